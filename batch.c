@@ -0,0 +1,551 @@
+/**
+ * @file batch.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Batches of small matrices, interleaved so that vector lanes run across the batch.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "batch.h"
+#include "cpu.h"
+#include "parallel.h"
+#include "trace.h"
+
+// Least number of flops worth handing to another thread.
+#define BATCH_PARALLEL_GRAIN (1 << 15)
+
+#define BATCH_SIZE_LIST(X) \
+    X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16)
+
+typedef void (*BatchGemm)(double *c, const double *a, const double *b, int m, int k, int n);
+typedef void (*BatchLu)(double *a, long long *piv, double *det, int n);
+typedef void (*BatchSolve)(const double *lu, const long long *piv, double *x, int n, int p);
+
+/**
+ * @brief Kernels on one group of BATCH_LANES matrices, built once per instruction set.
+ *
+ * Entry n is specialized for n x n matrices, gemm[0] multiplies any shapes. Pivots hold the
+ * pivot row of every step and lane, det the determinant of every lane.
+ */
+typedef struct
+{
+    CpuIsa isa;
+    BatchGemm gemm[BATCH_MAX_SIZE + 1];
+    BatchLu lu[BATCH_MAX_SIZE + 1];
+    BatchSolve solve[BATCH_MAX_SIZE + 1];
+} BatchKernels;
+
+// ===== Scalar reference =====
+
+#define LANE(p, i, l) ((p)[(i) * BATCH_LANES + (l)])
+
+// Row i of c is only stored once row i of a has been read, so c may be a.
+static void _gemm_scalar(double *c, const double *a, const double *b, int m, int k, int n)
+{
+    for (int i = 0; i < m; i++)
+    {
+        double acc[BATCH_MAX_SIZE][BATCH_LANES] = {{0}};
+        for (int p = 0; p < k; p++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                for (int l = 0; l < BATCH_LANES; l++)
+                {
+                    acc[j][l] += LANE(a, i * k + p, l) * LANE(b, p * n + j, l);
+                }
+            }
+        }
+        for (int j = 0; j < n; j++)
+        {
+            for (int l = 0; l < BATCH_LANES; l++)
+            {
+                LANE(c, i * n + j, l) = acc[j][l];
+            }
+        }
+    }
+}
+
+static void _lu_scalar(double *a, long long *piv, double *det, int n)
+{
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        double d = 1;
+        for (int k = 0; k < n; k++)
+        {
+            int p = k;
+            for (int r = k + 1; r < n; r++)
+            {
+                if (fabs(LANE(a, r * n + k, l)) > fabs(LANE(a, p * n + k, l)))
+                {
+                    p = r;
+                }
+            }
+            LANE(piv, k, l) = p;
+            if (p != k)
+            {
+                d = -d;
+                for (int j = 0; j < n; j++)
+                {
+                    double tmp = LANE(a, k * n + j, l);
+                    LANE(a, k * n + j, l) = LANE(a, p * n + j, l);
+                    LANE(a, p * n + j, l) = tmp;
+                }
+            }
+
+            double pivot = LANE(a, k * n + k, l);
+            for (int r = k + 1; r < n; r++)
+            {
+                double factor = LANE(a, r * n + k, l) / pivot;
+                LANE(a, r * n + k, l) = factor;
+                for (int j = k + 1; j < n; j++)
+                {
+                    LANE(a, r * n + j, l) -= factor * LANE(a, k * n + j, l);
+                }
+            }
+            d *= pivot;
+        }
+        det[l] = d;
+    }
+}
+
+static void _solve_scalar(const double *lu, const long long *piv, double *x, int n, int p)
+{
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        for (int k = 0; k < n; k++)
+        {
+            long long r = LANE(piv, k, l);
+            for (int j = 0; r != k && j < p; j++)
+            {
+                double tmp = LANE(x, k * p + j, l);
+                LANE(x, k * p + j, l) = LANE(x, r * p + j, l);
+                LANE(x, r * p + j, l) = tmp;
+            }
+        }
+        for (int i = 1; i < n; i++)
+        {
+            for (int k = 0; k < i; k++)
+            {
+                for (int j = 0; j < p; j++)
+                {
+                    LANE(x, i * p + j, l) -= LANE(lu, i * n + k, l) * LANE(x, k * p + j, l);
+                }
+            }
+        }
+        for (int i = n - 1; i >= 0; i--)
+        {
+            for (int k = i + 1; k < n; k++)
+            {
+                for (int j = 0; j < p; j++)
+                {
+                    LANE(x, i * p + j, l) -= LANE(lu, i * n + k, l) * LANE(x, k * p + j, l);
+                }
+            }
+            for (int j = 0; j < p; j++)
+            {
+                LANE(x, i * p + j, l) /= LANE(lu, i * n + i, l);
+            }
+        }
+    }
+}
+
+#undef LANE
+
+#define BATCH_SCALAR_GEMM(n) _gemm_scalar,
+#define BATCH_SCALAR_LU(n) _lu_scalar,
+#define BATCH_SCALAR_SOLVE(n) _solve_scalar,
+
+static const BatchKernels batch_kernels_scalar = {
+    CPU_ISA_SCALAR,
+    {_gemm_scalar, BATCH_SIZE_LIST(BATCH_SCALAR_GEMM)},
+    {_lu_scalar, BATCH_SIZE_LIST(BATCH_SCALAR_LU)},
+    {_solve_scalar, BATCH_SIZE_LIST(BATCH_SCALAR_SOLVE)},
+};
+
+// ===== Vector variants =====
+
+#ifdef CPU_DISPATCH
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#define BATCH_SUFFIX sse2
+#define BATCH_ISA CPU_ISA_SSE2
+#include "batch_template.h"
+#undef BATCH_SUFFIX
+#undef BATCH_ISA
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define BATCH_SUFFIX avx2
+#define BATCH_ISA CPU_ISA_AVX2
+#include "batch_template.h"
+#undef BATCH_SUFFIX
+#undef BATCH_ISA
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#define BATCH_SUFFIX avx512
+#define BATCH_ISA CPU_ISA_AVX512
+#include "batch_template.h"
+#undef BATCH_SUFFIX
+#undef BATCH_ISA
+#pragma GCC pop_options
+
+static const BatchKernels *variants[CPU_ISA_COUNT] = {
+    &batch_kernels_scalar, &batch_kernels_sse2, &batch_kernels_avx2, &batch_kernels_avx512};
+
+#else
+
+static const BatchKernels *variants[CPU_ISA_COUNT] = {&batch_kernels_scalar};
+
+#endif
+
+static const BatchKernels *_kernels(void)
+{
+    return variants[cpu_isa()];
+}
+
+// ===== Batches =====
+
+static double *_group(BatchMatrix *batch, long long g)
+{
+    return batch->data + g * batch->row * batch->col * BATCH_LANES;
+}
+
+BatchMatrix *bmat_alloc(long long count, long long row, long long col)
+{
+    if (count <= 0 || row <= 0 || col <= 0 || row > BATCH_MAX_SIZE || col > BATCH_MAX_SIZE)
+    {
+        fprintf(stderr,
+                "Batch Matrix Create Failed: Invalid batch of %lld matrices of size %lld x %lld, "
+                "sizes are limited to %d.\n",
+                count, row, col, BATCH_MAX_SIZE);
+        exit(1);
+    }
+
+    BatchMatrix *batch = malloc(sizeof(BatchMatrix));
+    if (batch == NULL)
+    {
+        fprintf(stderr, "Batch Matrix Create Failed: Can't allocate batch.\n");
+        exit(1);
+    }
+    batch->count = count;
+    batch->row = row;
+    batch->col = col;
+    batch->groups = (count + BATCH_LANES - 1) / BATCH_LANES;
+    batch->storage = mat_alloc(batch->groups, row * col * BATCH_LANES);
+    batch->data = batch->storage->data;
+    memset(batch->data, 0, batch->groups * row * col * BATCH_LANES * sizeof(double));
+
+    // Keep the padding matrices invertible, so that they never produce infinities.
+    for (long long b = count; row == col && b < batch->groups * BATCH_LANES; b++)
+    {
+        for (long long i = 0; i < row; i++)
+        {
+            bmat_at(batch, b, i, i) = 1;
+        }
+    }
+    return batch;
+}
+
+void bmat_free(BatchMatrix *batch)
+{
+    if (batch == NULL)
+    {
+        return;
+    }
+    mat_free(batch->storage);
+    free(batch);
+}
+
+BatchMatrix *bmat_fromArray(long long count, long long row, long long col, const double *src)
+{
+    BatchMatrix *batch = bmat_alloc(count, row, col);
+    for (long long b = 0; b < count; b++)
+    {
+        const double *mat = src + b * row * col;
+        for (long long i = 0; i < row; i++)
+        {
+            for (long long j = 0; j < col; j++)
+            {
+                bmat_at(batch, b, i, j) = mat[i * col + j];
+            }
+        }
+    }
+    return batch;
+}
+
+void bmat_toArray(BatchMatrix *batch, double *dst)
+{
+    for (long long b = 0; b < batch->count; b++)
+    {
+        double *mat = dst + b * batch->row * batch->col;
+        for (long long i = 0; i < batch->row; i++)
+        {
+            for (long long j = 0; j < batch->col; j++)
+            {
+                mat[i * batch->col + j] = bmat_at(batch, b, i, j);
+            }
+        }
+    }
+}
+
+static void _check_index(BatchMatrix *batch, long long b, const char *op)
+{
+    if (b < 0 || b >= batch->count)
+    {
+        fprintf(stderr, "Batch Matrix %s Failed: Index %lld out of a batch of %lld.\n", op, b, batch->count);
+        exit(1);
+    }
+}
+
+void bmat_set(BatchMatrix *batch, long long b, Matrix *mat)
+{
+    _check_index(batch, b, "Set");
+    if (mat->row != batch->row || mat->col != batch->col)
+    {
+        fprintf(stderr, "Batch Matrix Set Failed: Matrix should have size %lld x %lld, got %lld x %lld.\n",
+                batch->row, batch->col, mat->row, mat->col);
+        exit(1);
+    }
+    for (long long i = 0; i < mat->row; i++)
+    {
+        const double *x = mat_row(mat, i);
+        for (long long j = 0; j < mat->col; j++)
+        {
+            bmat_at(batch, b, i, j) = x[j];
+        }
+    }
+}
+
+Matrix *bmat_get(BatchMatrix *batch, long long b)
+{
+    _check_index(batch, b, "Get");
+    Matrix *mat = mat_alloc(batch->row, batch->col);
+    for (long long i = 0; i < mat->row; i++)
+    {
+        double *y = mat_row(mat, i);
+        for (long long j = 0; j < mat->col; j++)
+        {
+            y[j] = bmat_at(batch, b, i, j);
+        }
+    }
+    return mat;
+}
+
+typedef struct
+{
+    const BatchKernels *kern;
+    BatchMatrix *a;
+    BatchMatrix *b; // Right hand sides, NULL for the identity.
+    BatchMatrix *out;
+    long long *pivots;
+    double *det;
+} BatchArgs;
+
+static long long _grain(double flops_per_group)
+{
+    return (long long)(BATCH_PARALLEL_GRAIN / flops_per_group) + 1;
+}
+
+static void _multmat_groups(void *ctx, long long begin, long long end)
+{
+    BatchArgs *args = ctx;
+    int m = args->a->row, k = args->a->col, n = args->b->col;
+    BatchGemm gemm = args->kern->gemm[m == k && k == n ? n : 0];
+    for (long long g = begin; g < end; g++)
+    {
+        gemm(_group(args->out, g), _group(args->a, g), _group(args->b, g), m, k, n);
+    }
+}
+
+BatchMatrix *bmat_multmat(BatchMatrix *a, BatchMatrix *b, BatchMatrix *out)
+{
+    TRACE_BEGIN();
+    if (a->count != b->count || a->col != b->row)
+    {
+        fprintf(stderr,
+                "Batch Matrix Multiply Failed: "
+                "Cannot multiply %lld matrices of size %lld x %lld and %lld of size %lld x %lld.\n",
+                a->count, a->row, a->col, b->count, b->row, b->col);
+        exit(1);
+    }
+
+    if (out == NULL)
+    {
+        out = bmat_alloc(a->count, a->row, b->col);
+    }
+    else if (out->count != a->count || out->row != a->row || out->col != b->col || out == b)
+    {
+        fprintf(stderr,
+                "Batch Matrix Multiply Failed: "
+                "Output should be %lld matrices of size %lld x %lld other than the right operand.\n",
+                a->count, a->row, b->col);
+        exit(1);
+    }
+
+    BatchArgs args = {_kernels(), a, b, out, NULL, NULL};
+    double flops = 2.0 * a->row * a->col * b->col * BATCH_LANES;
+    par_for(a->groups, _grain(flops), _multmat_groups, &args);
+
+    TRACE_END("bmat_multmat", a->row, b->col, a->col,
+              a->count * (a->row * a->col + b->row * b->col + out->row * out->col) * sizeof(double),
+              2.0 * a->count * a->row * a->col * b->col);
+    return out;
+}
+
+static void _check_square(BatchMatrix *a, const char *op)
+{
+    if (a->row != a->col)
+    {
+        fprintf(stderr, "Batch Matrix %s Failed: Matrices should be square, got %lld x %lld.\n",
+                op, a->row, a->col);
+        exit(1);
+    }
+}
+
+static void _lu_groups(void *ctx, long long begin, long long end)
+{
+    BatchArgs *args = ctx;
+    BatchMatrix *a = args->a;
+    int n = a->row;
+    long long piv[BATCH_MAX_SIZE * BATCH_LANES];
+    double det[BATCH_LANES];
+    for (long long g = begin; g < end; g++)
+    {
+        args->kern->lu[n](_group(a, g), piv, det, n);
+        for (long long l = 0; args->pivots != NULL && l < BATCH_LANES && g * BATCH_LANES + l < a->count; l++)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                args->pivots[(g * BATCH_LANES + l) * n + k] = piv[k * BATCH_LANES + l];
+            }
+        }
+    }
+}
+
+void bmat_lu(BatchMatrix *a, long long *pivots)
+{
+    TRACE_BEGIN();
+    _check_square(a, "LU");
+    BatchArgs args = {_kernels(), a, NULL, NULL, pivots, NULL};
+    double n = a->row;
+    par_for(a->groups, _grain(2.0 / 3.0 * n * n * n * BATCH_LANES), _lu_groups, &args);
+    TRACE_END("bmat_lu", a->row, a->col, a->count, 2 * a->count * a->row * a->col * sizeof(double),
+              2.0 / 3.0 * n * n * n * a->count);
+}
+
+// Factor a copy of every group of a and solve against the right hand sides, or the identity.
+static void _solve_groups(void *ctx, long long begin, long long end)
+{
+    BatchArgs *args = ctx;
+    BatchMatrix *a = args->a;
+    int n = a->row, p = args->out->col;
+    double lu[BATCH_MAX_SIZE * BATCH_MAX_SIZE * BATCH_LANES];
+    long long piv[BATCH_MAX_SIZE * BATCH_LANES];
+    double det[BATCH_LANES];
+    size_t group_bytes = n * p * BATCH_LANES * sizeof(double);
+
+    for (long long g = begin; g < end; g++)
+    {
+        double *x = _group(args->out, g);
+        if (args->b != NULL)
+        {
+            memcpy(x, _group(args->b, g), group_bytes);
+        }
+        else
+        {
+            memset(x, 0, group_bytes);
+            for (int i = 0; i < n; i++)
+            {
+                for (int l = 0; l < BATCH_LANES; l++)
+                {
+                    x[(i * n + i) * BATCH_LANES + l] = 1;
+                }
+            }
+        }
+
+        memcpy(lu, _group(a, g), n * n * BATCH_LANES * sizeof(double));
+        args->kern->lu[n](lu, piv, det, n);
+        args->kern->solve[n](lu, piv, x, n, p);
+    }
+}
+
+BatchMatrix *bmat_solve(BatchMatrix *a, BatchMatrix *b)
+{
+    TRACE_BEGIN();
+    _check_square(a, "Solve");
+    if (a->count != b->count || b->row != a->row)
+    {
+        fprintf(stderr,
+                "Batch Matrix Solve Failed: "
+                "Right hand sides should be %lld matrices with %lld rows, got %lld with %lld.\n",
+                a->count, a->row, b->count, b->row);
+        exit(1);
+    }
+
+    BatchMatrix *x = bmat_alloc(b->count, b->row, b->col);
+    BatchArgs args = {_kernels(), a, b, x, NULL, NULL};
+    double n = a->row;
+    double flops = (2.0 / 3.0 * n + 2.0 * b->col) * n * n;
+    par_for(a->groups, _grain(flops * BATCH_LANES), _solve_groups, &args);
+
+    TRACE_END("bmat_solve", a->row, b->col, a->count,
+              a->count * (a->row * a->col + 2 * b->row * b->col) * sizeof(double), flops * a->count);
+    return x;
+}
+
+BatchMatrix *bmat_inv(BatchMatrix *a)
+{
+    TRACE_BEGIN();
+    _check_square(a, "Inverse");
+    BatchMatrix *x = bmat_alloc(a->count, a->row, a->col);
+    BatchArgs args = {_kernels(), a, NULL, x, NULL, NULL};
+    double n = a->row;
+    double flops = 8.0 / 3.0 * n * n * n;
+    par_for(a->groups, _grain(flops * BATCH_LANES), _solve_groups, &args);
+
+    TRACE_END("bmat_inv", a->row, a->col, a->count, 2 * a->count * a->row * a->col * sizeof(double),
+              flops * a->count);
+    return x;
+}
+
+static void _det_groups(void *ctx, long long begin, long long end)
+{
+    BatchArgs *args = ctx;
+    BatchMatrix *a = args->a;
+    int n = a->row;
+    double lu[BATCH_MAX_SIZE * BATCH_MAX_SIZE * BATCH_LANES];
+    long long piv[BATCH_MAX_SIZE * BATCH_LANES];
+    double det[BATCH_LANES];
+    for (long long g = begin; g < end; g++)
+    {
+        memcpy(lu, _group(a, g), n * n * BATCH_LANES * sizeof(double));
+        args->kern->lu[n](lu, piv, det, n);
+        for (long long l = 0; l < BATCH_LANES && g * BATCH_LANES + l < a->count; l++)
+        {
+            args->det[g * BATCH_LANES + l] = det[l];
+        }
+    }
+}
+
+void bmat_det(BatchMatrix *a, double *det)
+{
+    TRACE_BEGIN();
+    _check_square(a, "Determinant");
+    BatchArgs args = {_kernels(), a, NULL, NULL, NULL, det};
+    double n = a->row;
+    par_for(a->groups, _grain(2.0 / 3.0 * n * n * n * BATCH_LANES), _det_groups, &args);
+    TRACE_END("bmat_det", a->row, a->col, a->count, a->count * a->row * a->col * sizeof(double),
+              2.0 / 3.0 * n * n * n * a->count);
+}
@@ -0,0 +1,150 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "linalg.h"
+
+/**
+ * @brief Number of matrices interleaved in a batch, the vector width of its kernels.
+ *
+ */
+#define BATCH_LANES 8
+
+/**
+ * @brief Largest row or column size of a batched matrix.
+ *
+ */
+#define BATCH_MAX_SIZE 16
+
+/**
+ * @brief A batch of count small matrices of the same size.
+ *
+ * Matrices are interleaved in groups of BATCH_LANES: element (i, j) of the matrices of a
+ * group is stored contiguously, so that the kernels process one element of BATCH_LANES
+ * matrices per vector instruction. Use bmat_at to address single elements. bmat_alloc
+ * fills the padding matrices of the last group with the identity when matrices are square.
+ */
+typedef struct
+{
+    long long count;
+    long long row;
+    long long col;
+    long long groups; // Number of groups of BATCH_LANES matrices.
+    double *data;
+    Matrix *storage;
+} BatchMatrix;
+
+/**
+ * @brief Element (i, j) of matrix b of a batch, as an lvalue.
+ *
+ */
+#define bmat_at(batch, b, i, j)                                                        \
+    ((batch)->data[((b) / BATCH_LANES * (batch)->row * (batch)->col + (i) * (batch)->col + (j)) * \
+                       BATCH_LANES + (b) % BATCH_LANES])
+
+/**
+ * @brief Allocate a batch of zero matrices.
+ *
+ * @param count Number of matrices.
+ * @param row Row size of every matrix, at most BATCH_MAX_SIZE.
+ * @param col Column size of every matrix, at most BATCH_MAX_SIZE.
+ * @return BatchMatrix*
+ */
+BatchMatrix *bmat_alloc(long long count, long long row, long long col);
+
+/**
+ * @brief Free a batch.
+ *
+ * @param batch Batch, may be NULL.
+ */
+void bmat_free(BatchMatrix *batch);
+
+/**
+ * @brief Create a batch from matrices stored back to back in row major order.
+ *
+ * @param count Number of matrices.
+ * @param row Row size of every matrix.
+ * @param col Column size of every matrix.
+ * @param src Array of count * row * col elements.
+ * @return BatchMatrix*
+ */
+BatchMatrix *bmat_fromArray(long long count, long long row, long long col, const double *src);
+
+/**
+ * @brief Copy the matrices of a batch back to back in row major order.
+ *
+ * @param batch Batch.
+ * @param dst Array of count * row * col elements.
+ */
+void bmat_toArray(BatchMatrix *batch, double *dst);
+
+/**
+ * @brief Overwrite matrix b of a batch.
+ *
+ * @param batch Batch.
+ * @param b Index of the matrix.
+ * @param mat Matrix of the batch's size.
+ */
+void bmat_set(BatchMatrix *batch, long long b, Matrix *mat);
+
+/**
+ * @brief Copy matrix b of a batch.
+ *
+ * @param batch Batch.
+ * @param b Index of the matrix.
+ * @return Matrix*
+ */
+Matrix *bmat_get(BatchMatrix *batch, long long b);
+
+/**
+ * @brief Multiply every matrix of a batch by the matching matrix of another.
+ *
+ * Square sizes run fully unrolled kernels, other shapes a generic one.
+ *
+ * @param a Batch of m x k matrices.
+ * @param b Batch of k x n matrices, of the same count.
+ * @param out Batch of m x n matrices, or NULL to allocate one. May be a, must not be b.
+ * @return BatchMatrix*
+ */
+BatchMatrix *bmat_multmat(BatchMatrix *a, BatchMatrix *b, BatchMatrix *out);
+
+/**
+ * @brief LU decomposition with partial pivoting of every matrix of a batch, in place.
+ *
+ * Every matrix A is overwritten by L and U of P * A = L * U, the unit diagonal of L is not
+ * stored. Rows are swapped in LAPACK order: row k with row pivots[b * n + k] of matrix b.
+ *
+ * @param a Batch of n x n matrices.
+ * @param pivots Array of count * n pivot rows, or NULL.
+ */
+void bmat_lu(BatchMatrix *a, long long *pivots);
+
+/**
+ * @brief Solve A * X = B for every pair of matrices of two batches.
+ *
+ * Singular matrices give non-finite solutions, without affecting the rest of the batch.
+ *
+ * @param a Batch of n x n matrices.
+ * @param b Batch of n x p matrices, of the same count.
+ * @return BatchMatrix* Batch of n x p solutions.
+ */
+BatchMatrix *bmat_solve(BatchMatrix *a, BatchMatrix *b);
+
+/**
+ * @brief Inverse of every matrix of a batch.
+ *
+ * Singular matrices give non-finite inverses, without affecting the rest of the batch.
+ *
+ * @param a Batch of n x n matrices.
+ * @return BatchMatrix*
+ */
+BatchMatrix *bmat_inv(BatchMatrix *a);
+
+/**
+ * @brief Determinant of every matrix of a batch, from its LU decomposition.
+ *
+ * @param a Batch of n x n matrices.
+ * @param det Array of count determinants.
+ */
+void bmat_det(BatchMatrix *a, double *det);
+
+#endif
@@ -0,0 +1,256 @@
+/**
+ * @file batch_template.h
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Batched small matrix kernels, included by batch.c once per instruction set.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+// No include guard: batch.c defines BATCH_SUFFIX and BATCH_ISA, and puts the matching
+// target pragma in effect before every inclusion.
+//
+// Every kernel works on one group of BATCH_LANES interleaved matrices, so that a vector
+// holds the same element of all of them. The bodies are inlined into one wrapper per size,
+// where the constant size lets the compiler unroll the inner loops completely, and the
+// GEMM keeps a whole row of the product in registers.
+
+#define BATCH_CAT_(a, b) a##_##b
+#define BATCH_CAT(a, b) BATCH_CAT_(a, b)
+#define BATCH_FN(name) BATCH_CAT(name, BATCH_SUFFIX)
+#define BV BATCH_FN(bvec)
+#define BVI BATCH_FN(bveci)
+#define BLOAD(p, i) (*(const BV *)((p) + (i) * BATCH_LANES))
+#define BSTORE(p, i, v) (*(BV *)((p) + (i) * BATCH_LANES) = (v))
+#define BSPLAT(x) ((BV){0} + (x))
+#define BSPLATI(x) ((BVI){0} + (x))
+#define BSELECT(mask, x, y) ((BV)(((mask) & (BVI)(x)) | (~(mask) & (BVI)(y))))
+#define BABS(x) ((BV)((BVI)(x) & BSPLATI(0x7fffffffffffffffLL)))
+#define BATCH_INLINE static inline __attribute__((always_inline))
+
+// Vectors of BATCH_LANES doubles, and the matching comparison masks. They are only passed
+// by pointer, their by value ABI depends on the instruction set.
+typedef double BV __attribute__((vector_size(BATCH_LANES * sizeof(double)), aligned(sizeof(double))));
+typedef long long BVI __attribute__((vector_size(BATCH_LANES * sizeof(long long)), aligned(sizeof(long long))));
+
+BATCH_INLINE bool BATCH_FN(_any)(const BVI *mask)
+{
+    long long any = 0;
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        any |= (*mask)[l];
+    }
+    return any != 0;
+}
+
+// c = a * b for n x n matrices, with row i of c in registers while the rows of b stream past.
+BATCH_INLINE void BATCH_FN(_gemm_body)(double *c, const double *a, const double *b, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        BV acc[BATCH_MAX_SIZE];
+#pragma GCC unroll 16
+        for (int j = 0; j < n; j++)
+        {
+            acc[j] = BSPLAT(0.0);
+        }
+#pragma GCC unroll 16
+        for (int p = 0; p < n; p++)
+        {
+            BV a_ip = BLOAD(a, i * n + p);
+#pragma GCC unroll 16
+            for (int j = 0; j < n; j++)
+            {
+                acc[j] += a_ip * BLOAD(b, p * n + j);
+            }
+        }
+#pragma GCC unroll 16
+        for (int j = 0; j < n; j++)
+        {
+            BSTORE(c, i * n + j, acc[j]);
+        }
+    }
+}
+
+// Swap rows k and r of an n column matrix in the lanes where swap is set.
+BATCH_INLINE void BATCH_FN(_swap_rows)(double *a, int n, int k, int r, const BVI *swap)
+{
+    for (int j = 0; j < n; j++)
+    {
+        BV x = BLOAD(a, k * n + j), y = BLOAD(a, r * n + j);
+        BSTORE(a, k * n + j, BSELECT(*swap, y, x));
+        BSTORE(a, r * n + j, BSELECT(*swap, x, y));
+    }
+}
+
+// In place LU decomposition with partial pivoting, every lane picks its own pivots.
+BATCH_INLINE void BATCH_FN(_lu_body)(double *a, long long *piv, double *det, int n)
+{
+    BV sign = BSPLAT(1.0);
+    for (int k = 0; k < n; k++)
+    {
+        BV best = BABS(BLOAD(a, k * n + k));
+        BVI p = BSPLATI(k);
+        for (int r = k + 1; r < n; r++)
+        {
+            BV v = BABS(BLOAD(a, r * n + k));
+            BVI larger = v > best;
+            best = BSELECT(larger, v, best);
+            p = (larger & BSPLATI(r)) | (~larger & p);
+        }
+        *(BVI *)(piv + k * BATCH_LANES) = p;
+        sign = BSELECT(p != BSPLATI(k), -sign, sign);
+
+        for (int r = k + 1; r < n; r++)
+        {
+            BVI swap = p == BSPLATI(r);
+            if (BATCH_FN(_any)(&swap))
+            {
+                BATCH_FN(_swap_rows)(a, n, k, r, &swap);
+            }
+        }
+
+        BV inv = 1.0 / BLOAD(a, k * n + k);
+        for (int r = k + 1; r < n; r++)
+        {
+            BV l = BLOAD(a, r * n + k) * inv;
+            BSTORE(a, r * n + k, l);
+            for (int j = k + 1; j < n; j++)
+            {
+                BSTORE(a, r * n + j, BLOAD(a, r * n + j) - l * BLOAD(a, k * n + j));
+            }
+        }
+    }
+
+    BV d = sign;
+    for (int k = 0; k < n; k++)
+    {
+        d *= BLOAD(a, k * n + k);
+    }
+    BSTORE(det, 0, d);
+}
+
+// Overwrite the n x p matrices x by the solutions of A * X = x, given the LU decomposition.
+BATCH_INLINE void BATCH_FN(_solve_body)(const double *lu, const long long *piv, double *x, int n, int p)
+{
+    for (int k = 0; k < n; k++)
+    {
+        BVI row = *(const BVI *)(piv + k * BATCH_LANES);
+        for (int r = k + 1; r < n; r++)
+        {
+            BVI swap = row == BSPLATI(r);
+            if (BATCH_FN(_any)(&swap))
+            {
+                BATCH_FN(_swap_rows)(x, p, k, r, &swap);
+            }
+        }
+    }
+
+    // L * Y = P * B, L has a unit diagonal.
+    for (int i = 1; i < n; i++)
+    {
+        for (int k = 0; k < i; k++)
+        {
+            BV l = BLOAD(lu, i * n + k);
+            for (int j = 0; j < p; j++)
+            {
+                BSTORE(x, i * p + j, BLOAD(x, i * p + j) - l * BLOAD(x, k * p + j));
+            }
+        }
+    }
+
+    // U * X = Y.
+    for (int i = n - 1; i >= 0; i--)
+    {
+        for (int k = i + 1; k < n; k++)
+        {
+            BV u = BLOAD(lu, i * n + k);
+            for (int j = 0; j < p; j++)
+            {
+                BSTORE(x, i * p + j, BLOAD(x, i * p + j) - u * BLOAD(x, k * p + j));
+            }
+        }
+        BV inv = 1.0 / BLOAD(lu, i * n + i);
+        for (int j = 0; j < p; j++)
+        {
+            BSTORE(x, i * p + j, BLOAD(x, i * p + j) * inv);
+        }
+    }
+}
+
+// c = a * b for m x k matrices a and k x n matrices b of any size. Row i of c is only
+// stored once row i of a has been read, so c may be a.
+static void BATCH_FN(_gemm)(double *c, const double *a, const double *b, int m, int k, int n)
+{
+    for (int i = 0; i < m; i++)
+    {
+        BV acc[BATCH_MAX_SIZE];
+        for (int j = 0; j < n; j++)
+        {
+            acc[j] = BSPLAT(0.0);
+        }
+        for (int p = 0; p < k; p++)
+        {
+            BV a_ip = BLOAD(a, i * k + p);
+            for (int j = 0; j < n; j++)
+            {
+                acc[j] += a_ip * BLOAD(b, p * n + j);
+            }
+        }
+        for (int j = 0; j < n; j++)
+        {
+            BSTORE(c, i * n + j, acc[j]);
+        }
+    }
+}
+
+// One kernel per size, the size arguments are ignored in favour of the constant.
+#define BATCH_SPECIALIZE(n)                                                                        \
+    static void BATCH_FN(_gemm_##n)(double *c, const double *a, const double *b, int m, int k, int n_) \
+    {                                                                                              \
+        (void)m;                                                                                   \
+        (void)k;                                                                                   \
+        (void)n_;                                                                                  \
+        BATCH_FN(_gemm_body)(c, a, b, n);                                                          \
+    }                                                                                              \
+    static void BATCH_FN(_lu_##n)(double *a, long long *piv, double *det, int n_)                  \
+    {                                                                                              \
+        (void)n_;                                                                                  \
+        BATCH_FN(_lu_body)(a, piv, det, n);                                                        \
+    }                                                                                              \
+    static void BATCH_FN(_solve_##n)(const double *lu, const long long *piv, double *x, int n_, int p) \
+    {                                                                                              \
+        (void)n_;                                                                                  \
+        BATCH_FN(_solve_body)(lu, piv, x, n, p);                                                   \
+    }
+BATCH_SIZE_LIST(BATCH_SPECIALIZE)
+
+#define BATCH_GEMM_ENTRY(n) BATCH_FN(_gemm_##n),
+#define BATCH_LU_ENTRY(n) BATCH_FN(_lu_##n),
+#define BATCH_SOLVE_ENTRY(n) BATCH_FN(_solve_##n),
+
+static const BatchKernels BATCH_FN(batch_kernels) = {
+    BATCH_ISA,
+    {BATCH_FN(_gemm), BATCH_SIZE_LIST(BATCH_GEMM_ENTRY)},
+    {NULL, BATCH_SIZE_LIST(BATCH_LU_ENTRY)},
+    {NULL, BATCH_SIZE_LIST(BATCH_SOLVE_ENTRY)},
+};
+
+#undef BATCH_CAT_
+#undef BATCH_CAT
+#undef BATCH_FN
+#undef BV
+#undef BVI
+#undef BLOAD
+#undef BSTORE
+#undef BSPLAT
+#undef BSPLATI
+#undef BSELECT
+#undef BABS
+#undef BATCH_INLINE
+#undef BATCH_SPECIALIZE
+#undef BATCH_GEMM_ENTRY
+#undef BATCH_LU_ENTRY
+#undef BATCH_SOLVE_ENTRY
@@ -0,0 +1,856 @@
+/**
+ * @file bench.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Micro-benchmarks of linalg, xlinalg and nn.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "linalg.h"
+#include "xlinalg.h"
+#include "nn.h"
+#include "sparse.h"
+#include "batch.h"
+
+/**
+ * @brief One benchmark case. run is called once per repetition with ctx.
+ *
+ */
+typedef struct
+{
+    const char *group;
+    char name[64];
+    char shape[64];
+    double flops; // Per repetition, 0 if not meaningful.
+    double bytes; // Bytes read and written per repetition.
+    void (*run)(void *ctx);
+    void *ctx;
+} Bench;
+
+typedef struct
+{
+    Bench bench;
+    long long reps;
+    double median;
+    double p95;
+    double min;
+} BenchResult;
+
+typedef struct
+{
+    Matrix *a;
+    Matrix *b;
+    long long n;
+} MatArgs;
+
+typedef struct
+{
+    SparseMatrix *sp;
+    Matrix *b;
+} SparseArgs;
+
+typedef struct
+{
+    BatchMatrix *a;
+    BatchMatrix *out;
+    Matrix **mats; // The matrices of a, one by one.
+} BatchArgs;
+
+typedef struct
+{
+    Matrix *a; // batch products of n x n matrices, stacked by rows.
+    Matrix *b;
+    Matrix *c;
+    long long n;
+    long long batch;
+} BatchedArgs;
+
+typedef struct
+{
+    NN *nn;
+    double *input;
+    Matrix *target;
+    Matrix *output;
+    NNContext *context; // Holds a batch of samples.
+    Matrix *batch;
+} NNArgs;
+
+static int warmup = 2;
+static int reps = 10;
+static const char *filter = NULL;
+static double sink = 0; // Keeps results alive so calls are not optimized away.
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void _release(Matrix *mat)
+{
+    sink += mat->data[0];
+    mat_free(mat);
+}
+
+static int _cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static BenchResult _measure(Bench bench)
+{
+    for (int i = 0; i < warmup; i++)
+    {
+        bench.run(bench.ctx);
+    }
+
+    double *times = malloc(reps * sizeof(double));
+    for (int i = 0; i < reps; i++)
+    {
+        double start = _now();
+        bench.run(bench.ctx);
+        times[i] = _now() - start;
+    }
+    qsort(times, reps, sizeof(double), _cmp_double);
+
+    BenchResult result;
+    result.bench = bench;
+    result.reps = reps;
+    result.min = times[0];
+    result.median = reps % 2 ? times[reps / 2] : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+    result.p95 = times[(long long)(0.95 * (reps - 1) + 0.5)];
+
+    free(times);
+    return result;
+}
+
+// ===== Benchmark bodies =====
+
+static void _run_multmat(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(mat_multmat(args->a, args->b));
+}
+
+static void _run_multmat_padded(void *ctx)
+{
+    MatArgs *args = ctx;
+    Matrix *out = mat_allocPadded(args->a->row, args->b->col);
+    _release(mat_multmatFused(args->a, args->b, NULL, MAT_EPI_NONE, out));
+}
+
+static void _run_transpose(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(mat_transpose(args->a));
+}
+
+static void _run_transposeInPlace(void *ctx)
+{
+    MatArgs *args = ctx;
+    mat_transposeInPlace(args->a);
+    sink += args->a->data[0];
+}
+
+static void _run_addscal(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(mat_addscal(args->a, 1.0));
+}
+
+static void _run_multscal(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(mat_multscal(args->a, 2.0));
+}
+
+static void _run_addmat(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(mat_addmat(args->a, args->b));
+}
+
+static void _run_pwpmat(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(mat_pwpmat(args->a, args->b));
+}
+
+static void _run_elemSum(void *ctx)
+{
+    MatArgs *args = ctx;
+    sink += mat_elemSum(args->a);
+}
+
+static void _run_mean(void *ctx)
+{
+    MatArgs *args = ctx;
+    sink += xmat_mean(args->a);
+}
+
+static void _run_solve(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(xmat_solve(args->a, args->b));
+}
+
+static void _run_cg(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(xmat_cg(args->a, args->b, NULL, 1e-10, args->a->row, NULL));
+}
+
+static void _run_lstsq(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(xmat_lstsq(args->a, args->b));
+}
+
+static void _run_svd(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(xmat_svd(args->a, args->n, 2, NULL, NULL));
+}
+
+static void _run_inv(void *ctx)
+{
+    MatArgs *args = ctx;
+    _release(xmat_inv(args->a));
+}
+
+static void _run_det(void *ctx)
+{
+    MatArgs *args = ctx;
+    sink += xmat_det(args->a);
+}
+
+static void _run_isSymm(void *ctx)
+{
+    MatArgs *args = ctx;
+    sink += xmat_isSymm(args->a);
+}
+
+static void _run_isOrth(void *ctx)
+{
+    MatArgs *args = ctx;
+    sink += xmat_isOrthTol(args->a, 1e-12);
+}
+
+static void _run_spmm(void *ctx)
+{
+    SparseArgs *args = ctx;
+    _release(spmat_multmat(args->sp, args->b));
+}
+
+static void _run_bmat_multmat(void *ctx)
+{
+    BatchArgs *args = ctx;
+    bmat_multmat(args->a, args->a, args->out);
+    sink += args->out->data[0];
+}
+
+static void _run_bmat_inv(void *ctx)
+{
+    BatchArgs *args = ctx;
+    BatchMatrix *inv = bmat_inv(args->a);
+    sink += inv->data[0];
+    bmat_free(inv);
+}
+
+static void _run_loop_multmat(void *ctx)
+{
+    BatchArgs *args = ctx;
+    for (long long b = 0; b < args->a->count; b++)
+    {
+        _release(mat_multmat(args->mats[b], args->mats[b]));
+    }
+}
+
+static void _run_loop_inv(void *ctx)
+{
+    BatchArgs *args = ctx;
+    for (long long b = 0; b < args->a->count; b++)
+    {
+        _release(xmat_inv(args->mats[b]));
+    }
+}
+
+static void _run_multmatBatched(void *ctx)
+{
+    BatchedArgs *args = ctx;
+    long long n = args->n;
+    mat_multmatBatched(args->a->data, n, n * n, args->b->data, n, n * n, args->c->data, n, n * n,
+                       n, n, n, args->batch);
+    sink += args->c->data[0];
+}
+
+static void _run_loop_multmatBatched(void *ctx)
+{
+    BatchedArgs *args = ctx;
+    long long n = args->n;
+    for (long long p = 0; p < args->batch; p++)
+    {
+        Matrix *a = mat_createStrided(n, n, n, args->a->data + p * n * n);
+        Matrix *b = mat_createStrided(n, n, n, args->b->data + p * n * n);
+        _release(mat_multmat(a, b));
+        mat_free(a);
+        mat_free(b);
+    }
+}
+
+static void _run_forward(void *ctx)
+{
+    NNArgs *args = ctx;
+    _release(nn_forward(args->nn, args->input, args->nn->input_size));
+}
+
+static void _run_forwardBatch(void *ctx)
+{
+    NNArgs *args = ctx;
+    sink += nn_forwardBatch(args->context, args->batch)->data[0];
+}
+
+static void _run_backward(void *ctx)
+{
+    NNArgs *args = ctx;
+    nn_backward(args->nn, args->target, args->output, 1e-6);
+}
+
+// ===== Benchmark cases =====
+
+/**
+ * @brief Diagonally dominant random matrix, so elimination without pivoting is stable.
+ */
+static Matrix *_dominant(long long n)
+{
+    Matrix *mat = xmat_rand(n, n);
+    for (long long i = 0; i < n; i++)
+    {
+        mat_row(mat, i)[i] += n;
+    }
+    return mat;
+}
+
+/**
+ * @brief Symmetric diagonally dominant random matrix, positive definite.
+ */
+static Matrix *_spd(long long n)
+{
+    Matrix *mat = _dominant(n);
+    for (long long i = 0; i < n; i++)
+    {
+        for (long long j = 0; j < i; j++)
+        {
+            mat_row(mat, i)[j] = mat_row(mat, j)[i];
+        }
+    }
+    return mat;
+}
+
+/**
+ * @brief Copy of a matrix with padded rows.
+ */
+static Matrix *_padded(Matrix *mat)
+{
+    Matrix *padded = mat_allocPadded(mat->row, mat->col);
+    for (long long i = 0; i < mat->row; i++)
+    {
+        memcpy(mat_row(padded, i), mat_row(mat, i), mat->col * sizeof(double));
+    }
+    mat_free(mat);
+    return padded;
+}
+
+static MatArgs *_mat_args(Matrix *a, Matrix *b)
+{
+    MatArgs *args = malloc(sizeof(MatArgs));
+    args->a = a;
+    args->b = b;
+    args->n = a->row * a->col;
+    return args;
+}
+
+static long long _add_multmat(Bench *benches, long long count)
+{
+    long long shapes[][3] = {
+        {64, 64, 64},
+        {256, 256, 256},
+        {512, 512, 512},
+        {1, 1024, 1024},
+        {1024, 1024, 1},
+        {2048, 64, 64},
+        {64, 2048, 64},
+    };
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+    {
+        long long m = shapes[s][0], k = shapes[s][1], n = shapes[s][2];
+        Bench *bench = &benches[count++];
+        bench->group = "linalg";
+        snprintf(bench->name, sizeof(bench->name), "mat_multmat");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld * %lldx%lld", m, k, k, n);
+        bench->flops = 2.0 * m * n * k;
+        bench->bytes = (m * k + k * n + m * n) * sizeof(double);
+        bench->run = _run_multmat;
+        bench->ctx = _mat_args(xmat_rand(m, k), xmat_rand(k, n));
+    }
+
+    // Power of two leading dimensions, packed above and padded here.
+    for (long long n = 512; n <= 1024; n *= 2)
+    {
+        Bench *bench = &benches[count++];
+        bench->group = "linalg";
+        snprintf(bench->name, sizeof(bench->name), "mat_multmat");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld * %lldx%lld padded", n, n, n, n);
+        bench->flops = 2.0 * n * n * n;
+        bench->bytes = 3 * n * n * sizeof(double);
+        bench->run = _run_multmat_padded;
+        bench->ctx = _mat_args(_padded(xmat_rand(n, n)), _padded(xmat_rand(n, n)));
+    }
+    return count;
+}
+
+static long long _add_elementwise(Bench *benches, long long count)
+{
+    long long shapes[][2] = {{1024, 1024}, {4096, 256}, {1, 1 << 20}};
+    struct
+    {
+        const char *name;
+        void (*run)(void *);
+        int inputs;
+        double flops_per_elem;
+    } ops[] = {
+        {"mat_transpose", _run_transpose, 1, 0},
+        {"mat_addscal", _run_addscal, 1, 1},
+        {"mat_multscal", _run_multscal, 1, 1},
+        {"mat_addmat", _run_addmat, 2, 1},
+        {"mat_pwpmat", _run_pwpmat, 2, 1},
+        {"mat_elemSum", _run_elemSum, 1, 1},
+        {"xmat_mean", _run_mean, 1, 1},
+    };
+
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+    {
+        long long r = shapes[s][0], c = shapes[s][1];
+        Matrix *a = xmat_rand(r, c);
+        Matrix *b = xmat_rand(r, c);
+
+        for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++)
+        {
+            // Reductions only read, everything else also writes one output.
+            int reduction = ops[o].run == _run_elemSum || ops[o].run == _run_mean;
+            Bench *bench = &benches[count++];
+            bench->group = ops[o].run == _run_mean ? "xlinalg" : "linalg";
+            snprintf(bench->name, sizeof(bench->name), "%s", ops[o].name);
+            snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld", r, c);
+            bench->flops = ops[o].flops_per_elem * r * c;
+            bench->bytes = (double)(ops[o].inputs + (reduction ? 0 : 1)) * r * c * sizeof(double);
+            bench->run = ops[o].run;
+            bench->ctx = _mat_args(a, b);
+        }
+    }
+
+    // In place transposes only run on square matrices.
+    for (long long n = 1024; n <= 4096; n *= 4)
+    {
+        Bench *bench = &benches[count++];
+        bench->group = "linalg";
+        snprintf(bench->name, sizeof(bench->name), "mat_transposeInPlace");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld", n, n);
+        bench->flops = 0;
+        bench->bytes = 2.0 * n * n * sizeof(double);
+        bench->run = _run_transposeInPlace;
+        bench->ctx = _mat_args(xmat_rand(n, n), NULL);
+    }
+    return count;
+}
+
+/**
+ * @brief Sparse matrix with the given fraction of nonzeros at random positions.
+ */
+static SparseMatrix *_sparse_rand(long long row, long long col, double density)
+{
+    Matrix *dense = xmat_rand(row, col);
+    for (long long i = 0; i < row; i++)
+    {
+        double *x = mat_row(dense, i);
+        for (long long j = 0; j < col; j++)
+        {
+            x[j] = (double)rand() / RAND_MAX < density ? x[j] : 0;
+        }
+    }
+    SparseMatrix *sp = spmat_fromDense(dense);
+    mat_free(dense);
+    return sp;
+}
+
+static long long _add_sparse(Bench *benches, long long count)
+{
+    // Bag-of-words like batches against a dense layer.
+    double densities[] = {0.001, 0.01, 0.1};
+    long long m = 256, k = 16384, n = 256;
+    Matrix *b = xmat_rand(k, n);
+    for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++)
+    {
+        SparseArgs *args = malloc(sizeof(SparseArgs));
+        args->sp = _sparse_rand(m, k, densities[d]);
+        args->b = b;
+
+        Bench *bench = &benches[count++];
+        bench->group = "sparse";
+        snprintf(bench->name, sizeof(bench->name), "spmat_multmat");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld@%g * %lldx%lld", m, k, densities[d], k, n);
+        bench->flops = 2.0 * args->sp->nnz * n;
+        bench->bytes = (args->sp->nnz * (n + 2) + m * n) * sizeof(double);
+        bench->run = _run_spmm;
+        bench->ctx = args;
+    }
+    return count;
+}
+
+static long long _add_batch(Bench *benches, long long count)
+{
+    // Many tiny matrices, batched against one call per matrix.
+    long long sizes[] = {4, 16};
+    long long batch_count = 16384;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        long long n = sizes[s];
+        BatchArgs *args = malloc(sizeof(BatchArgs));
+        args->a = bmat_alloc(batch_count, n, n);
+        args->out = bmat_alloc(batch_count, n, n);
+        args->mats = malloc(batch_count * sizeof(Matrix *));
+        for (long long b = 0; b < batch_count; b++)
+        {
+            args->mats[b] = _dominant(n);
+            bmat_set(args->a, b, args->mats[b]);
+        }
+
+        const char *names[] = {"bmat_multmat", "mat_multmat loop", "bmat_inv", "xmat_inv loop"};
+        void (*runs[])(void *) = {_run_bmat_multmat, _run_loop_multmat, _run_bmat_inv, _run_loop_inv};
+        for (int r = 0; r < 4; r++)
+        {
+            Bench *bench = &benches[count++];
+            bench->group = "batch";
+            snprintf(bench->name, sizeof(bench->name), "%s", names[r]);
+            snprintf(bench->shape, sizeof(bench->shape), "%lld x %lldx%lld", batch_count, n, n);
+            bench->flops = (r < 2 ? 2.0 : 8.0 / 3.0) * n * n * n * batch_count;
+            bench->bytes = (r < 2 ? 3.0 : 2.0) * n * n * batch_count * sizeof(double);
+            bench->run = runs[r];
+            bench->ctx = args;
+        }
+    }
+
+    // Many medium products, such as per-head projections, into one output block.
+    BatchedArgs *args = malloc(sizeof(BatchedArgs));
+    args->n = 128;
+    args->batch = 64;
+    args->a = xmat_rand(args->batch * args->n, args->n);
+    args->b = xmat_rand(args->batch * args->n, args->n);
+    args->c = mat_alloc(args->batch * args->n, args->n);
+    const char *names[] = {"mat_multmatBatched", "mat_multmat loop"};
+    void (*runs[])(void *) = {_run_multmatBatched, _run_loop_multmatBatched};
+    for (int r = 0; r < 2; r++)
+    {
+        Bench *bench = &benches[count++];
+        bench->group = "batch";
+        snprintf(bench->name, sizeof(bench->name), "%s", names[r]);
+        snprintf(bench->shape, sizeof(bench->shape), "%lld x %lldx%lld", args->batch, args->n, args->n);
+        bench->flops = 2.0 * args->batch * args->n * args->n * args->n;
+        bench->bytes = 3.0 * args->batch * args->n * args->n * sizeof(double);
+        bench->run = runs[r];
+        bench->ctx = args;
+    }
+    return count;
+}
+
+static long long _add_xlinalg(Bench *benches, long long count)
+{
+    long long solve_sizes[] = {16, 64, 128, 256};
+    for (size_t s = 0; s < sizeof(solve_sizes) / sizeof(solve_sizes[0]); s++)
+    {
+        long long n = solve_sizes[s];
+
+        Bench *bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_solve");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld, %lldx1", n, n, n);
+        bench->flops = 2.0 / 3.0 * n * n * n;
+        bench->bytes = (n * n + 2 * n) * sizeof(double);
+        bench->run = _run_solve;
+        bench->ctx = _mat_args(_dominant(n), xmat_rand(n, 1));
+
+        bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_cg");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld, %lldx1", n, n, n);
+        bench->flops = 0; // Depends on the iteration count.
+        bench->bytes = (n * n + 2 * n) * sizeof(double);
+        bench->run = _run_cg;
+        bench->ctx = _mat_args(_spd(n), xmat_rand(n, 1));
+
+        bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_inv");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld", n, n);
+        bench->flops = 2.0 * n * n * n;
+        bench->bytes = 2.0 * n * n * sizeof(double);
+        bench->run = _run_inv;
+        bench->ctx = _mat_args(_dominant(n), NULL);
+    }
+
+    // Tall-skinny least squares through the blocked QR.
+    long long lstsq_shapes[][2] = {{10000, 50}, {100000, 200}};
+    for (size_t s = 0; s < sizeof(lstsq_shapes) / sizeof(lstsq_shapes[0]); s++)
+    {
+        long long m = lstsq_shapes[s][0], n = lstsq_shapes[s][1];
+        Bench *bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_lstsq");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld, %lldx1", m, n, m);
+        bench->flops = 2.0 * m * n * n - 2.0 / 3.0 * n * n * n + 4.0 * m * n;
+        bench->bytes = (2.0 * m * n + 2 * m) * sizeof(double);
+        bench->run = _run_lstsq;
+        bench->ctx = _mat_args(xmat_rand(m, n), xmat_rand(m, 1));
+    }
+
+    // Randomized truncated SVD, rank 10 plus oversampling, two power iterations.
+    {
+        long long m = 20000, n = 500, k = 10;
+        Bench *bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_svd");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld, k=%lld", m, n, k);
+        bench->flops = 6 * 2.0 * m * n * (k + 10);
+        bench->bytes = 6.0 * m * n * sizeof(double);
+        bench->run = _run_svd;
+        MatArgs *args = _mat_args(xmat_rand(m, n), NULL);
+        args->n = k;
+        bench->ctx = args;
+    }
+
+    // Predicates on inputs that pass, so the whole matrix is scanned.
+    {
+        long long n = 2048;
+        Bench *bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_isSymm");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld", n, n);
+        bench->flops = 0;
+        bench->bytes = n * n * sizeof(double);
+        bench->run = _run_isSymm;
+        bench->ctx = _mat_args(_spd(n), NULL);
+
+        n = 512;
+        Matrix *tau;
+        Matrix *qr = xmat_qr(xmat_rand(n, n), &tau);
+        bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_isOrthTol");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld", n, n);
+        bench->flops = 1.0 * n * n * n;
+        bench->bytes = n * n * sizeof(double);
+        bench->run = _run_isOrth;
+        bench->ctx = _mat_args(xmat_qrQ(qr, tau), NULL);
+        mat_free(qr);
+        mat_free(tau);
+    }
+
+    // Cofactor expansion is O(n!), keep sizes small.
+    long long det_sizes[] = {4, 6, 8};
+    for (size_t s = 0; s < sizeof(det_sizes) / sizeof(det_sizes[0]); s++)
+    {
+        long long n = det_sizes[s];
+        Bench *bench = &benches[count++];
+        bench->group = "xlinalg";
+        snprintf(bench->name, sizeof(bench->name), "xmat_det");
+        snprintf(bench->shape, sizeof(bench->shape), "%lldx%lld", n, n);
+        bench->flops = 0;
+        bench->bytes = n * n * sizeof(double);
+        bench->run = _run_det;
+        bench->ctx = _mat_args(_dominant(n), NULL);
+    }
+    return count;
+}
+
+static long long _add_nn(Bench *benches, long long count)
+{
+    long long archs[][4] = {
+        // input, hidden, output, hidden_num
+        {2, 8, 2, 1},
+        {64, 128, 10, 2},
+        {784, 256, 10, 2},
+        {1024, 1024, 100, 4},
+    };
+
+    for (size_t a = 0; a < sizeof(archs) / sizeof(archs[0]); a++)
+    {
+        long long in = archs[a][0], hid = archs[a][1], out = archs[a][2], num = archs[a][3];
+        NNArgs *args = malloc(sizeof(NNArgs));
+        args->nn = nn_buildNN(in, hid, out, num, ReLU, nngrad_CELoss);
+        args->input = xmat_rand(1, in)->data;
+        args->target = xmat_zeros(out, 1);
+        args->target->data[0] = 1;
+        args->output = nn_forward(args->nn, args->input, in);
+        long long samples = 64;
+        args->context = nn_createContext(args->nn, samples);
+        args->batch = xmat_rand(samples, in);
+
+        double weights = in * hid + num * hid * hid + hid * out;
+        double units = num * hid + hid + out;
+
+        Bench *bench = &benches[count++];
+        bench->group = "nn";
+        snprintf(bench->name, sizeof(bench->name), "nn_forward");
+        snprintf(bench->shape, sizeof(bench->shape), "%lld-%lldx%lld-%lld", in, hid, num + 1, out);
+        bench->flops = 2.0 * weights;
+        bench->bytes = (weights + units) * sizeof(double);
+        bench->run = _run_forward;
+        bench->ctx = args;
+
+        bench = &benches[count++];
+        bench->group = "nn";
+        snprintf(bench->name, sizeof(bench->name), "nn_forwardBatch");
+        snprintf(bench->shape, sizeof(bench->shape), "%lld-%lldx%lld-%lld, %lld", in, hid, num + 1, out, samples);
+        bench->flops = 2.0 * weights * samples;
+        bench->bytes = (weights + units * samples) * sizeof(double);
+        bench->run = _run_forwardBatch;
+        bench->ctx = args;
+
+        bench = &benches[count++];
+        bench->group = "nn";
+        snprintf(bench->name, sizeof(bench->name), "nn_backward");
+        snprintf(bench->shape, sizeof(bench->shape), "%lld-%lldx%lld-%lld", in, hid, num + 1, out);
+        bench->flops = 6.0 * weights;
+        bench->bytes = 4.0 * weights * sizeof(double);
+        bench->run = _run_backward;
+        bench->ctx = args;
+    }
+    return count;
+}
+
+// ===== Reporting =====
+
+static void _print_result(BenchResult *res)
+{
+    double gflops = res->bench.flops > 0 ? res->bench.flops / res->median * 1e-9 : 0;
+    double gbps = res->bench.bytes / res->median * 1e-9;
+    printf("%-8s %-20s %-28s %12.3f %12.3f %10.3f %10.3f\n",
+           res->bench.group, res->bench.name, res->bench.shape,
+           res->median * 1e6, res->p95 * 1e6, gflops, gbps);
+}
+
+static void _write_json(const char *path, BenchResult *results, long long count)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Bench failed: Can't open %s for writing.\n", path);
+        exit(1);
+    }
+
+    fprintf(file, "{\n  \"warmup\": %d,\n  \"reps\": %d,\n  \"results\": [\n", warmup, reps);
+    for (long long i = 0; i < count; i++)
+    {
+        BenchResult *res = &results[i];
+        double gflops = res->bench.flops > 0 ? res->bench.flops / res->median * 1e-9 : 0;
+        double gbps = res->bench.bytes / res->median * 1e-9;
+        fprintf(file,
+                "    {\"group\": \"%s\", \"name\": \"%s\", \"shape\": \"%s\", "
+                "\"median_s\": %.9e, \"p95_s\": %.9e, \"min_s\": %.9e, "
+                "\"gflops\": %.6f, \"gbps\": %.6f}%s\n",
+                res->bench.group, res->bench.name, res->bench.shape,
+                res->median, res->p95, res->min, gflops, gbps,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+static int _selected(Bench *bench)
+{
+    if (filter == NULL)
+    {
+        return 1;
+    }
+    return strstr(bench->name, filter) != NULL || strstr(bench->group, filter) != NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *json_path = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-json") == 0 && i + 1 < argc)
+        {
+            json_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc)
+        {
+            reps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-warmup") == 0 && i + 1 < argc)
+        {
+            warmup = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-filter") == 0 && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-json <file>] [-reps <n>] [-warmup <n>] [-filter <name>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (reps <= 0 || warmup < 0)
+    {
+        fprintf(stderr, "Bench failed: reps should be positive and warmup non-negative.\n");
+        exit(1);
+    }
+
+    Bench benches[128];
+    long long count = 0;
+    count = _add_multmat(benches, count);
+    count = _add_elementwise(benches, count);
+    count = _add_sparse(benches, count);
+    count = _add_batch(benches, count);
+    count = _add_xlinalg(benches, count);
+    count = _add_nn(benches, count);
+
+    BenchResult *results = malloc(count * sizeof(BenchResult));
+    long long done = 0;
+
+    printf("%-8s %-20s %-28s %12s %12s %10s %10s\n",
+           "group", "name", "shape", "median(us)", "p95(us)", "GFLOP/s", "GB/s");
+    for (long long i = 0; i < count; i++)
+    {
+        if (!_selected(&benches[i]))
+        {
+            continue;
+        }
+        results[done] = _measure(benches[i]);
+        _print_result(&results[done]);
+        done++;
+    }
+
+    if (json_path != NULL)
+    {
+        _write_json(json_path, results, done);
+        printf("\nResults written to %s\n", json_path);
+    }
+
+    return sink == 12345.6789; // Never true, only consumes sink.
+}
@@ -0,0 +1,154 @@
+/**
+ * @file cpu.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Host CPU feature detection and kernel instruction set selection.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "cpu.h"
+
+#ifdef CPU_DISPATCH
+#include <cpuid.h>
+#endif
+
+// -1 until the first call to cpu_isa.
+static atomic_int selected_isa = -1;
+
+static const char *isa_names[CPU_ISA_COUNT] = {"scalar", "sse2", "avx2", "avx512"};
+
+bool cpu_isaSupported(CpuIsa isa)
+{
+    switch (isa)
+    {
+    case CPU_ISA_SCALAR:
+        return true;
+#ifdef CPU_DISPATCH
+    case CPU_ISA_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case CPU_ISA_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case CPU_ISA_AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+               __builtin_cpu_supports("fma");
+#endif
+    default:
+        return false;
+    }
+}
+
+CpuIsa cpu_bestIsa(void)
+{
+    for (int isa = CPU_ISA_COUNT - 1; isa > CPU_ISA_SCALAR; isa--)
+    {
+        if (cpu_isaSupported(isa))
+        {
+            return isa;
+        }
+    }
+    return CPU_ISA_SCALAR;
+}
+
+const char *cpu_isaName(CpuIsa isa)
+{
+    return isa >= 0 && isa < CPU_ISA_COUNT ? isa_names[isa] : "unknown";
+}
+
+static CpuIsa _initial_isa(void)
+{
+    CpuIsa best = cpu_bestIsa();
+    const char *env = getenv("CNN_ISA");
+    if (env == NULL || env[0] == '\0')
+    {
+        return best;
+    }
+
+    for (int isa = 0; isa < CPU_ISA_COUNT; isa++)
+    {
+        if (strcmp(env, isa_names[isa]) == 0)
+        {
+            if (cpu_isaSupported(isa))
+            {
+                return isa;
+            }
+            fprintf(stderr, "CNN_ISA=%s is not supported on this host, using %s.\n", env, isa_names[best]);
+            return best;
+        }
+    }
+
+    fprintf(stderr, "CNN_ISA=%s is unknown, using %s.\n", env, isa_names[best]);
+    return best;
+}
+
+CpuIsa cpu_isa(void)
+{
+    int isa = atomic_load_explicit(&selected_isa, memory_order_relaxed);
+    if (isa < 0)
+    {
+        int expected = -1;
+        atomic_compare_exchange_strong(&selected_isa, &expected, _initial_isa());
+        isa = atomic_load(&selected_isa);
+    }
+    return isa;
+}
+
+bool cpu_setIsa(CpuIsa isa)
+{
+    if (!cpu_isaSupported(isa))
+    {
+        return false;
+    }
+    atomic_store(&selected_isa, isa);
+    return true;
+}
+
+const char *cpu_model(void)
+{
+    static char model[49];
+    static atomic_int initialized = 0;
+    if (atomic_load(&initialized))
+    {
+        return model;
+    }
+
+    char brand[49] = "unknown";
+#ifdef CPU_DISPATCH
+    unsigned int regs[12];
+    if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004)
+    {
+        for (unsigned int leaf = 0; leaf < 3; leaf++)
+        {
+            __get_cpuid(0x80000002 + leaf, &regs[4 * leaf], &regs[4 * leaf + 1], &regs[4 * leaf + 2], &regs[4 * leaf + 3]);
+        }
+        memcpy(brand, regs, sizeof(regs));
+        brand[48] = '\0';
+    }
+#endif
+
+    // Trim, and keep the name on one line without the separators of the tuning cache.
+    const char *begin = brand;
+    while (*begin == ' ')
+    {
+        begin++;
+    }
+    size_t len = strlen(begin);
+    while (len > 0 && begin[len - 1] == ' ')
+    {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = begin[i];
+        model[i] = c == '\t' || c == '\n' || c == '\r' || c == '/' ? ' ' : c;
+    }
+    model[len] = '\0';
+    atomic_store(&initialized, 1);
+    return model;
+}
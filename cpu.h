@@ -0,0 +1,78 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Defined when instruction set specific kernel variants are compiled in, GCC on x86.
+ *
+ */
+#if defined(__GNUC__) && !defined(__clang__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH
+#endif
+
+/**
+ * @brief Instruction set a kernel variant is built for, in increasing order of width.
+ *
+ * CPU_ISA_SCALAR is the portable reference and the only variant on non-x86 targets.
+ */
+typedef enum
+{
+    CPU_ISA_SCALAR,
+    CPU_ISA_SSE2,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512,
+    CPU_ISA_COUNT
+} CpuIsa;
+
+/**
+ * @brief Instruction set the kernels currently dispatch to.
+ *
+ * On first use this is the widest instruction set that is both compiled in and supported
+ * by the host CPU and OS, unless the environment variable CNN_ISA names another one
+ * ("scalar", "sse2", "avx2" or "avx512"). Unsupported requests fall back to the best
+ * supported instruction set with a warning.
+ *
+ * @return CpuIsa
+ */
+CpuIsa cpu_isa(void);
+
+/**
+ * @brief Dispatch every kernel to the given instruction set from now on.
+ *
+ * @param isa Instruction set.
+ * @return true if isa is supported and selected, false otherwise and the selection is kept.
+ */
+bool cpu_setIsa(CpuIsa isa);
+
+/**
+ * @brief Whether kernels for an instruction set are compiled in and can run on this host.
+ *
+ * @param isa Instruction set.
+ * @return bool
+ */
+bool cpu_isaSupported(CpuIsa isa);
+
+/**
+ * @brief Widest supported instruction set, ignoring CNN_ISA.
+ *
+ * @return CpuIsa
+ */
+CpuIsa cpu_bestIsa(void);
+
+/**
+ * @brief Name of an instruction set, as accepted by CNN_ISA.
+ *
+ * @param isa Instruction set.
+ * @return const char*
+ */
+const char *cpu_isaName(CpuIsa isa);
+
+/**
+ * @brief Model name of the host CPU, "unknown" where it can't be read.
+ *
+ * @return const char*
+ */
+const char *cpu_model(void);
+
+#endif
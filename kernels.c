@@ -0,0 +1,396 @@
+/**
+ * @file kernels.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Instruction set specific variants of the hot linear algebra loops.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "kernels.h"
+#include "xmath.h"
+
+// ===== Scalar reference =====
+
+static void _gemm_scalar(double *c, long long ldc, const double *a, long long lda,
+                         const double *b, long long ldb, long long mr, long long kb, long long nb)
+{
+    for (long long r = 0; r < mr; r++)
+    {
+        for (long long k = 0; k < kb; k++)
+        {
+            double a_rk = a[r * lda + k];
+            for (long long j = 0; j < nb; j++)
+            {
+                c[r * ldc + j] += a_rk * b[k * ldb + j];
+            }
+        }
+    }
+}
+
+static void _vecmat_scalar(double *c, const double *x, const double *b, long long ldb, long long kb, long long nb)
+{
+    for (long long k = 0; k < kb; k++)
+    {
+        for (long long j = 0; j < nb; j++)
+        {
+            c[j] += x[k] * b[k * ldb + j];
+        }
+    }
+}
+
+static void _matvec_scalar(double *y, const double *a, long long lda, const double *x, long long mr, long long kb)
+{
+    for (long long r = 0; r < mr; r++)
+    {
+        double sum = 0;
+        for (long long k = 0; k < kb; k++)
+        {
+            sum += a[r * lda + k] * x[k];
+        }
+        y[r] += sum;
+    }
+}
+
+static void _addmat_scalar(double *y, const double *x1, const double *x2, long long n)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        y[i] = x1[i] + x2[i];
+    }
+}
+
+static void _pwpmat_scalar(double *y, const double *x1, const double *x2, long long n)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        y[i] = x1[i] * x2[i];
+    }
+}
+
+static void _addscal_scalar(double *y, const double *x, double val, long long n)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        y[i] = x[i] + val;
+    }
+}
+
+static void _multscal_scalar(double *y, const double *x, double val, long long n)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        y[i] = x[i] * val;
+    }
+}
+
+static double _sum_scalar(const double *x, long long n)
+{
+    double sum = 0;
+    for (long long i = 0; i < n; i++)
+    {
+        sum += x[i];
+    }
+    return sum;
+}
+
+static void _relu_scalar(double *y, const double *x, long long n)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        y[i] = x[i] > 0 ? x[i] : 0;
+    }
+}
+
+static void _transpose_scalar(double *dst, long long ldd, const double *src, long long lds,
+                              long long rows, long long cols)
+{
+    for (long long i = 0; i < rows; i++)
+    {
+        for (long long j = 0; j < cols; j++)
+        {
+            dst[j * ldd + i] = src[i * lds + j];
+        }
+    }
+}
+
+static const MatKernels kernels_scalar = {
+    CPU_ISA_SCALAR,
+    _gemm_scalar,
+    _vecmat_scalar,
+    _matvec_scalar,
+    _addmat_scalar,
+    _pwpmat_scalar,
+    _addscal_scalar,
+    _multscal_scalar,
+    _sum_scalar,
+    _relu_scalar,
+    _transpose_scalar,
+};
+
+// ===== Vector variants =====
+
+#ifdef CPU_DISPATCH
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#define KERN_SUFFIX sse2
+#define KERN_LANES 2
+#define KERN_LANE_LIST(F, s) F(0, s), F(1, s)
+#define KERN_ISA CPU_ISA_SSE2
+#include "kernels_template.h"
+#undef KERN_SUFFIX
+#undef KERN_LANES
+#undef KERN_ISA
+#undef KERN_LANE_LIST
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define KERN_SUFFIX avx2
+#define KERN_LANES 4
+#define KERN_LANE_LIST(F, s) F(0, s), F(1, s), F(2, s), F(3, s)
+#define KERN_ISA CPU_ISA_AVX2
+#include "kernels_template.h"
+#undef KERN_SUFFIX
+#undef KERN_LANES
+#undef KERN_ISA
+#undef KERN_LANE_LIST
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#define KERN_SUFFIX avx512
+#define KERN_LANES 8
+#define KERN_LANE_LIST(F, s) F(0, s), F(1, s), F(2, s), F(3, s), F(4, s), F(5, s), F(6, s), F(7, s)
+#define KERN_ISA CPU_ISA_AVX512
+#include "kernels_template.h"
+#undef KERN_SUFFIX
+#undef KERN_LANES
+#undef KERN_ISA
+#undef KERN_LANE_LIST
+#pragma GCC pop_options
+
+static const MatKernels *variants[CPU_ISA_COUNT] = {&kernels_scalar, &kernels_sse2, &kernels_avx2, &kernels_avx512};
+
+#else
+
+static const MatKernels *variants[CPU_ISA_COUNT] = {&kernels_scalar};
+
+#endif
+
+const MatKernels *kern_variant(CpuIsa isa)
+{
+    if (isa < 0 || isa >= CPU_ISA_COUNT || !cpu_isaSupported(isa))
+    {
+        return NULL;
+    }
+    return variants[isa];
+}
+
+const MatKernels *kern_get(void)
+{
+    return variants[cpu_isa()];
+}
+
+void kern_epilogue(const MatKernels *kern, double *c, long long n, MatrixEpilogue act)
+{
+    switch (act)
+    {
+    case MAT_EPI_RELU:
+        kern->relu(c, c, n);
+        break;
+    case MAT_EPI_SIGMOID:
+        xmath_vsigmoid(c, c, n);
+        break;
+    case MAT_EPI_TANH:
+        xmath_vtanh(c, c, n);
+        break;
+    default:
+        break;
+    }
+}
+
+// ===== Self test =====
+
+// Odd sizes, so that every vector loop also runs its remainder.
+#define TEST_N 10007
+#define TEST_M 7
+#define TEST_K 131
+#define TEST_NB 75
+#define TEST_LD 83
+
+/**
+ * @brief Largest error of y against the reference, relative to max(|ref|, 1).
+ */
+static double _max_error(const double *y, const double *ref, long long n)
+{
+    double err = 0;
+    for (long long i = 0; i < n; i++)
+    {
+        if (isnan(y[i]) != isnan(ref[i]))
+        {
+            return INFINITY;
+        }
+        if (!isnan(ref[i]) && y[i] != ref[i])
+        {
+            err = fmax(err, fabs(y[i] - ref[i]) / fmax(fabs(ref[i]), 1));
+        }
+    }
+    return err;
+}
+
+static int _check(bool verbose, CpuIsa isa, const char *kernel, double err, double tol)
+{
+    bool ok = err <= tol;
+    if (verbose || !ok)
+    {
+        printf("%-8s %-14s max error %.3e  %s\n", cpu_isaName(isa), kernel, err, ok ? "ok" : "FAILED");
+    }
+    return ok ? 0 : 1;
+}
+
+static void _test_gemm(const MatKernels *kern, const double *a, const double *b, double *c)
+{
+    for (long long i = 0; i < TEST_M * TEST_LD; i++)
+    {
+        c[i] = 0.5;
+    }
+    // Row blocks of KERN_GEMM_MR rows and a partial one, with padded leading dimensions.
+    for (long long i = 0; i < TEST_M; i += KERN_GEMM_MR)
+    {
+        long long mr = TEST_M - i < KERN_GEMM_MR ? TEST_M - i : KERN_GEMM_MR;
+        kern->gemm(c + i * TEST_LD, TEST_LD, a + i * TEST_K, TEST_K, b, TEST_LD, mr, TEST_K, TEST_NB);
+    }
+}
+
+int kern_selfTest(bool verbose)
+{
+    double *x1 = malloc(TEST_N * sizeof(double));
+    double *x2 = malloc(TEST_N * sizeof(double));
+    double *y = malloc(TEST_N * sizeof(double));
+    double *ref = malloc(TEST_N * sizeof(double));
+    double *a = malloc(TEST_M * TEST_K * sizeof(double));
+    double *b = malloc(TEST_K * TEST_LD * sizeof(double));
+    double *c = malloc(TEST_M * TEST_LD * sizeof(double));
+    double *c_ref = malloc(TEST_M * TEST_LD * sizeof(double));
+
+    for (long long i = 0; i < TEST_N; i++)
+    {
+        x1[i] = ((double)rand() / RAND_MAX - 0.5) * 40;
+        x2[i] = ((double)rand() / RAND_MAX - 0.5) * 40;
+    }
+    x1[3] = NAN;
+    x1[5] = INFINITY;
+    x1[7] = -INFINITY;
+    for (long long i = 0; i < TEST_M * TEST_K; i++)
+    {
+        a[i] = (double)rand() / RAND_MAX - 0.5;
+    }
+    for (long long i = 0; i < TEST_K * TEST_LD; i++)
+    {
+        b[i] = (double)rand() / RAND_MAX - 0.5;
+    }
+
+    // Summation order differs between variants, bound the error by the condition of the sums.
+    double sum_tol = 0;
+    for (long long i = 8; i < TEST_N; i++)
+    {
+        sum_tol += fabs(x2[i]);
+    }
+    sum_tol = 4 * TEST_N * 1.1102230246251565e-16 * sum_tol / fmax(fabs(_sum_scalar(x2 + 8, TEST_N - 8)), 1);
+    double gemm_tol = 4 * TEST_K * 1.1102230246251565e-16 * TEST_K;
+    double act_tol = 8 * 1.1102230246251565e-16;
+
+    _test_gemm(&kernels_scalar, a, b, c_ref);
+
+    void (*activations[4])(double *, const double *, long long) = {xmath_vexp, xmath_vlog, xmath_vtanh, xmath_vsigmoid};
+    const char *activation_names[4] = {"xmath_vexp", "xmath_vlog", "xmath_vtanh", "xmath_vsigmoid"};
+
+    CpuIsa selected = cpu_isa();
+    int failures = 0;
+    for (int isa = CPU_ISA_SCALAR; isa < CPU_ISA_COUNT; isa++)
+    {
+        const MatKernels *kern = kern_variant(isa);
+        if (kern == NULL)
+        {
+            if (verbose)
+            {
+                printf("%-8s not supported on this host, skipped\n", cpu_isaName(isa));
+            }
+            continue;
+        }
+
+        _test_gemm(kern, a, b, c);
+        failures += _check(verbose, isa, "gemm", _max_error(c, c_ref, TEST_M * TEST_LD), gemm_tol);
+
+        // The first row of a times the TEST_K x TEST_NB block of b, and that block times the
+        // first TEST_NB elements of a.
+        for (long long i = 0; i < TEST_K; i++)
+        {
+            y[i] = ref[i] = 0.5;
+        }
+        kern->vecmat(y, a, b, TEST_LD, TEST_K, TEST_NB);
+        _vecmat_scalar(ref, a, b, TEST_LD, TEST_K, TEST_NB);
+        failures += _check(verbose, isa, "vecmat", _max_error(y, ref, TEST_NB), gemm_tol);
+
+        kern->matvec(y, b, TEST_LD, a, TEST_K, TEST_NB);
+        _matvec_scalar(ref, b, TEST_LD, a, TEST_K, TEST_NB);
+        failures += _check(verbose, isa, "matvec", _max_error(y, ref, TEST_K), gemm_tol);
+
+        kern->addmat(y, x1, x2, TEST_N);
+        _addmat_scalar(ref, x1, x2, TEST_N);
+        failures += _check(verbose, isa, "addmat", _max_error(y, ref, TEST_N), 0);
+
+        kern->pwpmat(y, x1, x2, TEST_N);
+        _pwpmat_scalar(ref, x1, x2, TEST_N);
+        failures += _check(verbose, isa, "pwpmat", _max_error(y, ref, TEST_N), 0);
+
+        kern->addscal(y, x1, 0.25, TEST_N);
+        _addscal_scalar(ref, x1, 0.25, TEST_N);
+        failures += _check(verbose, isa, "addscal", _max_error(y, ref, TEST_N), 0);
+
+        kern->multscal(y, x1, -3, TEST_N);
+        _multscal_scalar(ref, x1, -3, TEST_N);
+        failures += _check(verbose, isa, "multscal", _max_error(y, ref, TEST_N), 0);
+
+        kern->relu(y, x1, TEST_N);
+        _relu_scalar(ref, x1, TEST_N);
+        failures += _check(verbose, isa, "relu", _max_error(y, ref, TEST_N), 0);
+
+        // Transpose the TEST_K x TEST_NB block of b, with odd sizes on both sides.
+        kern->transpose(y, TEST_K, b, TEST_LD, TEST_K, TEST_NB);
+        _transpose_scalar(ref, TEST_K, b, TEST_LD, TEST_K, TEST_NB);
+        failures += _check(verbose, isa, "transpose", _max_error(y, ref, TEST_K * TEST_NB), 0);
+
+        double sum = kern->sum(x2 + 8, TEST_N - 8);
+        double sum_ref = _sum_scalar(x2 + 8, TEST_N - 8);
+        failures += _check(verbose, isa, "sum", _max_error(&sum, &sum_ref, 1), sum_tol);
+
+        // xmath dispatches on the selected instruction set itself.
+        for (int f = 0; f < 4; f++)
+        {
+            cpu_setIsa(CPU_ISA_SCALAR);
+            activations[f](ref, x1, TEST_N);
+            cpu_setIsa(isa);
+            activations[f](y, x1, TEST_N);
+            failures += _check(verbose, isa, activation_names[f], _max_error(y, ref, TEST_N), act_tol);
+        }
+    }
+    cpu_setIsa(selected);
+
+    free(x1);
+    free(x2);
+    free(y);
+    free(ref);
+    free(a);
+    free(b);
+    free(c);
+    free(c_ref);
+    return failures;
+}
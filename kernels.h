@@ -0,0 +1,93 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdbool.h>
+#include "cpu.h"
+#include "linalg.h"
+
+/**
+ * @brief Number of rows of C the GEMM kernel updates at once.
+ *
+ */
+#define KERN_GEMM_MR 4
+
+/**
+ * @brief Hot loops of the linear algebra routines, built once per instruction set.
+ *
+ * Every function works on contiguous arrays, outputs may alias inputs.
+ */
+typedef struct
+{
+    CpuIsa isa;
+
+    /**
+     * @brief c[r][0:nb] += sum_k a[r][k] * b[k][0:nb] for the mr <= KERN_GEMM_MR rows of a
+     * kb deep block, with leading dimensions ldc, lda and ldb.
+     */
+    void (*gemm)(double *c, long long ldc, const double *a, long long lda,
+                 const double *b, long long ldb, long long mr, long long kb, long long nb);
+
+    /**
+     * @brief c[0:nb] += sum_k x[k] * b[k][0:nb] for a kb deep block with leading dimension
+     * ldb, a row vector times a matrix.
+     */
+    void (*vecmat)(double *c, const double *x, const double *b, long long ldb, long long kb, long long nb);
+
+    /**
+     * @brief y[r] += sum_k a[r][k] * x[k] for the mr rows of a with leading dimension lda, a
+     * matrix times a column vector.
+     */
+    void (*matvec)(double *y, const double *a, long long lda, const double *x, long long mr, long long kb);
+
+    void (*addmat)(double *y, const double *x1, const double *x2, long long n);
+    void (*pwpmat)(double *y, const double *x1, const double *x2, long long n);
+    void (*addscal)(double *y, const double *x, double val, long long n);
+    void (*multscal)(double *y, const double *x, double val, long long n);
+    double (*sum)(const double *x, long long n);
+    void (*relu)(double *y, const double *x, long long n);
+
+    /**
+     * @brief dst[j][i] = src[i][j] for a rows x cols block of src, with leading dimensions
+     * ldd and lds. src and dst must not overlap.
+     */
+    void (*transpose)(double *dst, long long ldd, const double *src, long long lds,
+                      long long rows, long long cols);
+} MatKernels;
+
+/**
+ * @brief Kernels of the instruction set selected by cpu_isa.
+ *
+ * @return const MatKernels*
+ */
+const MatKernels *kern_get(void);
+
+/**
+ * @brief Kernels of a given instruction set.
+ *
+ * @param isa Instruction set.
+ * @return const MatKernels*, NULL if the variant is not compiled in or not supported.
+ */
+const MatKernels *kern_variant(CpuIsa isa);
+
+/**
+ * @brief Apply a matrix multiplication epilogue to an array, in place.
+ *
+ * @param kern Kernels to use.
+ * @param c Array.
+ * @param n Number of elements.
+ * @param act Activation.
+ */
+void kern_epilogue(const MatKernels *kern, double *c, long long n, MatrixEpilogue act);
+
+/**
+ * @brief Compare every kernel variant supported by the host against the scalar reference,
+ * including the array functions of xmath.
+ *
+ * Element-wise maps must match exactly, reductions, GEMM and activations within rounding.
+ *
+ * @param verbose Print one line per variant and kernel.
+ * @return Number of failed checks.
+ */
+int kern_selfTest(bool verbose);
+
+#endif
@@ -0,0 +1,374 @@
+/**
+ * @file kernels_template.h
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Vector kernels, included by kernels.c once per instruction set.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+// No include guard: kernels.c defines KERN_SUFFIX, KERN_LANES, KERN_ISA and
+// KERN_LANE_LIST, and puts the matching target pragma in effect before every inclusion.
+
+#define KERN_CAT_(a, b) a##_##b
+#define KERN_CAT(a, b) KERN_CAT_(a, b)
+#define KERN_FN(name) KERN_CAT(name, KERN_SUFFIX)
+#define KV KERN_FN(kvec)
+#define KVI KERN_FN(kveci)
+#define KLOAD(p) (*(const KV *)(p))
+#define KSTORE(p, v) (*(KV *)(p) = (v))
+
+// Unaligned vectors of KERN_LANES doubles, and the matching comparison masks.
+typedef double KV __attribute__((vector_size(KERN_LANES * sizeof(double)), aligned(sizeof(double))));
+typedef long long KVI __attribute__((vector_size(KERN_LANES * sizeof(long long)), aligned(sizeof(long long))));
+
+static void KERN_FN(_gemm)(double *c, long long ldc, const double *a, long long lda,
+                           const double *b, long long ldb, long long mr, long long kb, long long nb)
+{
+    long long j = 0;
+    if (mr == KERN_GEMM_MR)
+    {
+        const double *a0 = a, *a1 = a + lda, *a2 = a + 2 * lda, *a3 = a + 3 * lda;
+        double *c0 = c, *c1 = c + ldc, *c2 = c + 2 * ldc, *c3 = c + 3 * ldc;
+
+        // 4 x 2 vectors of accumulators, every loaded row of b is used 4 times.
+        for (; j + 2 * KERN_LANES <= nb; j += 2 * KERN_LANES)
+        {
+            KV c00 = KLOAD(c0 + j), c01 = KLOAD(c0 + j + KERN_LANES);
+            KV c10 = KLOAD(c1 + j), c11 = KLOAD(c1 + j + KERN_LANES);
+            KV c20 = KLOAD(c2 + j), c21 = KLOAD(c2 + j + KERN_LANES);
+            KV c30 = KLOAD(c3 + j), c31 = KLOAD(c3 + j + KERN_LANES);
+            for (long long k = 0; k < kb; k++)
+            {
+                const double *b_k = b + k * ldb + j;
+                KV b0 = KLOAD(b_k), b1 = KLOAD(b_k + KERN_LANES);
+                c00 += a0[k] * b0, c01 += a0[k] * b1;
+                c10 += a1[k] * b0, c11 += a1[k] * b1;
+                c20 += a2[k] * b0, c21 += a2[k] * b1;
+                c30 += a3[k] * b0, c31 += a3[k] * b1;
+            }
+            KSTORE(c0 + j, c00), KSTORE(c0 + j + KERN_LANES, c01);
+            KSTORE(c1 + j, c10), KSTORE(c1 + j + KERN_LANES, c11);
+            KSTORE(c2 + j, c20), KSTORE(c2 + j + KERN_LANES, c21);
+            KSTORE(c3 + j, c30), KSTORE(c3 + j + KERN_LANES, c31);
+        }
+    }
+
+    // Rows of a partial row block, and the columns left over above.
+    for (long long r = 0; r < mr; r++)
+    {
+        const double *a_r = a + r * lda;
+        double *c_r = c + r * ldc;
+        long long jr = j;
+        for (; jr + KERN_LANES <= nb; jr += KERN_LANES)
+        {
+            KV acc = KLOAD(c_r + jr);
+            for (long long k = 0; k < kb; k++)
+            {
+                acc += a_r[k] * KLOAD(b + k * ldb + jr);
+            }
+            KSTORE(c_r + jr, acc);
+        }
+        for (; jr < nb; jr++)
+        {
+            double acc = c_r[jr];
+            for (long long k = 0; k < kb; k++)
+            {
+                acc += a_r[k] * b[k * ldb + jr];
+            }
+            c_r[jr] = acc;
+        }
+    }
+}
+
+static void KERN_FN(_vecmat)(double *c, const double *x, const double *b, long long ldb, long long kb, long long nb)
+{
+    long long j = 0;
+
+    // 4 vectors of columns, with separate accumulators for even and odd rows of b, so that
+    // 8 independent additions are in flight while b streams past once.
+    for (; j + 4 * KERN_LANES <= nb; j += 4 * KERN_LANES)
+    {
+        KV c0 = KLOAD(c + j), c1 = KLOAD(c + j + KERN_LANES);
+        KV c2 = KLOAD(c + j + 2 * KERN_LANES), c3 = KLOAD(c + j + 3 * KERN_LANES);
+        KV d0 = {0}, d1 = {0}, d2 = {0}, d3 = {0};
+        long long k = 0;
+        for (; k + 2 <= kb; k += 2)
+        {
+            const double *b0 = b + k * ldb + j, *b1 = b0 + ldb;
+            c0 += x[k] * KLOAD(b0), c1 += x[k] * KLOAD(b0 + KERN_LANES);
+            c2 += x[k] * KLOAD(b0 + 2 * KERN_LANES), c3 += x[k] * KLOAD(b0 + 3 * KERN_LANES);
+            d0 += x[k + 1] * KLOAD(b1), d1 += x[k + 1] * KLOAD(b1 + KERN_LANES);
+            d2 += x[k + 1] * KLOAD(b1 + 2 * KERN_LANES), d3 += x[k + 1] * KLOAD(b1 + 3 * KERN_LANES);
+        }
+        if (k < kb)
+        {
+            const double *b0 = b + k * ldb + j;
+            c0 += x[k] * KLOAD(b0), c1 += x[k] * KLOAD(b0 + KERN_LANES);
+            c2 += x[k] * KLOAD(b0 + 2 * KERN_LANES), c3 += x[k] * KLOAD(b0 + 3 * KERN_LANES);
+        }
+        KSTORE(c + j, c0 + d0), KSTORE(c + j + KERN_LANES, c1 + d1);
+        KSTORE(c + j + 2 * KERN_LANES, c2 + d2), KSTORE(c + j + 3 * KERN_LANES, c3 + d3);
+    }
+
+    for (; j + KERN_LANES <= nb; j += KERN_LANES)
+    {
+        KV acc = KLOAD(c + j);
+        for (long long k = 0; k < kb; k++)
+        {
+            acc += x[k] * KLOAD(b + k * ldb + j);
+        }
+        KSTORE(c + j, acc);
+    }
+    for (; j < nb; j++)
+    {
+        double acc = c[j];
+        for (long long k = 0; k < kb; k++)
+        {
+            acc += x[k] * b[k * ldb + j];
+        }
+        c[j] = acc;
+    }
+}
+
+static inline double KERN_FN(_hsum)(const KV *v)
+{
+    double sum = 0;
+    for (int l = 0; l < KERN_LANES; l++)
+    {
+        sum += (*v)[l];
+    }
+    return sum;
+}
+
+static void KERN_FN(_matvec)(double *y, const double *a, long long lda, const double *x, long long mr, long long kb)
+{
+    long long r = 0;
+
+    // 4 rows with 2 vectors of accumulators each, every loaded vector of x is used 4 times.
+    for (; r + 4 <= mr; r += 4)
+    {
+        const double *a0 = a + r * lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+        KV s00 = {0}, s01 = {0}, s10 = {0}, s11 = {0}, s20 = {0}, s21 = {0}, s30 = {0}, s31 = {0};
+        long long k = 0;
+        for (; k + 2 * KERN_LANES <= kb; k += 2 * KERN_LANES)
+        {
+            KV x0 = KLOAD(x + k), x1 = KLOAD(x + k + KERN_LANES);
+            s00 += KLOAD(a0 + k) * x0, s01 += KLOAD(a0 + k + KERN_LANES) * x1;
+            s10 += KLOAD(a1 + k) * x0, s11 += KLOAD(a1 + k + KERN_LANES) * x1;
+            s20 += KLOAD(a2 + k) * x0, s21 += KLOAD(a2 + k + KERN_LANES) * x1;
+            s30 += KLOAD(a3 + k) * x0, s31 += KLOAD(a3 + k + KERN_LANES) * x1;
+        }
+        s00 += s01, s10 += s11, s20 += s21, s30 += s31;
+        double t0 = KERN_FN(_hsum)(&s00), t1 = KERN_FN(_hsum)(&s10);
+        double t2 = KERN_FN(_hsum)(&s20), t3 = KERN_FN(_hsum)(&s30);
+        for (; k < kb; k++)
+        {
+            t0 += a0[k] * x[k], t1 += a1[k] * x[k], t2 += a2[k] * x[k], t3 += a3[k] * x[k];
+        }
+        y[r] += t0, y[r + 1] += t1, y[r + 2] += t2, y[r + 3] += t3;
+    }
+
+    for (; r < mr; r++)
+    {
+        const double *a_r = a + r * lda;
+        KV s0 = {0}, s1 = {0};
+        long long k = 0;
+        for (; k + 2 * KERN_LANES <= kb; k += 2 * KERN_LANES)
+        {
+            s0 += KLOAD(a_r + k) * KLOAD(x + k);
+            s1 += KLOAD(a_r + k + KERN_LANES) * KLOAD(x + k + KERN_LANES);
+        }
+        s0 += s1;
+        double t = KERN_FN(_hsum)(&s0);
+        for (; k < kb; k++)
+        {
+            t += a_r[k] * x[k];
+        }
+        y[r] += t;
+    }
+}
+
+static void KERN_FN(_addmat)(double *y, const double *x1, const double *x2, long long n)
+{
+    long long i = 0;
+    for (; i + KERN_LANES <= n; i += KERN_LANES)
+    {
+        KSTORE(y + i, KLOAD(x1 + i) + KLOAD(x2 + i));
+    }
+    for (; i < n; i++)
+    {
+        y[i] = x1[i] + x2[i];
+    }
+}
+
+static void KERN_FN(_pwpmat)(double *y, const double *x1, const double *x2, long long n)
+{
+    long long i = 0;
+    for (; i + KERN_LANES <= n; i += KERN_LANES)
+    {
+        KSTORE(y + i, KLOAD(x1 + i) * KLOAD(x2 + i));
+    }
+    for (; i < n; i++)
+    {
+        y[i] = x1[i] * x2[i];
+    }
+}
+
+static void KERN_FN(_addscal)(double *y, const double *x, double val, long long n)
+{
+    long long i = 0;
+    for (; i + KERN_LANES <= n; i += KERN_LANES)
+    {
+        KSTORE(y + i, KLOAD(x + i) + val);
+    }
+    for (; i < n; i++)
+    {
+        y[i] = x[i] + val;
+    }
+}
+
+static void KERN_FN(_multscal)(double *y, const double *x, double val, long long n)
+{
+    long long i = 0;
+    for (; i + KERN_LANES <= n; i += KERN_LANES)
+    {
+        KSTORE(y + i, KLOAD(x + i) * val);
+    }
+    for (; i < n; i++)
+    {
+        y[i] = x[i] * val;
+    }
+}
+
+static double KERN_FN(_sum)(const double *x, long long n)
+{
+    // Four independent accumulators hide the latency of the additions.
+    KV s0 = {0}, s1 = {0}, s2 = {0}, s3 = {0};
+    long long i = 0;
+    for (; i + 4 * KERN_LANES <= n; i += 4 * KERN_LANES)
+    {
+        s0 += KLOAD(x + i);
+        s1 += KLOAD(x + i + KERN_LANES);
+        s2 += KLOAD(x + i + 2 * KERN_LANES);
+        s3 += KLOAD(x + i + 3 * KERN_LANES);
+    }
+    s0 = (s0 + s1) + (s2 + s3);
+
+    double sum = 0;
+    for (int l = 0; l < KERN_LANES; l++)
+    {
+        sum += s0[l];
+    }
+    for (; i < n; i++)
+    {
+        sum += x[i];
+    }
+    return sum;
+}
+
+static void KERN_FN(_relu)(double *y, const double *x, long long n)
+{
+    const KV zero = {0};
+    long long i = 0;
+    for (; i + KERN_LANES <= n; i += KERN_LANES)
+    {
+        KV v = KLOAD(x + i);
+        KSTORE(y + i, (KV)((KVI)v & (v > zero)));
+    }
+    for (; i < n; i++)
+    {
+        y[i] = x[i] > 0 ? x[i] : 0;
+    }
+}
+
+// Stage s of an in-register transpose swaps the off-diagonal s x s blocks of every
+// 2s x 2s block, between rows i and i + s. All stages together transpose the tile.
+#define KERN_MASK_LO(j, s) (((j) & (s)) ? KERN_LANES + (j) - (s) : (j))
+#define KERN_MASK_HI(j, s) (((j) & (s)) ? KERN_LANES + (j) : (j) + (s))
+#define KERN_TRANSPOSE_STAGE(r, s)                                                            \
+    for (int i = 0; i < KERN_LANES; i++)                                                      \
+    {                                                                                         \
+        if (!(i & (s)))                                                                       \
+        {                                                                                     \
+            KV lo = __builtin_shuffle(r[i], r[i + (s)], (KVI){KERN_LANE_LIST(KERN_MASK_LO, s)}); \
+            KV hi = __builtin_shuffle(r[i], r[i + (s)], (KVI){KERN_LANE_LIST(KERN_MASK_HI, s)}); \
+            r[i] = lo;                                                                        \
+            r[i + (s)] = hi;                                                                  \
+        }                                                                                     \
+    }
+
+static inline void KERN_FN(_transpose_tile)(double *dst, long long ldd, const double *src, long long lds)
+{
+    KV r[KERN_LANES];
+    for (int i = 0; i < KERN_LANES; i++)
+    {
+        r[i] = KLOAD(src + i * lds);
+    }
+    KERN_TRANSPOSE_STAGE(r, 1);
+#if KERN_LANES > 2
+    KERN_TRANSPOSE_STAGE(r, 2);
+#endif
+#if KERN_LANES > 4
+    KERN_TRANSPOSE_STAGE(r, 4);
+#endif
+    for (int i = 0; i < KERN_LANES; i++)
+    {
+        KSTORE(dst + i * ldd, r[i]);
+    }
+}
+
+static void KERN_FN(_transpose)(double *dst, long long ldd, const double *src, long long lds,
+                                long long rows, long long cols)
+{
+    long long i = 0;
+    for (; i + KERN_LANES <= rows; i += KERN_LANES)
+    {
+        long long j = 0;
+        for (; j + KERN_LANES <= cols; j += KERN_LANES)
+        {
+            KERN_FN(_transpose_tile)(dst + j * ldd + i, ldd, src + i * lds + j, lds);
+        }
+        for (; j < cols; j++)
+        {
+            for (long long r = i; r < i + KERN_LANES; r++)
+            {
+                dst[j * ldd + r] = src[r * lds + j];
+            }
+        }
+    }
+    for (; i < rows; i++)
+    {
+        for (long long j = 0; j < cols; j++)
+        {
+            dst[j * ldd + i] = src[i * lds + j];
+        }
+    }
+}
+
+static const MatKernels KERN_FN(kernels) = {
+    KERN_ISA,
+    KERN_FN(_gemm),
+    KERN_FN(_vecmat),
+    KERN_FN(_matvec),
+    KERN_FN(_addmat),
+    KERN_FN(_pwpmat),
+    KERN_FN(_addscal),
+    KERN_FN(_multscal),
+    KERN_FN(_sum),
+    KERN_FN(_relu),
+    KERN_FN(_transpose),
+};
+
+#undef KERN_CAT_
+#undef KERN_CAT
+#undef KERN_FN
+#undef KV
+#undef KVI
+#undef KLOAD
+#undef KSTORE
+#undef KERN_MASK_LO
+#undef KERN_MASK_HI
+#undef KERN_TRANSPOSE_STAGE
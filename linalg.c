@@ -11,10 +11,111 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <math.h>
 #include "linalg.h"
+#include "xmath.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "trace.h"
+#include "tune.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+struct MatrixStorage
+{
+    double *base;
+    long long bytes;
+    const char *site;
+    atomic_llong refs; // Matrices sharing this storage.
+};
+
+// Number of distinct call sites the allocation tracker can tell apart.
+#define MAT_TRACK_SITES 512
+
+typedef struct
+{
+    _Atomic(const char *) site;
+    atomic_llong allocations;
+    atomic_llong live_count;
+    atomic_llong live_bytes;
+} AllocSite;
+
+static atomic_llong live_matrices = 0;
+static atomic_llong live_bytes = 0;
+static atomic_llong peak_bytes = 0;
+static atomic_llong allocations = 0;
+static AllocSite alloc_sites[MAT_TRACK_SITES];
+static atomic_int report_registered = 0;
+static atomic_int env_checked = 0;
+
+/**
+ * @brief Find or claim the tracker slot of a call site, open addressing on the site pointer.
+ */
+static AllocSite *_alloc_site(const char *site)
+{
+    size_t start = ((uintptr_t)site >> 4) % MAT_TRACK_SITES;
+    for (size_t probe = 0; probe < MAT_TRACK_SITES; probe++)
+    {
+        AllocSite *slot = &alloc_sites[(start + probe) % MAT_TRACK_SITES];
+        const char *current = atomic_load(&slot->site);
+        if (current == NULL)
+        {
+            const char *expected = NULL;
+            if (atomic_compare_exchange_strong(&slot->site, &expected, site) || expected == site)
+            {
+                return slot;
+            }
+            current = expected;
+        }
+        if (current == site)
+        {
+            return slot;
+        }
+    }
+    return NULL; // Table full, only the totals are tracked.
+}
+
+static void _track_alloc(const char *site, long long bytes)
+{
+    atomic_fetch_add(&allocations, 1);
+    long long live = atomic_fetch_add(&live_bytes, bytes) + bytes;
+    long long peak = atomic_load(&peak_bytes);
+    while (live > peak && !atomic_compare_exchange_weak(&peak_bytes, &peak, live))
+    {
+    }
+
+    AllocSite *slot = _alloc_site(site);
+    if (slot != NULL)
+    {
+        atomic_fetch_add(&slot->allocations, 1);
+        atomic_fetch_add(&slot->live_count, 1);
+        atomic_fetch_add(&slot->live_bytes, bytes);
+    }
+}
+
+static void _track_free(const char *site, long long bytes)
+{
+    atomic_fetch_sub(&live_bytes, bytes);
+
+    AllocSite *slot = _alloc_site(site);
+    if (slot != NULL)
+    {
+        atomic_fetch_sub(&slot->live_count, 1);
+        atomic_fetch_sub(&slot->live_bytes, bytes);
+    }
+}
 
 Matrix *mat_create(long long row, long long col, double *data)
+{
+    return mat_createStrided(row, col, col, data);
+}
+
+Matrix *mat_createStrided(long long row, long long col, long long stride, double *data)
 {
     if (row <= 0 || col <= 0)
     {
@@ -22,20 +123,243 @@ Matrix *mat_create(long long row, long long col, double *data)
         exit(1);
     }
 
+    if (stride < col && stride != 0)
+    {
+        fprintf(stderr, "Matrix Create Failed: Stride %lld is less than column size %lld.\n", stride, col);
+        exit(1);
+    }
+
+    if (!atomic_load_explicit(&env_checked, memory_order_relaxed) && atomic_exchange(&env_checked, 1) == 0)
+    {
+        if (getenv("CNN_MEMREPORT") != NULL)
+        {
+            mat_memReportAtExit();
+        }
+    }
+
     Matrix *matrix = (Matrix *)malloc(sizeof(Matrix));
     matrix->row = row;
     matrix->col = col;
+    matrix->stride = stride;
     matrix->data = data;
+    matrix->storage = NULL;
+    atomic_fetch_add(&live_matrices, 1);
 
     return matrix;
 }
 
+static double *_storage_alloc(size_t bytes)
+{
+#ifdef _WIN32
+    return _aligned_malloc(bytes, MAT_ALIGNMENT);
+#else
+    void *ptr = NULL;
+    return posix_memalign(&ptr, MAT_ALIGNMENT, bytes) == 0 ? ptr : NULL;
+#endif
+}
+
+static void _storage_free(double *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static Matrix *_alloc_strided(long long row, long long col, long long stride, const char *site)
+{
+    if (row <= 0 || col <= 0)
+    {
+        fprintf(stderr, "Matrix Allocate Failed: Invalid matrix size\n");
+        exit(1);
+    }
+
+    // The last row is not padded.
+    long long bytes = ((row - 1) * stride + col) * sizeof(double);
+    MatrixStorage *storage = malloc(sizeof(MatrixStorage));
+    double *data = _storage_alloc(bytes);
+    if (storage == NULL || data == NULL)
+    {
+        fprintf(stderr, "Matrix Allocate Failed: Can't allocate %lld x %lld matrix.\n", row, col);
+        exit(1);
+    }
+    storage->base = data;
+    storage->bytes = bytes;
+    storage->site = site;
+    atomic_init(&storage->refs, 1);
+    _track_alloc(site, storage->bytes);
+
+    Matrix *matrix = mat_createStrided(row, col, stride, data);
+    matrix->storage = storage;
+    return matrix;
+}
+
+Matrix *mat_allocAt(long long row, long long col, const char *site)
+{
+    return _alloc_strided(row, col, col, site);
+}
+
+Matrix *mat_allocPaddedAt(long long row, long long col, const char *site)
+{
+    const long long per_line = MAT_ALIGNMENT / sizeof(double);
+    long long stride = col;
+    if (col >= per_line)
+    {
+        stride = (col + per_line - 1) / per_line * per_line;
+        if (stride % (4096 / sizeof(double)) == 0)
+        {
+            stride += per_line;
+        }
+    }
+    return _alloc_strided(row, col, stride, site);
+}
+
+bool mat_isContiguous(Matrix *matrix)
+{
+    return matrix->stride == matrix->col || matrix->row == 1;
+}
+
+static void _release_storage(MatrixStorage *storage)
+{
+    if (storage != NULL && atomic_fetch_sub_explicit(&storage->refs, 1, memory_order_acq_rel) == 1)
+    {
+        _track_free(storage->site, storage->bytes);
+        _storage_free(storage->base);
+        free(storage);
+    }
+}
+
+void mat_free(Matrix *matrix)
+{
+    if (matrix == NULL)
+    {
+        return;
+    }
+
+    _release_storage(matrix->storage);
+    atomic_fetch_sub(&live_matrices, 1);
+    free(matrix);
+}
+
+/**
+ * @brief Whether rows of a matrix alias each other, as in a broadcast view.
+ */
+static bool _aliased_rows(Matrix *matrix)
+{
+    return matrix->stride == 0 && matrix->row > 1;
+}
+
+void mat_detach(Matrix *matrix)
+{
+    MatrixStorage *shared = matrix->storage;
+    bool aliased = _aliased_rows(matrix);
+    if (!aliased && (shared == NULL || atomic_load_explicit(&shared->refs, memory_order_acquire) == 1))
+    {
+        return;
+    }
+
+    // A broadcast view becomes dense, so that a write changes a single element.
+    Matrix *own = _alloc_strided(matrix->row, matrix->col, aliased ? matrix->col : matrix->stride,
+                                 shared != NULL ? shared->site : "mat_detach");
+    for (long long i = 0; i < matrix->row; i++)
+    {
+        memcpy(mat_row(own, i), mat_row(matrix, i), matrix->col * sizeof(double));
+    }
+
+    // Several sharers may detach at once, the last one to let go frees the shared storage.
+    matrix->data = own->data;
+    matrix->stride = own->stride;
+    matrix->storage = own->storage;
+    _release_storage(shared);
+
+    own->storage = NULL;
+    mat_free(own);
+}
+
+MatrixMemStats mat_memStats(void)
+{
+    MatrixMemStats stats;
+    stats.live_matrices = atomic_load(&live_matrices);
+    stats.live_bytes = atomic_load(&live_bytes);
+    stats.peak_bytes = atomic_load(&peak_bytes);
+    stats.allocations = atomic_load(&allocations);
+    return stats;
+}
+
+void mat_memReport(void)
+{
+    MatrixMemStats stats = mat_memStats();
+    printf("===== Matrix Memory Report =====\n");
+    printf("Live matrices: %lld\n", stats.live_matrices);
+    printf("Live bytes:    %lld\n", stats.live_bytes);
+    printf("Peak bytes:    %lld\n", stats.peak_bytes);
+    printf("Allocations:   %lld\n", stats.allocations);
+    printf("%-24s %12s %12s %14s\n", "site", "allocations", "live", "live bytes");
+    for (int i = 0; i < MAT_TRACK_SITES; i++)
+    {
+        const char *site = atomic_load(&alloc_sites[i].site);
+        if (site == NULL)
+        {
+            continue;
+        }
+        printf("%-24s %12lld %12lld %14lld\n", site,
+               atomic_load(&alloc_sites[i].allocations),
+               atomic_load(&alloc_sites[i].live_count),
+               atomic_load(&alloc_sites[i].live_bytes));
+    }
+    printf("\n");
+}
+
+void mat_memReportAtExit(void)
+{
+    if (atomic_exchange(&report_registered, 1) == 0)
+    {
+        atexit(mat_memReport);
+    }
+}
+
 Matrix *mat_copy(Matrix *matrix)
 {
-    Matrix *newMatrix = mat_create(matrix->row, matrix->col, matrix->data);
+    if (matrix->storage == NULL || _aliased_rows(matrix))
+    {
+        // Borrowed data may change behind our back, and rows of a broadcast view would
+        // stay aliased, take a dense snapshot.
+        Matrix *newMatrix = mat_alloc(matrix->row, matrix->col);
+        for (long long i = 0; i < matrix->row; i++)
+        {
+            memcpy(mat_row(newMatrix, i), mat_row(matrix, i), matrix->col * sizeof(double));
+        }
+        return newMatrix;
+    }
+
+    Matrix *newMatrix = mat_createStrided(matrix->row, matrix->col, matrix->stride, matrix->data);
+    atomic_fetch_add_explicit(&matrix->storage->refs, 1, memory_order_relaxed);
+    newMatrix->storage = matrix->storage;
     return newMatrix;
 }
 
+Matrix *mat_broadcast(Matrix *matrix, long long row)
+{
+    if (matrix->row != 1 || row <= 0)
+    {
+        fprintf(stderr,
+                "Matrix Broadcast Failed: Only a single row can be broadcast to a positive number of rows. "
+                "matrix: %lld x %lld, row: %lld.\n",
+                matrix->row, matrix->col, row);
+        exit(1);
+    }
+
+    // Every row starts at the same element.
+    Matrix *view = mat_createStrided(row, matrix->col, 0, matrix->data);
+    if (matrix->storage != NULL)
+    {
+        atomic_fetch_add_explicit(&matrix->storage->refs, 1, memory_order_relaxed);
+        view->storage = matrix->storage;
+    }
+    return view;
+}
+
 double mat_read(Matrix *matrix, long long i, long long j)
 {
     if (i < 0 || j < 0 || i >= matrix->row || j >= matrix->col)
@@ -43,7 +367,7 @@ double mat_read(Matrix *matrix, long long i, long long j)
         fprintf(stderr, "Matrix Read Failed: Matrix location index out of bounds.\n");
         exit(1);
     }
-    return matrix->data[i * matrix->col + j];
+    return matrix->data[i * matrix->stride + j];
 }
 
 void mat_write(Matrix *matrix, long long i, long long j, double val)
@@ -53,7 +377,8 @@ void mat_write(Matrix *matrix, long long i, long long j, double val)
         fprintf(stderr, "Matrix Write Failed: Matrix location index out of bounds.\n");
         exit(1);
     }
-    matrix->data[i * matrix->col + j] = val;
+    mat_detach(matrix);
+    matrix->data[i * matrix->stride + j] = val;
     // return matrix;
 }
 
@@ -75,85 +400,214 @@ void mat_print(Matrix *matrix)
     printf("\n");
 }
 
+/**
+ * @brief Split equally sized matrices into spans of consecutive elements, one span per row
+ * unless all of them are contiguous. b and c may be NULL.
+ *
+ * @return Number of spans, len receives their length.
+ */
+static long long _spans(Matrix *a, Matrix *b, Matrix *c, long long *len)
+{
+    if (mat_isContiguous(a) && (b == NULL || mat_isContiguous(b)) && (c == NULL || mat_isContiguous(c)))
+    {
+        *len = a->row * a->col;
+        return 1;
+    }
+    *len = a->col;
+    return a->row;
+}
+
 double mat_elemSum(Matrix *matrix)
 {
+    TRACE_BEGIN();
     if (matrix->row <= 0 || matrix->col <= 0)
     {
         fprintf(stderr, "Matrix Element-wise Sum Failed: Malicious matrix size.");
         exit(1);
     }
+    const MatKernels *kern = kern_get();
     double sum = 0;
-    for (long long i = 0; i < matrix->row * matrix->col; i++)
+    long long len;
+    long long spans = _spans(matrix, NULL, NULL, &len);
+    for (long long r = 0; r < spans; r++)
     {
-        sum += matrix->data[i];
+        sum += kern->sum(mat_row(matrix, r), len);
     }
 
+    TRACE_END("mat_elemSum", matrix->row, matrix->col, 0, matrix->row * matrix->col * sizeof(double), matrix->row * matrix->col);
     return sum;
 }
 
+// Side of the square blocks the transpose works on, a source and a destination block fit in L2.
+#define TRANSPOSE_BLOCK 64
+// Least number of elements worth handing to another thread.
+#define TRANSPOSE_PARALLEL_GRAIN (1 << 16)
+
+typedef struct
+{
+    const MatKernels *kern;
+    Matrix *src;
+    Matrix *dst;
+} TransposeArgs;
+
+static void _transpose_blocks(void *ctx, long long begin, long long end)
+{
+    TransposeArgs *args = ctx;
+    Matrix *src = args->src;
+    for (long long i = begin * TRANSPOSE_BLOCK; i < end * TRANSPOSE_BLOCK && i < src->row; i += TRANSPOSE_BLOCK)
+    {
+        long long rows = src->row - i < TRANSPOSE_BLOCK ? src->row - i : TRANSPOSE_BLOCK;
+        for (long long j = 0; j < src->col; j += TRANSPOSE_BLOCK)
+        {
+            long long cols = src->col - j < TRANSPOSE_BLOCK ? src->col - j : TRANSPOSE_BLOCK;
+            args->kern->transpose(mat_row(args->dst, j) + i, args->dst->stride,
+                                  mat_row(src, i) + j, src->stride, rows, cols);
+        }
+    }
+}
+
 Matrix *mat_transpose(Matrix *matrix)
 {
+    TRACE_BEGIN();
     if (matrix->row <= 0 || matrix->col <= 0)
     {
         fprintf(stderr, "Matrix Transpose Sum Failed: Malicious matrix size.");
         exit(1);
     }
 
-    double *empty_data = malloc(matrix->row * matrix->col * sizeof(double));
+    Matrix *transposed = mat_alloc(matrix->col, matrix->row);
 
-    Matrix *transposed = mat_create(matrix->col, matrix->row, empty_data);
+    // Block rows of the source are independent.
+    TransposeArgs args = {kern_get(), matrix, transposed};
+    long long block_rows = (matrix->row + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    long long grain = TRANSPOSE_PARALLEL_GRAIN / (TRANSPOSE_BLOCK * matrix->col) + 1;
+    par_for(block_rows, grain, _transpose_blocks, &args);
 
-    for (long long i = 0; i < matrix->row; i++)
+    TRACE_END("mat_transpose", matrix->row, matrix->col, 0, 2 * matrix->row * matrix->col * sizeof(double), 0);
+    return transposed;
+}
+
+static void _transpose_square_blocks(void *ctx, long long begin, long long end)
+{
+    TransposeArgs *args = ctx;
+    Matrix *mat = args->src;
+    long long n = mat->row;
+    double tile[TRANSPOSE_BLOCK * TRANSPOSE_BLOCK];
+
+    // Block row bi swaps its blocks right of the diagonal with the matching ones below it.
+    for (long long bi = begin; bi < end; bi++)
     {
-        for (long long j = 0; j < matrix->col; j++)
+        long long i = bi * TRANSPOSE_BLOCK;
+        long long h = n - i < TRANSPOSE_BLOCK ? n - i : TRANSPOSE_BLOCK;
+        for (long long j = i; j < n; j += TRANSPOSE_BLOCK)
         {
-            mat_write(transposed, j, i, mat_read(matrix, i, j));
+            long long w = n - j < TRANSPOSE_BLOCK ? n - j : TRANSPOSE_BLOCK;
+            double *upper = mat_row(mat, i) + j; // h x w
+            double *lower = mat_row(mat, j) + i; // w x h
+
+            args->kern->transpose(tile, h, upper, mat->stride, h, w);
+            if (j != i)
+            {
+                args->kern->transpose(upper, mat->stride, lower, mat->stride, w, h);
+            }
+            for (long long r = 0; r < w; r++)
+            {
+                memcpy(lower + r * mat->stride, tile + r * h, h * sizeof(double));
+            }
         }
     }
+}
 
-    return transposed;
+Matrix *mat_transposeInPlace(Matrix *matrix)
+{
+    TRACE_BEGIN();
+    if (matrix->row <= 0 || matrix->col <= 0)
+    {
+        fprintf(stderr, "Matrix Transpose In Place Failed: Malicious matrix size.");
+        exit(1);
+    }
+
+    if (matrix->row == 1 || matrix->col == 1)
+    {
+        if (!mat_isContiguous(matrix))
+        {
+            fprintf(stderr, "Matrix Transpose In Place Failed: Vector elements are not contiguous.");
+            exit(1);
+        }
+        // A contiguous vector only changes its shape.
+        long long row = matrix->col;
+        matrix->col = matrix->row;
+        matrix->row = row;
+        matrix->stride = matrix->col;
+    }
+    else if (matrix->row == matrix->col)
+    {
+        mat_detach(matrix);
+        TransposeArgs args = {kern_get(), matrix, matrix};
+        long long block_rows = (matrix->row + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+        long long grain = TRANSPOSE_PARALLEL_GRAIN / (TRANSPOSE_BLOCK * matrix->col) + 1;
+        par_for(block_rows, grain, _transpose_square_blocks, &args);
+    }
+    else
+    {
+        fprintf(stderr,
+                "Matrix Transpose In Place Failed: "
+                "Can only transpose square matrices and vectors in place, got %lld x %lld.",
+                matrix->row, matrix->col);
+        exit(1);
+    }
+
+    TRACE_END("mat_transposeInPlace", matrix->row, matrix->col, 0, 2 * matrix->row * matrix->col * sizeof(double), 0);
+    return matrix;
 }
 
 Matrix *mat_addscal(Matrix *mat, double val)
 {
+    TRACE_BEGIN();
 
     if (mat->row <= 0 || mat->col <= 0)
     {
         fprintf(stderr, "Matrix Add Scalar Failed: Malicious matrix size.");
         exit(1);
     }
-    double *added_data = malloc(mat->row * mat->col * sizeof(double));
+    Matrix *added = mat_alloc(mat->row, mat->col);
 
-    for (long long i = 0; i < mat->row * mat->col; i++)
+    const MatKernels *kern = kern_get();
+    long long len;
+    long long spans = _spans(mat, added, NULL, &len);
+    for (long long r = 0; r < spans; r++)
     {
-        added_data[i] = mat->data[i] + val;
+        kern->addscal(mat_row(added, r), mat_row(mat, r), val, len);
     }
 
-    Matrix *added = mat_create(mat->row, mat->col, added_data);
-
+    TRACE_END("mat_addscal", mat->row, mat->col, 0, 2 * mat->row * mat->col * sizeof(double), mat->row * mat->col);
     return added;
 }
 
 Matrix *mat_multscal(Matrix *mat, double val)
 {
+    TRACE_BEGIN();
     if (mat->row <= 0 || mat->col <= 0)
     {
         fprintf(stderr, "Matrix Multiply Scalar Failed: Malicious matrix size.");
         exit(1);
     }
-    double *multiplied_data = malloc(mat->row * mat->col * sizeof(double));
+    Matrix *multiplied = mat_alloc(mat->row, mat->col);
 
-    for (long long i = 0; i < mat->row * mat->col; i++)
+    const MatKernels *kern = kern_get();
+    long long len;
+    long long spans = _spans(mat, multiplied, NULL, &len);
+    for (long long r = 0; r < spans; r++)
     {
-        multiplied_data[i] = mat->data[i] * val;
+        kern->multscal(mat_row(multiplied, r), mat_row(mat, r), val, len);
     }
-
-    Matrix *multiplied = mat_create(mat->row, mat->col, multiplied_data);
+    TRACE_END("mat_multscal", mat->row, mat->col, 0, 2 * mat->row * mat->col * sizeof(double), mat->row * mat->col);
     return multiplied;
 }
 
 Matrix *mat_addmat(Matrix *mat_1, Matrix *mat_2)
 {
+    TRACE_BEGIN();
     if (mat_1->row <= 0 || mat_1->col <= 0 || mat_2->row <= 0 || mat_2->col <= 0)
     {
         fprintf(stderr, "Matrix Add Matrix Failed: Malicious matrix size of mat_1.");
@@ -169,25 +623,33 @@ Matrix *mat_addmat(Matrix *mat_1, Matrix *mat_2)
                 mat_1->row, mat_1->col, mat_2->row, mat_2->col);
     }
 
-    double *added_data = malloc(mat_1->row * mat_1->col * sizeof(double));
+    Matrix *added = mat_alloc(mat_1->row, mat_1->col);
 
-    for (long long i = 0; i < mat_1->row * mat_1->col; i++)
+    const MatKernels *kern = kern_get();
+    long long len;
+    long long spans = _spans(mat_1, mat_2, added, &len);
+    for (long long r = 0; r < spans; r++)
     {
-        added_data[i] = mat_1->data[i] + mat_2->data[i];
+        kern->addmat(mat_row(added, r), mat_row(mat_1, r), mat_row(mat_2, r), len);
     }
 
-    Matrix *added = mat_create(mat_1->row, mat_1->col, added_data);
-
+    TRACE_END("mat_addmat", mat_1->row, mat_1->col, 0, 3 * mat_1->row * mat_1->col * sizeof(double), mat_1->row * mat_1->col);
     return added;
 }
 
 Matrix *mat_difmat(Matrix *mat_1, Matrix *mat_2)
 {
-    return mat_addmat(mat_1, mat_multscal(mat_2, -1));
+    TRACE_BEGIN();
+    Matrix *neg = mat_multscal(mat_2, -1);
+    Matrix *dif = mat_addmat(mat_1, neg);
+    mat_free(neg);
+    TRACE_END("mat_difmat", mat_1->row, mat_1->col, 0, 3 * mat_1->row * mat_1->col * sizeof(double), 2 * mat_1->row * mat_1->col);
+    return dif;
 }
 
 Matrix *mat_pwpmat(Matrix *mat_1, Matrix *mat_2)
 {
+    TRACE_BEGIN();
     if (mat_1->row <= 0 || mat_1->col <= 0 || mat_2->row <= 0 || mat_2->col <= 0)
     {
         fprintf(stderr, "Matrix Point-wise Multiply Matrix Failed: Malicious matrix size of mat_1.");
@@ -204,20 +666,150 @@ Matrix *mat_pwpmat(Matrix *mat_1, Matrix *mat_2)
         exit(1);
     }
 
-    double *multiplied_data = malloc(mat_1->row * mat_1->col * sizeof(double));
+    Matrix *added = mat_alloc(mat_1->row, mat_1->col);
 
-    for (long long i = 0; i < mat_1->row * mat_1->col; i++)
+    const MatKernels *kern = kern_get();
+    long long len;
+    long long spans = _spans(mat_1, mat_2, added, &len);
+    for (long long r = 0; r < spans; r++)
     {
-        multiplied_data[i] = mat_1->data[i] * mat_2->data[i];
+        kern->pwpmat(mat_row(added, r), mat_row(mat_1, r), mat_row(mat_2, r), len);
     }
 
-    Matrix *added = mat_create(mat_1->row, mat_1->col, multiplied_data);
-
+    TRACE_END("mat_pwpmat", mat_1->row, mat_1->col, 0, 3 * mat_1->row * mat_1->col * sizeof(double), mat_1->row * mat_1->col);
     return added;
 }
 
+// Default column and depth block sizes of the GEMM kernel. A KB x NB panel of the right
+// matrix is reused across all rows of the left matrix.
+#define GEMM_BLOCK_N 256
+#define GEMM_BLOCK_K 128
+
+static const MatGemmConfig gemm_defaults = {GEMM_BLOCK_N, GEMM_BLOCK_K, 0, HUGE_VAL, 0};
+static MatGemmConfig gemm_config;
+
+// gemm_config is only read once the state is GEMM_READY, products use gemm_defaults until
+// then, so it can be written while the first product tunes next to other products.
+enum
+{
+    GEMM_UNTUNED,
+    GEMM_TUNING,
+    GEMM_READY
+};
+static atomic_int gemm_state = GEMM_UNTUNED;
+
+MatGemmConfig mat_defaultGemmConfig(void)
+{
+    return gemm_defaults;
+}
+
+void mat_setGemmConfig(const MatGemmConfig *config)
+{
+    MatGemmConfig clamped = *config;
+    clamped.block_n = clamped.block_n < 8 ? 8 : clamped.block_n;
+    clamped.block_k = clamped.block_k < 8 ? 8 : clamped.block_k;
+    gemm_config = clamped;
+    atomic_store_explicit(&gemm_state, GEMM_READY, memory_order_release);
+}
+
+/**
+ * @brief Published configuration, or the defaults before it is complete.
+ */
+static const MatGemmConfig *_published(void)
+{
+    return atomic_load_explicit(&gemm_state, memory_order_acquire) == GEMM_READY ? &gemm_config : &gemm_defaults;
+}
+
+MatGemmConfig mat_getGemmConfig(void)
+{
+    return *_published();
+}
+
+/**
+ * @brief Configuration of mat_multmat, tuned on the first product (tune.h).
+ *
+ * Products running while the first one tunes use the defaults.
+ */
+static const MatGemmConfig *_config(void)
+{
+    int expected = GEMM_UNTUNED;
+    if (atomic_load_explicit(&gemm_state, memory_order_acquire) == GEMM_UNTUNED &&
+        atomic_compare_exchange_strong(&gemm_state, &expected, GEMM_TUNING))
+    {
+        tune_ensure();
+    }
+    return _published();
+}
+
+/**
+ * @brief Blocked row-major GEMM, C = act(A * B + bias), with leading dimensions lda, ldb, ldc.
+ *
+ * Row blocks of KERN_GEMM_MR rows are handed to the GEMM kernel of the selected instruction set.
+ * The epilogue of a row tile runs right after its last K block has been accumulated.
+ */
+static void _gemm(const MatGemmConfig *cfg, const double *A, long long lda, const double *B, long long ldb,
+                  double *C, long long ldc, long long M, long long N, long long K,
+                  const double *bias, MatrixEpilogue act, bool accumulate)
+{
+    const MatKernels *kern = kern_get();
+    long long block_n = cfg->block_n, block_k = cfg->block_k;
+    for (long long jj = 0; jj < N; jj += block_n)
+    {
+        long long nb = N - jj < block_n ? N - jj : block_n;
+
+        for (long long kk = 0; kk < K; kk += block_k)
+        {
+            long long kb = K - kk < block_k ? K - kk : block_k;
+            int last = kk + kb == K;
+
+            for (long long i = 0; i < M; i += KERN_GEMM_MR)
+            {
+                long long mr = M - i < KERN_GEMM_MR ? M - i : KERN_GEMM_MR;
+                double *c = C + i * ldc + jj;
+
+                if (kk == 0 && !accumulate)
+                {
+                    for (long long r = 0; r < mr; r++)
+                    {
+                        for (long long j = 0; j < nb; j++)
+                        {
+                            c[r * ldc + j] = bias != NULL ? bias[jj + j] : 0;
+                        }
+                    }
+                }
+
+                kern->gemm(c, ldc, A + i * lda + kk, lda, B + kk * ldb + jj, ldb, mr, kb, nb);
+
+                if (last)
+                {
+                    for (long long r = 0; r < mr; r++)
+                    {
+                        kern_epilogue(kern, c + r * ldc, nb, act);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void _gemm_dispatch(const MatGemmConfig *cfg, const double *A, long long lda, const double *B, long long ldb,
+                           double *C, long long ldc, long long M, long long N, long long K,
+                           const double *bias, MatrixEpilogue act, bool accumulate);
+
 Matrix *mat_multmat(Matrix *mat_l, Matrix *mat_r)
 {
+    return mat_multmatFused(mat_l, mat_r, NULL, MAT_EPI_NONE, NULL);
+}
+
+Matrix *mat_multmatFused(Matrix *mat_l, Matrix *mat_r, Matrix *bias, MatrixEpilogue act, Matrix *out)
+{
+    return mat_multmatConfig(mat_l, mat_r, bias, act, out, _config());
+}
+
+Matrix *mat_multmatConfig(Matrix *mat_l, Matrix *mat_r, Matrix *bias, MatrixEpilogue act, Matrix *out,
+                          const MatGemmConfig *config)
+{
+    TRACE_BEGIN();
     if (mat_l->row <= 0 || mat_l->col <= 0 || mat_r->row <= 0 || mat_r->col <= 0)
     {
         fprintf(stderr, "Matrix Multiply Matrix Failed: Malicious matrix size of mat_1.");
@@ -236,22 +828,440 @@ Matrix *mat_multmat(Matrix *mat_l, Matrix *mat_r)
         exit(1);
     }
 
-    double *empty_data = malloc(mat_l->row * mat_r->col * sizeof(double));
-    Matrix *multiplied = mat_create(mat_l->row, mat_r->col, empty_data);
+    if (bias != NULL && (bias->row != 1 || bias->col != mat_r->col))
+    {
+        fprintf(stderr,
+                "Matrix Multiply Matrix Failed: "
+                "Bias should have size 1 x %lld, got %lld x %lld.",
+                mat_r->col, bias->row, bias->col);
+        exit(1);
+    }
 
-    for (long long i = 0; i < multiplied->row; i++)
+    if (out == NULL)
+    {
+        out = mat_alloc(mat_l->row, mat_r->col);
+    }
+    else if (out->row != mat_l->row || out->col != mat_r->col)
+    {
+        fprintf(stderr,
+                "Matrix Multiply Matrix Failed: "
+                "Output should have size %lld x %lld, got %lld x %lld.",
+                mat_l->row, mat_r->col, out->row, out->col);
+        exit(1);
+    }
+    else
+    {
+        mat_detach(out);
+    }
+
+    _gemm_dispatch(config, mat_l->data, mat_l->stride, mat_r->data, mat_r->stride, out->data, out->stride,
+                   mat_l->row, mat_r->col, mat_l->col, bias != NULL ? bias->data : NULL, act, false);
+
+    TRACE_END("mat_multmat", mat_l->row, mat_r->col, mat_l->col, (mat_l->row * mat_l->col + mat_r->row * mat_r->col + out->row * out->col) * sizeof(double), 2.0 * mat_l->row * mat_r->col * mat_l->col);
+    return out;
+}
+
+Matrix *mat_multmatAdd(Matrix *mat_l, Matrix *mat_r, Matrix *out)
+{
+    TRACE_BEGIN();
+    if (mat_l->col != mat_r->row || out->row != mat_l->row || out->col != mat_r->col)
+    {
+        fprintf(stderr,
+                "Matrix Multiply Add Failed: "
+                "Cannot add product of size %lld x %lld and size %lld x %lld to size %lld x %lld.",
+                mat_l->row, mat_l->col, mat_r->row, mat_r->col, out->row, out->col);
+        exit(1);
+    }
+
+    mat_detach(out);
+    _gemm_dispatch(_config(), mat_l->data, mat_l->stride, mat_r->data, mat_r->stride, out->data, out->stride,
+                   mat_l->row, mat_r->col, mat_l->col, NULL, MAT_EPI_NONE, true);
+
+    TRACE_END("mat_multmatAdd", mat_l->row, mat_r->col, mat_l->col, (mat_l->row * mat_l->col + mat_r->row * mat_r->col + 2 * out->row * out->col) * sizeof(double), 2.0 * mat_l->row * mat_r->col * mat_l->col);
+    return out;
+}
+
+// Least number of flops worth handing to another thread.
+#define GEMM_PARALLEL_GRAIN (1 << 18)
+
+typedef struct
+{
+    const MatGemmConfig *cfg;
+    const double *a;
+    long long lda, stride_a;
+    const double *b;
+    long long ldb, stride_b;
+    double *c;
+    long long ldc, stride_c;
+    long long m, n, k;
+    long long tile_rows; // Rows of C per task, a multiple of KERN_GEMM_MR.
+    long long tiles;     // Tasks per product.
+    const double *bias;
+    MatrixEpilogue act;
+    bool accumulate;
+} BatchedGemmArgs;
+
+static void _gemm_tiles(void *ctx, long long begin, long long end)
+{
+    BatchedGemmArgs *args = ctx;
+    for (long long t = begin; t < end; t++)
+    {
+        long long p = t / args->tiles;
+        long long i = t % args->tiles * args->tile_rows;
+        long long rows = args->m - i < args->tile_rows ? args->m - i : args->tile_rows;
+        _gemm(args->cfg, args->a + p * args->stride_a + i * args->lda, args->lda,
+              args->b + p * args->stride_b, args->ldb,
+              args->c + p * args->stride_c + i * args->ldc, args->ldc,
+              rows, args->n, args->k, args->bias, args->act, args->accumulate);
+    }
+}
+
+/**
+ * @brief Run a batch of products on the thread pool: whole products when the batch alone
+ * keeps every thread busy, otherwise row tiles of them too.
+ */
+static void _gemm_batched(BatchedGemmArgs *args, long long batch)
+{
+    long long m = args->m;
+    long long min_tasks = par_threads() > 1 ? 4LL * par_threads() : 1;
+    long long parts = batch >= min_tasks ? 1 : (min_tasks + batch - 1) / batch;
+    long long tile_rows = (m + parts - 1) / parts;
+    args->tile_rows = (tile_rows + KERN_GEMM_MR - 1) / KERN_GEMM_MR * KERN_GEMM_MR;
+    args->tiles = (m + args->tile_rows - 1) / args->tile_rows;
+
+    double tile_flops = 2.0 * args->tile_rows * args->n * args->k;
+    par_for(batch * args->tiles, (long long)(GEMM_PARALLEL_GRAIN / tile_flops) + 1, _gemm_tiles, args);
+}
+
+void mat_multmatBatched(const double *a, long long lda, long long stride_a,
+                        const double *b, long long ldb, long long stride_b,
+                        double *c, long long ldc, long long stride_c,
+                        long long m, long long n, long long k, long long batch)
+{
+    TRACE_BEGIN();
+    if (m <= 0 || n <= 0 || k <= 0 || batch <= 0 || lda < k || ldb < n || ldc < n)
+    {
+        fprintf(stderr,
+                "Matrix Multiply Batched Failed: "
+                "Invalid batch of %lld products of size %lld x %lld and %lld x %lld "
+                "with leading dimensions %lld, %lld and %lld.\n",
+                batch, m, k, k, n, lda, ldb, ldc);
+        exit(1);
+    }
+
+    if (batch > 1 && stride_c < (m - 1) * ldc + n)
+    {
+        fprintf(stderr,
+                "Matrix Multiply Batched Failed: "
+                "Output stride %lld is smaller than an output of size %lld x %lld with leading dimension %lld.\n",
+                stride_c, m, n, ldc);
+        exit(1);
+    }
+
+    BatchedGemmArgs args = {_config(), a, lda, stride_a, b, ldb, stride_b, c, ldc, stride_c, m, n, k,
+                            0, 0, NULL, MAT_EPI_NONE, false};
+    _gemm_batched(&args, batch);
+
+    TRACE_END("mat_multmatBatched", m, n, k, batch * (m * k + k * n + m * n) * sizeof(double), 2.0 * batch * m * n * k);
+}
+
+// Below this size products go to the classic blocked GEMM, see mat_setStrassenCrossover.
+#define STRASSEN_DEFAULT_CROSSOVER 4096
+
+static atomic_llong strassen_crossover = STRASSEN_DEFAULT_CROSSOVER;
+
+void mat_setStrassenCrossover(long long size)
+{
+    atomic_store(&strassen_crossover, size < 2 ? 2 : size);
+}
+
+long long mat_getStrassenCrossover(void)
+{
+    return atomic_load(&strassen_crossover);
+}
+
+// dst = x + sign * y for rows x cols blocks with leading dimensions ldd, ldx and ldy.
+static void _sw_combine(double *dst, long long ldd, const double *x, long long ldx,
+                        const double *y, long long ldy, long long rows, long long cols, double sign)
+{
+    for (long long i = 0; i < rows; i++)
     {
-        for (long long j = 0; j < multiplied->col; j++)
+        double *d = dst + i * ldd;
+        const double *a = x + i * ldx, *b = y + i * ldy;
+        for (long long j = 0; j < cols; j++)
         {
-            // Locate the row & col of the new matrix.
-            double lin_comb = 0;
-            for (long long k = 0; k < mat_l->col; k++)
+            d[j] = a[j] + sign * b[j];
+        }
+    }
+}
+
+// Workspace of a Strassen-Winograd product, summed over the recursion levels.
+static long long _sw_workspace(long long m, long long n, long long k, long long crossover)
+{
+    long long total = 0;
+    while (m >= crossover && n >= crossover && k >= crossover)
+    {
+        m /= 2, n /= 2, k /= 2;
+        total += m * (k > n ? k : n) + k * n;
+    }
+    return total;
+}
+
+/**
+ * @brief C = A * B by Strassen-Winograd recursion down to the crossover, then _gemm.
+ *
+ * Every level uses two temporaries X and Y from work and the quadrants of C, in the schedule
+ * of Boyer, Dumas, Pernet and Zhou (2009). Odd sizes are handled by peeling the last row,
+ * column or inner index off with _gemm.
+ */
+static void _strassen(const MatGemmConfig *cfg, const double *A, long long lda, const double *B, long long ldb,
+                      double *C, long long ldc, long long m, long long n, long long k,
+                      double *work, long long crossover)
+{
+    if (m < crossover || n < crossover || k < crossover)
+    {
+        _gemm(cfg, A, lda, B, ldb, C, ldc, m, n, k, NULL, MAT_EPI_NONE, false);
+        return;
+    }
+
+    long long m2 = m / 2, n2 = n / 2, k2 = k / 2;
+    long long ldx = k2 > n2 ? k2 : n2;
+    double *X = work, *Y = work + m2 * ldx, *next = Y + k2 * n2;
+
+    const double *A11 = A, *A12 = A + k2, *A21 = A + m2 * lda, *A22 = A21 + k2;
+    const double *B11 = B, *B12 = B + n2, *B21 = B + k2 * ldb, *B22 = B21 + n2;
+    double *C11 = C, *C12 = C + n2, *C21 = C + m2 * ldc, *C22 = C21 + n2;
+
+    _sw_combine(X, ldx, A11, lda, A21, lda, m2, k2, -1);            // S3 = A11 - A21
+    _sw_combine(Y, n2, B22, ldb, B12, ldb, k2, n2, -1);             // T3 = B22 - B12
+    _strassen(cfg, X, ldx, Y, n2, C21, ldc, m2, n2, k2, next, crossover); // P7 = S3 * T3
+    _sw_combine(X, ldx, A21, lda, A22, lda, m2, k2, 1);             // S1 = A21 + A22
+    _sw_combine(Y, n2, B12, ldb, B11, ldb, k2, n2, -1);             // T1 = B12 - B11
+    _strassen(cfg, X, ldx, Y, n2, C22, ldc, m2, n2, k2, next, crossover); // P5 = S1 * T1
+    _sw_combine(X, ldx, X, ldx, A11, lda, m2, k2, -1);              // S2 = S1 - A11
+    _sw_combine(Y, n2, B22, ldb, Y, n2, k2, n2, -1);                // T2 = B22 - T1
+    _strassen(cfg, X, ldx, Y, n2, C12, ldc, m2, n2, k2, next, crossover); // P6 = S2 * T2
+    _sw_combine(X, ldx, A12, lda, X, ldx, m2, k2, -1);              // S4 = A12 - S2
+    _strassen(cfg, X, ldx, B22, ldb, C11, ldc, m2, n2, k2, next, crossover); // P3 = S4 * B22
+    _strassen(cfg, A11, lda, B11, ldb, X, ldx, m2, n2, k2, next, crossover); // P1 = A11 * B11
+    _sw_combine(C12, ldc, X, ldx, C12, ldc, m2, n2, 1);             // U2 = P1 + P6
+    _sw_combine(C21, ldc, C12, ldc, C21, ldc, m2, n2, 1);           // U3 = U2 + P7
+    _sw_combine(C12, ldc, C12, ldc, C22, ldc, m2, n2, 1);           // U4 = U2 + P5
+    _sw_combine(C22, ldc, C21, ldc, C22, ldc, m2, n2, 1);           // U7 = U3 + P5
+    _sw_combine(C12, ldc, C12, ldc, C11, ldc, m2, n2, 1);           // U5 = U4 + P3
+    _sw_combine(Y, n2, Y, n2, B21, ldb, k2, n2, -1);                // T4 = T2 - B21
+    _strassen(cfg, A22, lda, Y, n2, C11, ldc, m2, n2, k2, next, crossover); // P4 = A22 * T4
+    _sw_combine(C21, ldc, C21, ldc, C11, ldc, m2, n2, -1);          // U6 = U3 - P4
+    _strassen(cfg, A12, lda, B21, ldb, C11, ldc, m2, n2, k2, next, crossover); // P2 = A12 * B21
+    _sw_combine(C11, ldc, X, ldx, C11, ldc, m2, n2, 1);             // U1 = P1 + P2
+
+    if (k > 2 * k2)
+    {
+        _gemm(cfg, A + 2 * k2, lda, B + 2 * k2 * ldb, ldb, C, ldc, 2 * m2, 2 * n2, 1, NULL, MAT_EPI_NONE, true);
+    }
+    if (n > 2 * n2)
+    {
+        _gemm(cfg, A, lda, B + 2 * n2, ldb, C + 2 * n2, ldc, 2 * m2, 1, k, NULL, MAT_EPI_NONE, false);
+    }
+    if (m > 2 * m2)
+    {
+        _gemm(cfg, A + 2 * m2 * lda, lda, B, ldb, C + 2 * m2 * ldc, ldc, 1, n, k, NULL, MAT_EPI_NONE, false);
+    }
+}
+
+Matrix *mat_multmatStrassen(Matrix *mat_l, Matrix *mat_r, Matrix *out)
+{
+    TRACE_BEGIN();
+    if (mat_l->col != mat_r->row)
+    {
+        fprintf(stderr,
+                "Matrix Multiply Strassen Failed: "
+                "Cannot multiply matrix with size %lld x %lld and size %lld x %lld.\n",
+                mat_l->row, mat_l->col, mat_r->row, mat_r->col);
+        exit(1);
+    }
+
+    if (out == NULL)
+    {
+        out = mat_alloc(mat_l->row, mat_r->col);
+    }
+    else if (out->row != mat_l->row || out->col != mat_r->col)
+    {
+        fprintf(stderr,
+                "Matrix Multiply Strassen Failed: "
+                "Output should have size %lld x %lld, got %lld x %lld.\n",
+                mat_l->row, mat_r->col, out->row, out->col);
+        exit(1);
+    }
+    else
+    {
+        mat_detach(out);
+    }
+
+    long long m = mat_l->row, n = mat_r->col, k = mat_l->col;
+    long long crossover = mat_getStrassenCrossover();
+    long long size = _sw_workspace(m, n, k, crossover);
+    Matrix *work = size > 0 ? mat_alloc(1, size) : NULL;
+    _strassen(_config(), mat_l->data, mat_l->stride, mat_r->data, mat_r->stride, out->data, out->stride,
+              m, n, k, work != NULL ? work->data : NULL, crossover);
+    mat_free(work);
+
+    TRACE_END("mat_multmatStrassen", m, n, k, (m * k + k * n + m * n + size) * sizeof(double), 2.0 * m * n * k);
+    return out;
+}
+
+// Unblocked product for tiny shapes, where the blocking and kernel calls cost more than the loops.
+static void _gemm_small(const double *A, long long lda, const double *B, long long ldb,
+                        double *C, long long ldc, long long M, long long N, long long K,
+                        const double *bias, MatrixEpilogue act, bool accumulate)
+{
+    for (long long i = 0; i < M; i++)
+    {
+        double *c = C + i * ldc;
+        for (long long j = 0; !accumulate && j < N; j++)
+        {
+            c[j] = bias != NULL ? bias[j] : 0;
+        }
+        for (long long k = 0; k < K; k++)
+        {
+            double a_ik = A[i * lda + k];
+            const double *b = B + k * ldb;
+            for (long long j = 0; j < N; j++)
             {
-                lin_comb += mat_read(mat_l, i, k) * mat_read(mat_r, k, j);
+                c[j] += a_ik * b[j];
             }
-            mat_write(multiplied, i, j, lin_comb);
+        }
+        if (act != MAT_EPI_NONE)
+        {
+            kern_epilogue(kern_get(), c, N, act);
         }
     }
+}
 
-    return multiplied;
+// Least number of multiply-adds of a matrix-vector product worth handing to another thread.
+#define GEMV_PARALLEL_GRAIN (1 << 16)
+// Columns of a row vector-matrix product per task, a multiple of every vector width.
+#define GEMV_COLUMN_BLOCK 64
+
+typedef struct
+{
+    const MatKernels *kern;
+    const double *a; // Matrix of the product.
+    long long lda;
+    const double *x; // Contiguous vector of the product.
+    double *y;       // Contiguous output vector.
+    long long m, k;  // Output size and depth.
+    const double *bias;
+    MatrixEpilogue act;
+    bool accumulate;
+} GemvArgs;
+
+static void _vecmat_blocks(void *ctx, long long begin, long long end)
+{
+    GemvArgs *args = ctx;
+    long long j = begin * GEMV_COLUMN_BLOCK;
+    long long n = (end * GEMV_COLUMN_BLOCK < args->m ? end * GEMV_COLUMN_BLOCK : args->m) - j;
+    double *y = args->y + j;
+    for (long long i = 0; !args->accumulate && i < n; i++)
+    {
+        y[i] = args->bias != NULL ? args->bias[j + i] : 0;
+    }
+    args->kern->vecmat(y, args->x, args->a + j, args->lda, args->k, n);
+    kern_epilogue(args->kern, y, n, args->act);
+}
+
+static void _matvec_rows(void *ctx, long long begin, long long end)
+{
+    GemvArgs *args = ctx;
+    double *y = args->y + begin;
+    for (long long i = 0; !args->accumulate && i < end - begin; i++)
+    {
+        y[i] = args->bias != NULL ? args->bias[0] : 0;
+    }
+    args->kern->matvec(y, args->a + begin * args->lda, args->lda, args->x, end - begin, args->k);
+    kern_epilogue(args->kern, y, end - begin, args->act);
+}
+
+/**
+ * @brief Products with a single row or column, which stream the matrix once and are bound by
+ * memory rather than arithmetic. Wide ones are split over the thread pool.
+ */
+static void _gemv(const double *A, long long lda, const double *B, long long ldb,
+                  double *C, long long ldc, long long M, long long N, long long K,
+                  const double *bias, MatrixEpilogue act, bool accumulate)
+{
+    const MatKernels *kern = kern_get();
+    if (N > 1)
+    {
+        // Row vector times matrix, rows of C and A are contiguous.
+        GemvArgs args = {kern, B, ldb, A, C, N, K, bias, act, accumulate};
+        long long blocks = (N + GEMV_COLUMN_BLOCK - 1) / GEMV_COLUMN_BLOCK;
+        par_for(blocks, GEMV_PARALLEL_GRAIN / (K * GEMV_COLUMN_BLOCK) + 1, _vecmat_blocks, &args);
+        return;
+    }
+
+    // Matrix times column vector, gathering strided columns.
+    Matrix *x = ldb == 1 ? NULL : mat_alloc(1, K);
+    Matrix *y = ldc == 1 ? NULL : mat_alloc(1, M);
+    for (long long k = 0; x != NULL && k < K; k++)
+    {
+        x->data[k] = B[k * ldb];
+    }
+    for (long long i = 0; y != NULL && accumulate && i < M; i++)
+    {
+        y->data[i] = C[i * ldc];
+    }
+
+    GemvArgs args = {kern, A, lda, x != NULL ? x->data : B, y != NULL ? y->data : C, M, K, bias, act, accumulate};
+    par_for(M, GEMV_PARALLEL_GRAIN / K + 1, _matvec_rows, &args);
+
+    for (long long i = 0; y != NULL && i < M; i++)
+    {
+        C[i * ldc] = y->data[i];
+    }
+    mat_free(x);
+    mat_free(y);
+}
+
+/**
+ * @brief Pick the algorithm of a product from its shape and the configuration: matrix-vector
+ * kernels for a single row or column, unblocked for
+ * tiny products, Strassen-Winograd for huge ones, row tiles over the thread pool for large
+ * ones and the serial blocked GEMM otherwise.
+ */
+static void _gemm_dispatch(const MatGemmConfig *cfg, const double *A, long long lda, const double *B, long long ldb,
+                           double *C, long long ldc, long long M, long long N, long long K,
+                           const double *bias, MatrixEpilogue act, bool accumulate)
+{
+    if (M == 1 || N == 1)
+    {
+        _gemv(A, lda, B, ldb, C, ldc, M, N, K, bias, act, accumulate);
+        return;
+    }
+
+    double flops = 2.0 * M * N * K;
+    if (flops <= cfg->small_flops)
+    {
+        _gemm_small(A, lda, B, ldb, C, ldc, M, N, K, bias, act, accumulate);
+        return;
+    }
+
+    long long smin = cfg->strassen_min;
+    if (smin > 0 && M >= smin && N >= smin && K >= smin && bias == NULL && act == MAT_EPI_NONE && !accumulate)
+    {
+        long long size = _sw_workspace(M, N, K, smin);
+        Matrix *work = mat_alloc(1, size);
+        _strassen(cfg, A, lda, B, ldb, C, ldc, M, N, K, work->data, smin);
+        mat_free(work);
+        return;
+    }
+
+    if (flops >= cfg->parallel_flops && par_threads() > 1)
+    {
+        BatchedGemmArgs args = {cfg, A, lda, 0, B, ldb, 0, C, ldc, 0, M, N, K, 0, 0, bias, act, accumulate};
+        _gemm_batched(&args, 1);
+        return;
+    }
+
+    _gemm(cfg, A, lda, B, ldb, C, ldc, M, N, K, bias, act, accumulate);
 }
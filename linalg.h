@@ -1,17 +1,80 @@
 #ifndef LINALG_H
 #define LINALG_H
 
+#include <stdbool.h>
+
+/**
+ * @brief Alignment in bytes of the data owned by a matrix.
+ *
+ */
+#define MAT_ALIGNMENT 64
+
+/**
+ * @brief Owned storage of a matrix, see mat_alloc.
+ *
+ */
+typedef struct MatrixStorage MatrixStorage;
+
 /**
  * @brief Matrix struct.
  *
+ * Element (i, j) is stored at data[i * stride + j]. stride is the leading dimension,
+ * at least col, and larger than col when rows are padded (mat_allocPadded), or 0 when one
+ * row is broadcast to all of them (mat_broadcast).
+ * storage is NULL when data is borrowed from the caller (mat_create). Owned storage is
+ * reference counted and may be shared by several matrices (mat_copy), it is copied on
+ * the first write through any of them (mat_detach) and released with the last of them.
  */
 typedef struct
 {
     long long row;
     long long col;
+    long long stride;
     double *data;
+    MatrixStorage *storage;
 } Matrix;
 
+/**
+ * @brief Allocation statistics of matrices.
+ *
+ */
+typedef struct
+{
+    long long live_matrices;
+    long long live_bytes;
+    long long peak_bytes;
+    long long allocations;
+} MatrixMemStats;
+
+/**
+ * @brief Element-wise operation fused into the end of a matrix multiplication.
+ *
+ */
+typedef enum
+{
+    MAT_EPI_NONE,
+    MAT_EPI_RELU,
+    MAT_EPI_SIGMOID,
+    MAT_EPI_TANH
+} MatrixEpilogue;
+
+/**
+ * @brief Block sizes and algorithm crossovers of mat_multmat, tuned per host (tune.h).
+ *
+ * Products of at most small_flops flops run unblocked loops, products whose sizes are all
+ * at least strassen_min use Strassen-Winograd down to that size, products of at least
+ * parallel_flops flops are split into row tiles over the thread pool, and the rest run
+ * the serial blocked GEMM with block_n x block_k panels of the right matrix.
+ */
+typedef struct
+{
+    long long block_n;
+    long long block_k;
+    double small_flops;
+    double parallel_flops;
+    long long strassen_min; // 0 never uses Strassen-Winograd.
+} MatGemmConfig;
+
 /**
  * @brief Create a matrix with given size and data.
  *
@@ -22,14 +85,146 @@ typedef struct
  */
 Matrix *mat_create(long long row, long long col, double *data);
 
+/**
+ * @brief Create a matrix with given size, leading dimension and data.
+ *
+ * @param row Row size of matrix.
+ * @param col Column size of matrix.
+ * @param stride Number of elements between the starts of two rows, at least col, or 0 for
+ * a matrix whose rows all read the same elements (see mat_broadcast).
+ * @param data Data array of the matrix.
+ * @return Matrix*
+ */
+Matrix *mat_createStrided(long long row, long long col, long long stride, double *data);
+
+/**
+ * @brief Create a matrix that owns newly allocated, uninitialized data.
+ *
+ * The data is aligned to MAT_ALIGNMENT bytes and rows are packed, stride == col.
+ * The allocation is accounted to the calling function, see mat_memReport.
+ *
+ * @param row Row size of matrix.
+ * @param col Column size of matrix.
+ * @return Matrix*
+ */
+#define mat_alloc(row, col) mat_allocAt((row), (col), __func__)
+
+/**
+ * @brief Create a matrix that owns newly allocated, uninitialized data.
+ *
+ * @param row Row size of matrix.
+ * @param col Column size of matrix.
+ * @param site Name the allocation is accounted to, must outlive the matrix.
+ * @return Matrix*
+ */
+Matrix *mat_allocAt(long long row, long long col, const char *site);
+
+/**
+ * @brief Create a matrix that owns newly allocated, uninitialized data with padded rows.
+ *
+ * Every row starts on a MAT_ALIGNMENT boundary, and the leading dimension is chosen so
+ * that it is not a multiple of 4096 bytes, which would map the same column of all rows
+ * to the same cache sets. Matrices with less than 8 columns are not padded.
+ *
+ * @param row Row size of matrix.
+ * @param col Column size of matrix.
+ * @return Matrix*
+ */
+#define mat_allocPadded(row, col) mat_allocPaddedAt((row), (col), __func__)
+
+/**
+ * @brief Create a matrix that owns newly allocated, uninitialized data with padded rows.
+ *
+ * @param row Row size of matrix.
+ * @param col Column size of matrix.
+ * @param site Name the allocation is accounted to, must outlive the matrix.
+ * @return Matrix*
+ */
+Matrix *mat_allocPaddedAt(long long row, long long col, const char *site);
+
+/**
+ * @brief Pointer to the first element of row i.
+ *
+ * @param matrix Matrix struct pointer.
+ * @param i Row index.
+ * @return double*
+ */
+#define mat_row(matrix, i) ((matrix)->data + (i) * (matrix)->stride)
+
+/**
+ * @brief Whether the rows of a matrix are stored back to back, so that its data can be
+ * traversed as a single array of row * col elements.
+ *
+ * @param matrix Matrix struct pointer.
+ * @return bool
+ */
+bool mat_isContiguous(Matrix *matrix);
+
+/**
+ * @brief Free a matrix, and its data if the matrix owns it.
+ *
+ * @param matrix Matrix struct pointer, may be NULL.
+ */
+void mat_free(Matrix *matrix);
+
+/**
+ * @brief Read the current allocation statistics.
+ *
+ * @return MatrixMemStats
+ */
+MatrixMemStats mat_memStats(void);
+
+/**
+ * @brief Print allocation statistics, and live allocations per call site.
+ *
+ */
+void mat_memReport(void);
+
+/**
+ * @brief Print mat_memReport when the program exits.
+ *
+ * Also enabled by setting the environment variable CNN_MEMREPORT.
+ */
+void mat_memReportAtExit(void);
+
 /**
  * @brief Copy an existing matrix to a new address.
  *
+ * The copy shares the storage of matrix until either of them is written, and both are
+ * freed independently. Borrowed data and broadcast views (mat_broadcast) are copied right
+ * away into ordinary matrices.
+ *
  * @param matrix
  * @return Matrix*
  */
 Matrix *mat_copy(Matrix *matrix);
 
+/**
+ * @brief View a single row matrix as a matrix of row identical rows, without copying.
+ *
+ * The view has stride 0 and shares the data of matrix like mat_copy does (borrowed data is
+ * borrowed again), so element-wise operations and products read it directly, e.g. to add a
+ * bias row to every sample of a batch. mat_copy of the view, the results of operations on
+ * it, and the view itself once written by mat_write or another library function
+ * (mat_detach) are ordinary matrices. Writing data directly changes every row.
+ *
+ * @param matrix Matrix with one row.
+ * @param row Number of rows of the view.
+ * @return Matrix*
+ */
+Matrix *mat_broadcast(Matrix *matrix, long long row);
+
+/**
+ * @brief Give a matrix its own copy of storage it shares with other matrices.
+ *
+ * Library functions writing into an existing matrix call this first. Code writing to
+ * data directly must call it too, unless the matrix was just allocated. A broadcast view
+ * gets dense storage of its own, even when it is the only user of its storage.
+ *
+ * @param matrix Matrix struct pointer.
+ */
+void mat_detach(Matrix *matrix);
+
 /**
  * @brief Read a matrix value.
  *
@@ -74,6 +269,14 @@ double mat_elemSum(Matrix *matrix);
  */
 Matrix *mat_transpose(Matrix *matrix);
 
+/**
+ * @brief Transpose a square matrix or a contiguous vector in place.
+ *
+ * @param matrix Matrix struct pointer.
+ * @return Matrix* matrix itself.
+ */
+Matrix *mat_transposeInPlace(Matrix *matrix);
+
 /**
  * @brief Matrix addition with scalar.
  *
@@ -122,10 +325,138 @@ Matrix *mat_pwpmat(Matrix *mat_1, Matrix *mat_2);
 /**
  * @brief Matrix multiplication.
  *
+ * The path is picked per shape from the tuned configuration, see mat_setGemmConfig.
+ *
  * @param mat_l Left matrix.
  * @param mat_r Right matrix.
  * @return Matrix*
  */
 Matrix *mat_multmat(Matrix *mat_l, Matrix *mat_r);
 
+/**
+ * @brief Matrix multiplication with a fused bias and activation epilogue.
+ *
+ * Computes act(mat_l * mat_r + bias). The bias row is added and the activation applied
+ * to each output tile right after its last accumulation, while it is still in cache.
+ *
+ * @param mat_l Left matrix.
+ * @param mat_r Right matrix.
+ * @param bias Row matrix of size 1 x mat_r->col added to every output row, or NULL.
+ * @param act Activation applied to every output element.
+ * @param out Output matrix of size mat_l->row x mat_r->col, or NULL to allocate one.
+ * @return Matrix*
+ */
+Matrix *mat_multmatFused(Matrix *mat_l, Matrix *mat_r, Matrix *bias, MatrixEpilogue act, Matrix *out);
+
+/**
+ * @brief mat_multmatFused with an explicit configuration instead of the tuned one.
+ *
+ * @param mat_l Left matrix.
+ * @param mat_r Right matrix.
+ * @param bias Row matrix of size 1 x mat_r->col added to every output row, or NULL.
+ * @param act Activation applied to every output element.
+ * @param out Output matrix of size mat_l->row x mat_r->col, or NULL to allocate one.
+ * @param config Block sizes and crossovers.
+ * @return Matrix*
+ */
+Matrix *mat_multmatConfig(Matrix *mat_l, Matrix *mat_r, Matrix *bias, MatrixEpilogue act, Matrix *out,
+                          const MatGemmConfig *config);
+
+/**
+ * @brief Configuration mat_multmat uses. The first product loads or tunes it (tune_ensure).
+ *
+ * @return MatGemmConfig
+ */
+MatGemmConfig mat_getGemmConfig(void);
+
+/**
+ * @brief Configuration used before tuning: fixed blocks, no unblocked, threaded or
+ * Strassen-Winograd products.
+ *
+ * @return MatGemmConfig
+ */
+MatGemmConfig mat_defaultGemmConfig(void);
+
+/**
+ * @brief Set the configuration of mat_multmat, which then skips tuning.
+ *
+ * Products use the defaults until the first configuration is complete, so the first call may
+ * run next to products; later calls must not be made while a product is running.
+ *
+ * @param config Block sizes and crossovers.
+ */
+void mat_setGemmConfig(const MatGemmConfig *config);
+
+/**
+ * @brief Accumulating matrix multiplication, out += mat_l * mat_r, in place.
+ *
+ * @param mat_l Left matrix.
+ * @param mat_r Right matrix.
+ * @param out Matrix of size mat_l->row x mat_r->col to add the product to.
+ * @return Matrix* out.
+ */
+Matrix *mat_multmatAdd(Matrix *mat_l, Matrix *mat_r, Matrix *out);
+
+/**
+ * @brief Strided batched matrix multiplication, C_p = A_p * B_p for every p in [0, batch).
+ *
+ * A_p is the m x k matrix at a + p * stride_a with leading dimension lda, B_p and C_p
+ * likewise. A stride of 0 uses the same operand for every product, e.g. a shared weight.
+ * The outputs must not overlap and are written in place, nothing is allocated. Products,
+ * and row tiles of them when the batch is small, are distributed over the thread pool.
+ *
+ * @param a Base of the left matrices.
+ * @param lda Leading dimension of the left matrices.
+ * @param stride_a Elements between consecutive left matrices.
+ * @param b Base of the right matrices.
+ * @param ldb Leading dimension of the right matrices.
+ * @param stride_b Elements between consecutive right matrices.
+ * @param c Base of the outputs.
+ * @param ldc Leading dimension of the outputs.
+ * @param stride_c Elements between consecutive outputs.
+ * @param m Row size of the left matrices and outputs.
+ * @param n Column size of the right matrices and outputs.
+ * @param k Column size of the left matrices, row size of the right ones.
+ * @param batch Number of products.
+ */
+void mat_multmatBatched(const double *a, long long lda, long long stride_a,
+                        const double *b, long long ldb, long long stride_b,
+                        double *c, long long ldc, long long stride_c,
+                        long long m, long long n, long long k, long long batch);
+
+/**
+ * @brief Matrix multiplication by Strassen-Winograd recursion, for very large products.
+ *
+ * Every level splits the operands in halves and forms the product from 7 half size
+ * products and 15 additions instead of 8 products, until a dimension falls below the
+ * crossover (mat_setStrassenCrossover), where the blocked GEMM takes over. The temporaries
+ * of all levels come from one workspace of about (2/3) n^2 elements allocated per call.
+ *
+ * The error bound is normwise only: |C - fl(C)| <= c(n) u ||A|| ||B|| with
+ * c(n) ~ (n / n0)^log2(18) (n0^2 + 6 n0) for crossover n0 and unit roundoff u (Higham,
+ * Accuracy and Stability of Numerical Algorithms, 2nd ed., sec. 23.2.3), against the
+ * componentwise n u |A| |B| of mat_multmat. Each level multiplies the constant by about
+ * 4.5, and elements of C much smaller than ||A|| ||B|| may lose their relative accuracy.
+ *
+ * @param mat_l Left matrix.
+ * @param mat_r Right matrix.
+ * @param out Output matrix of size mat_l->row x mat_r->col, or NULL to allocate one.
+ * @return Matrix*
+ */
+Matrix *mat_multmatStrassen(Matrix *mat_l, Matrix *mat_r, Matrix *out);
+
+/**
+ * @brief Set the size below which mat_multmatStrassen stops recursing.
+ *
+ * @param size Crossover, any of the row, inner or column size below it ends the recursion.
+ */
+void mat_setStrassenCrossover(long long size);
+
+/**
+ * @brief Size below which mat_multmatStrassen stops recursing.
+ *
+ * @return long long
+ */
+long long mat_getStrassenCrossover(void);
+
 #endif
@@ -13,9 +13,21 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <math.h>
 #include "linalg.h"
 #include "xlinalg.h"
 #include "nn.h"
+#include "kernels.h"
+#include "batch.h"
+#include "serve.h"
+#include "trace.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 int demo_xlinalg()
 {
@@ -210,7 +222,7 @@ void demo_xornn()
     double f1 = (2 * precision * recall) / (double)(precision + recall);
 
     printf("\n~~~ NN Final output states ~~~\n");
-    mat_print(xor_nn->output_states[2]);
+    mat_print(xor_nn->context->states[xor_nn->hidden_num + 2]);
 
     printf("\n~~~ Confusion Matrix ~~~\n");
     printf("TP: %f, TN: %f, FP: %f, FN: %f\n", tp, tn, fp, fn);
@@ -229,6 +241,199 @@ void demo_xornn()
     free(xor_nn);
 }
 
+/**
+ * @brief Check bmat_multmat in place against the out of place product, for square and
+ * rectangular left operands, on every supported instruction set.
+ *
+ * @return int Number of failed checks.
+ */
+static int _check_bmat_inplace()
+{
+    int failures = 0;
+    CpuIsa selected = cpu_isa();
+    long long sizes[2][2] = {{4, 4}, {3, 4}};
+    for (int isa = CPU_ISA_SCALAR; isa < CPU_ISA_COUNT; isa++)
+    {
+        if (!cpu_isaSupported(isa))
+        {
+            continue;
+        }
+        cpu_setIsa(isa);
+        for (int s = 0; s < 2; s++)
+        {
+            long long m = sizes[s][0], n = sizes[s][1], count = 11;
+            BatchMatrix *a = bmat_alloc(count, m, n);
+            BatchMatrix *b = bmat_alloc(count, n, n);
+            for (long long k = 0; k < count; k++)
+            {
+                Matrix *x = xmat_rand(m, n), *y = xmat_rand(n, n);
+                bmat_set(a, k, x);
+                bmat_set(b, k, y);
+                mat_free(x);
+                mat_free(y);
+            }
+
+            BatchMatrix *ref = bmat_multmat(a, b, NULL);
+            bmat_multmat(a, b, a);
+            double err = 0;
+            for (long long k = 0; k < count; k++)
+            {
+                for (long long i = 0; i < m; i++)
+                {
+                    for (long long j = 0; j < n; j++)
+                    {
+                        err = fmax(err, fabs(bmat_at(a, k, i, j) - bmat_at(ref, k, i, j)));
+                    }
+                }
+            }
+            bool ok = err == 0;
+            printf("%-8s bmat %lldx%lld in place  max error %.3e  %s\n", cpu_isaName(isa), m, n, err,
+                   ok ? "ok" : "FAILED");
+            failures += ok ? 0 : 1;
+
+            bmat_free(a);
+            bmat_free(b);
+            bmat_free(ref);
+        }
+    }
+    cpu_setIsa(selected);
+    return failures;
+}
+
+int demo_isa()
+{
+    printf("Best instruction set: %s\n", cpu_isaName(cpu_bestIsa()));
+    printf("Selected instruction set: %s\n\n", cpu_isaName(cpu_isa()));
+
+    int failures = kern_selfTest(true);
+    failures += _check_bmat_inplace();
+    printf("\n%d kernel checks failed.\n", failures);
+    return failures;
+}
+
+#ifndef _WIN32
+
+#define SERVE_DEMO_CLIENTS 32
+#define SERVE_DEMO_REQUESTS 200
+#define SERVE_DEMO_SOCKET "/tmp/cnn_serve_demo.sock"
+
+typedef struct
+{
+    NN *nn;
+    bool via_socket;
+    long long *latencies; // SERVE_DEMO_REQUESTS nanoseconds per client.
+} ServeDemoClient;
+
+static void *_serve_demo_client(void *arg)
+{
+    ServeDemoClient *client = arg;
+    long long in = client->nn->input_size, out = client->nn->output_size;
+    Matrix *input = xmat_rand(1, in);
+    double *output = malloc(out * sizeof(double));
+
+    // Either a thread of its own running the model, or a connection to the server.
+    NNContext *ctx = NULL;
+    int fd = -1;
+    if (client->via_socket)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        strcpy(addr.sun_path, SERVE_DEMO_SOCKET);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        {
+            fprintf(stderr, "Serve demo failed: Can't connect to %s.", SERVE_DEMO_SOCKET);
+            exit(1);
+        }
+    }
+    else
+    {
+        ctx = nn_createContext(client->nn, 1);
+    }
+
+    for (int r = 0; r < SERVE_DEMO_REQUESTS; r++)
+    {
+        long long start = trace_now();
+        if (client->via_socket)
+        {
+            // Requests and replies are small, a single call moves them over a Unix socket.
+            if (write(fd, input->data, in * sizeof(double)) != (ssize_t)(in * sizeof(double)) ||
+                recv(fd, output, out * sizeof(double), MSG_WAITALL) != (ssize_t)(out * sizeof(double)))
+            {
+                fprintf(stderr, "Serve demo failed: Connection lost.");
+                exit(1);
+            }
+        }
+        else
+        {
+            mat_free(nn_forwardContext(ctx, input->data, in));
+        }
+        client->latencies[r] = trace_now() - start;
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    nn_freeContext(ctx);
+    mat_free(input);
+    free(output);
+    return NULL;
+}
+
+static int _compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Run the clients in closed loops and print throughput and latency percentiles.
+ */
+static void _serve_demo_run(NN *nn, bool via_socket, const char *label)
+{
+    long long total = SERVE_DEMO_CLIENTS * SERVE_DEMO_REQUESTS;
+    long long *latencies = malloc(total * sizeof(long long));
+    ServeDemoClient clients[SERVE_DEMO_CLIENTS];
+    pthread_t threads[SERVE_DEMO_CLIENTS];
+
+    long long start = trace_now();
+    for (int c = 0; c < SERVE_DEMO_CLIENTS; c++)
+    {
+        clients[c] = (ServeDemoClient){nn, via_socket, latencies + c * SERVE_DEMO_REQUESTS};
+        pthread_create(&threads[c], NULL, _serve_demo_client, &clients[c]);
+    }
+    for (int c = 0; c < SERVE_DEMO_CLIENTS; c++)
+    {
+        pthread_join(threads[c], NULL);
+    }
+    double seconds = (trace_now() - start) * 1e-9;
+
+    qsort(latencies, total, sizeof(long long), _compare_ll);
+    printf("%-28s %10.0f req/s   p50 %8.0f us   p99 %8.0f us\n", label, total / seconds,
+           latencies[total / 2] * 1e-3, latencies[total * 99 / 100] * 1e-3);
+    free(latencies);
+}
+
+void demo_serve()
+{
+    NN *nn = nn_buildNN(784, 256, 10, 2, ReLU, nngrad_CELoss);
+    printf("%d clients, %d requests each, network 784-256x3-10.\n\n", SERVE_DEMO_CLIENTS, SERVE_DEMO_REQUESTS);
+
+    _serve_demo_run(nn, false, "One forward per thread");
+
+    NNServer *server = serve_create(nn, serve_defaultConfig());
+    serve_listen(server, SERVE_DEMO_SOCKET);
+    _serve_demo_run(nn, true, "Micro-batching server");
+    ServeStats stats = serve_stats(server);
+    serve_free(server);
+
+    printf("\nServer: %lld requests in %lld batches (%.1f per batch), p50 %.0f us, p99 %.0f us, max %.0f us.\n",
+           stats.requests, stats.batches, stats.mean_batch, stats.p50_us, stats.p99_us, stats.max_us);
+    nn_free(nn);
+}
+
+#endif
+
 int main(int argc, char *argv[], char **envp)
 {
     if (argc < 2)
@@ -256,6 +461,16 @@ int main(int argc, char *argv[], char **envp)
     {
         demo_xornn();
     }
+    else if (strcmp(val, "isa") == 0)
+    {
+        return demo_isa() == 0 ? 0 : 1;
+    }
+#ifndef _WIN32
+    else if (strcmp(val, "serve") == 0)
+    {
+        demo_serve();
+    }
+#endif
     else
     {
         fprintf(stderr, "Unknown demo type %s", val);
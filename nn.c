@@ -13,9 +13,13 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "linalg.h"
 #include "xlinalg.h"
 #include "nn.h"
+#include "xmath.h"
+#include "trace.h"
+#include "rng.h"
 
 Matrix *ReLU(Matrix *mat, long long i, long long j, va_list args)
 {
@@ -39,7 +43,7 @@ Matrix *Sigmoid(Matrix *mat, long long i, long long j, va_list args)
     bool forward = va_arg(args, int);
     double x = mat_read(mat, i, j);
 
-    double activation = 1 / (1 + exp(-x));
+    double activation = xmath_sigmoid(x);
     if (forward)
     {
         mat_write(mat, i, j, activation);
@@ -51,6 +55,23 @@ Matrix *Sigmoid(Matrix *mat, long long i, long long j, va_list args)
     return mat;
 }
 
+Matrix *Tanh(Matrix *mat, long long i, long long j, va_list args)
+{
+    bool forward = va_arg(args, int);
+    double x = mat_read(mat, i, j);
+
+    double activation = xmath_tanh(x);
+    if (forward)
+    {
+        mat_write(mat, i, j, activation);
+    }
+    else
+    {
+        mat_write(mat, i, j, 1 - activation * activation);
+    }
+    return mat;
+}
+
 Matrix *nngrad_CELoss(Matrix *truth, Matrix *pred)
 {
     if (!xmat_isCol(truth) || !xmat_isCol(pred))
@@ -66,50 +87,204 @@ Matrix *nngrad_CELoss(Matrix *truth, Matrix *pred)
         exit(1);
     }
 
-    Matrix *softmaxed_pred = softMax(pred);
-    Matrix *dLdy = mat_difmat(softmaxed_pred, truth);
+    Matrix *dLdy = mat_alloc(pred->row, pred->col);
+    nn_softmaxCE(pred, truth, dLdy);
 
     return dLdy;
 }
 
-Matrix *softMax(Matrix *vec)
+// Blocks of a softmax segment: at most SOFTMAX_BLOCKS of them, of at least SOFTMAX_MIN_BLOCK
+// elements, so that a block stays in cache between its exp and its sum.
+#define SOFTMAX_BLOCKS 64
+#define SOFTMAX_MIN_BLOCK 256
+
+/**
+ * @brief Stable softmax (and optionally cross-entropy) over one contiguous sample, in two passes.
+ *
+ * Pass 1 writes exp(x - block max) into out block by block and merges the block sums into
+ * a running maximum and sum (online softmax), along with the target-weighted terms. Pass 2
+ * rescales every block to the final maximum, normalizes (and subtracts the target for the
+ * gradient). out may alias x, since a block of x is read before its block of out is written.
+ */
+static double _softmax_segment(const double *x, const double *t, double *out, long long n)
 {
-    if (vec->row != 1 && vec->col != 1)
+    long long block = (n + SOFTMAX_BLOCKS - 1) / SOFTMAX_BLOCKS;
+    block = block < SOFTMAX_MIN_BLOCK ? SOFTMAX_MIN_BLOCK : block;
+    double block_max[SOFTMAX_BLOCKS];
+
+    double max = 0;
+    double sum = 0;
+    double t_sum = 0;
+    double tx_sum = 0;
+    long long blocks = 0;
+    for (long long start = 0; start < n; start += block, blocks++)
     {
-        fprintf(stderr, "Unable to softmax non-vector matrix.");
+        long long len = n - start < block ? n - start : block;
+        const double *xb = x + start;
+        double *ob = out + start;
+
+        double m = xb[0];
+        for (long long k = 0; k < len; k++)
+        {
+            if (xb[k] > m)
+            {
+                m = xb[k];
+            }
+            if (t != NULL)
+            {
+                t_sum += t[start + k];
+                tx_sum += t[start + k] * xb[k];
+            }
+        }
+
+        for (long long k = 0; k < len; k++)
+        {
+            ob[k] = xb[k] - m;
+        }
+        xmath_vexp(ob, ob, len);
+
+        double s = 0;
+        for (long long k = 0; k < len; k++)
+        {
+            s += ob[k];
+        }
+
+        // Rescale whichever of the running sum and the block sum has the smaller maximum.
+        if (blocks == 0)
+        {
+            sum = s;
+            max = m;
+        }
+        else if (m > max)
+        {
+            sum = sum * xmath_exp(max - m) + s;
+            max = m;
+        }
+        else
+        {
+            sum += s * xmath_exp(m - max);
+        }
+        block_max[blocks] = m;
+    }
+
+    double inv_sum = 1.0 / sum;
+    for (long long b = 0; b < blocks; b++)
+    {
+        long long start = b * block;
+        long long len = n - start < block ? n - start : block;
+        double scale = block_max[b] == max ? inv_sum : xmath_exp(block_max[b] - max) * inv_sum;
+        double *ob = out + start;
+        if (t != NULL)
+        {
+            for (long long k = 0; k < len; k++)
+            {
+                ob[k] = ob[k] * scale - t[start + k];
+            }
+        }
+        else
+        {
+            for (long long k = 0; k < len; k++)
+            {
+                ob[k] *= scale;
+            }
+        }
+    }
+
+    // L = -sum(t * log(p)) = sum(t) * logsumexp(x) - sum(t * x)
+    double log_sum_exp = max + xmath_log(sum);
+    return t_sum * log_sum_exp - tx_sum;
+}
+
+/**
+ * @brief _softmax_segment of a column vector whose elements are stride apart, through a packed copy.
+ */
+static double _softmax_strided(Matrix *logits, Matrix *truth, Matrix *out)
+{
+    long long n = logits->row;
+    Matrix *packed = mat_alloc(2, n);
+    double *x = mat_row(packed, 0);
+    double *t = mat_row(packed, 1);
+    for (long long i = 0; i < n; i++)
+    {
+        x[i] = logits->data[i * logits->stride];
+        t[i] = truth != NULL ? truth->data[i * truth->stride] : 0;
+    }
+
+    double loss = _softmax_segment(x, truth != NULL ? t : NULL, x, n);
+    for (long long i = 0; i < n; i++)
+    {
+        out->data[i * out->stride] = x[i];
+    }
+    mat_free(packed);
+    return loss;
+}
+
+double nn_softmaxCE(Matrix *logits, Matrix *truth, Matrix *grad)
+{
+    TRACE_BEGIN();
+    if (truth->row != logits->row || truth->col != logits->col ||
+        grad->row != logits->row || grad->col != logits->col)
+    {
+        fprintf(stderr, "Softmax cross entropy failed: "
+                        "Logits, truth and gradient should have the same shape.");
+        exit(1);
     }
 
-    double sum = mat_elemSum(vec);
+    // A column vector is a single sample, otherwise every row is a sample.
+    long long len = xmat_isCol(logits) ? logits->row : logits->col;
+    long long count = xmat_isCol(logits) ? 1 : logits->row;
 
-    for (long long i = 0; i < vec->row; i++)
+    mat_detach(grad);
+    double loss = 0;
+    if (count == 1 && !(mat_isContiguous(logits) && mat_isContiguous(truth) && mat_isContiguous(grad)))
     {
-        for (long long j = 0; j < vec->col; j++)
+        loss = _softmax_strided(logits, truth, grad);
+    }
+    else
+    {
+        for (long long s = 0; s < count; s++)
         {
-            mat_write(vec, i, j, exp(mat_read(vec, i, j)) / sum);
+            loss += _softmax_segment(count == 1 ? logits->data : mat_row(logits, s),
+                                     count == 1 ? truth->data : mat_row(truth, s),
+                                     count == 1 ? grad->data : mat_row(grad, s),
+                                     len);
         }
     }
 
-    return vec;
+    TRACE_END("nn_softmaxCE", count, len, 0, 3 * count * len * sizeof(double), 4 * count * len);
+    return loss;
 }
 
-Matrix *_layer_init(Matrix *mat, long long row, long long col, va_list args)
+Matrix *softMax(Matrix *vec)
 {
-    double scale = va_arg(args, double);
-    double val = ((double)rand() / RAND_MAX) * 2.0 * scale - scale;
-    mat_write(mat, row, col, val);
-    return mat;
+    if (vec->row != 1 && vec->col != 1)
+    {
+        fprintf(stderr, "Unable to softmax non-vector matrix.");
+        exit(1);
+    }
+
+    mat_detach(vec);
+    if (mat_isContiguous(vec))
+    {
+        _softmax_segment(vec->data, NULL, vec->data, vec->row * vec->col);
+    }
+    else
+    {
+        _softmax_strided(vec, NULL, vec);
+    }
+
+    return vec;
 }
 
 Layer *nn_buildLayer(long long input, long long output)
 {
-    // Matrix* weights = xmat_rand(input, output);
-    double scale = sqrt(6.0 / (input + output));
-    Matrix *weights = xmat_traverse(xmat_rand(input, output), _layer_init, scale);
+    Matrix *weights = mat_alloc(input, output);
     if (weights == NULL)
     {
         printf("Build layer failed: Can't initialize weights.");
         return NULL;
     }
+    rng_xavier(weights, input, output, rng_nextSeed());
 
     Layer *layer = malloc(sizeof(Layer));
     if (layer == NULL)
@@ -118,9 +293,63 @@ Layer *nn_buildLayer(long long input, long long output)
         return NULL;
     }
     layer->weights = weights;
+    layer->bias = xmat_zeros(1, output);
+    layer->grad_weights = xmat_zeros(input, output);
+    layer->grad_bias = xmat_zeros(1, output);
     return layer;
 }
 
+bool nn_activationEpilogue(MatrixElementOperation activation, MatrixEpilogue *epilogue)
+{
+    if (activation == ReLU)
+    {
+        *epilogue = MAT_EPI_RELU;
+        return true;
+    }
+    if (activation == Sigmoid)
+    {
+        *epilogue = MAT_EPI_SIGMOID;
+        return true;
+    }
+    if (activation == Tanh)
+    {
+        *epilogue = MAT_EPI_TANH;
+        return true;
+    }
+
+    *epilogue = MAT_EPI_NONE;
+    return false;
+}
+
+/**
+ * @brief Multiply a gradient by the activation derivative, evaluated from the activation output.
+ */
+static void _activation_grad(Matrix *grad, Matrix *output, MatrixEpilogue act)
+{
+    // Both are vectors, step over their elements with the stride of a column when needed.
+    long long grad_step = xmat_isCol(grad) ? grad->stride : 1;
+    long long output_step = xmat_isCol(output) ? output->stride : 1;
+    for (long long i = 0; i < grad->row * grad->col; i++)
+    {
+        double y = output->data[i * output_step];
+        double *g = &grad->data[i * grad_step];
+        switch (act)
+        {
+        case MAT_EPI_RELU:
+            *g *= y > 0 ? 1 : 0;
+            break;
+        case MAT_EPI_SIGMOID:
+            *g *= y * (1 - y);
+            break;
+        case MAT_EPI_TANH:
+            *g *= 1 - y * y;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
 NN *nn_buildNN(
     long long input_size,
     long long hidden_size,
@@ -139,11 +368,12 @@ NN *nn_buildNN(
     // Architecture of neural-network.
     nn->input_size = input_size;
     nn->hidden_size = hidden_size;
+    nn->output_size = ouptut_size;
     nn->hidden_num = hidden_num;
 
-    // Dynamic states during back propagation.
-    nn->output_states = malloc((nn->hidden_num + 3) * sizeof(Matrix *));
-    nn->delta_states = malloc((nn->hidden_num + 3) * sizeof(Matrix *));
+    // States of passes live in contexts, the default one is created by the first pass.
+    nn->context = NULL;
+    nn->grad_pattern = NULL;
 
     // Activation and loss function.
     nn->activation = activation;
@@ -158,7 +388,7 @@ NN *nn_buildNN(
     }
 
     // Input Layer
-    Layer *input_layer = nn_buildLayer(input_size + 1, hidden_size + 1);
+    Layer *input_layer = nn_buildLayer(input_size, hidden_size);
     if (input_layer == NULL)
     {
         fprintf(stderr, "Build NN failed: Can't allocate memory for input layer.");
@@ -172,7 +402,7 @@ NN *nn_buildNN(
     // Hidden Layer
     for (long long i = 1; i < hidden_num + 1; i++)
     {
-        Layer *hidden_layer = nn_buildLayer(hidden_size + 1, hidden_size + 1);
+        Layer *hidden_layer = nn_buildLayer(hidden_size, hidden_size);
         if (hidden_layer == NULL)
         {
             fprintf(stderr, "Build NN failed: Can't allocate memory for hidden layer.");
@@ -182,7 +412,7 @@ NN *nn_buildNN(
     }
 
     // Output Layer
-    Layer *output_layer = nn_buildLayer(hidden_size + 1, ouptut_size);
+    Layer *output_layer = nn_buildLayer(hidden_size, ouptut_size);
     if (output_layer == NULL)
     {
         fprintf(stderr, "Build NN failed: Can't allocate memory for output layer.");
@@ -192,6 +422,103 @@ NN *nn_buildNN(
     return nn;
 }
 
+void nn_free(NN *nn)
+{
+    for (long long k = 0; k < nn->hidden_num + 2; k++)
+    {
+        Layer *layer = nn->layers[k];
+        mat_free(layer->weights);
+        mat_free(layer->bias);
+        mat_free(layer->grad_weights);
+        mat_free(layer->grad_bias);
+        free(layer);
+    }
+    nn_freeContext(nn->context);
+    spmat_free(nn->grad_pattern);
+    free(nn->layers);
+    free(nn);
+}
+
+NNContext *nn_createContext(NN *nn, long long batch)
+{
+    if (batch <= 0)
+    {
+        fprintf(stderr, "Create NN context failed: Batch size should be positive, got %lld.", batch);
+        exit(1);
+    }
+
+    long long layer_num = nn->hidden_num + 2;
+    NNContext *ctx = malloc(sizeof(NNContext));
+    Matrix **states = calloc(layer_num + 1, sizeof(Matrix *));
+    Matrix **deltas = calloc(layer_num, sizeof(Matrix *));
+    if (ctx == NULL || states == NULL || deltas == NULL)
+    {
+        fprintf(stderr, "Create NN context failed: Can't allocate memory for the context.");
+        exit(1);
+    }
+    ctx->nn = nn;
+    ctx->states = states;
+    ctx->deltas = deltas;
+    ctx->batch = batch;
+    ctx->rows = 0;
+    ctx->sparse_input = NULL;
+
+    ctx->states[0] = mat_alloc(batch, nn->input_size);
+    for (long long k = 0; k < layer_num; k++)
+    {
+        Matrix *weights = nn->layers[k]->weights;
+        ctx->states[k + 1] = mat_alloc(batch, weights->col);
+        if (k > 0)
+        {
+            ctx->deltas[k] = mat_alloc(weights->row, 1);
+        }
+    }
+    return ctx;
+}
+
+void nn_freeContext(NNContext *ctx)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+    for (long long k = 0; k < ctx->nn->hidden_num + 3; k++)
+    {
+        mat_free(ctx->states[k]);
+    }
+    for (long long k = 0; k < ctx->nn->hidden_num + 2; k++)
+    {
+        mat_free(ctx->deltas[k]);
+    }
+    spmat_free(ctx->sparse_input);
+    free(ctx->states);
+    free(ctx->deltas);
+    free(ctx);
+}
+
+static NNContext *_default_context(NN *nn)
+{
+    if (nn->context == NULL)
+    {
+        nn->context = nn_createContext(nn, 1);
+    }
+    return nn->context;
+}
+
+/**
+ * @brief Start a pass of the given number of samples, the states cover that many rows.
+ */
+static void _begin_pass(NNContext *ctx, long long rows)
+{
+    for (long long k = 0; k < ctx->nn->hidden_num + 3; k++)
+    {
+        ctx->states[k]->row = rows;
+    }
+    ctx->rows = rows;
+    spmat_free(ctx->sparse_input);
+    ctx->sparse_input = NULL;
+}
+
 void nn_printNN(NN *nn)
 {
     Layer **layers = nn->layers;
@@ -205,47 +532,201 @@ void nn_printNN(NN *nn)
         }
         printf("Layer %lld at %p: (%lld -> %lld)\n", k, weights, weights->row, weights->col);
         mat_print(weights);
+        printf("Bias:\n");
+        mat_print(layers[k]->bias);
         printf("\n");
     }
 }
 
+/**
+ * @brief Number of weights and biases in a network, used for trace estimates.
+ */
+static long long _param_count(NN *nn)
+{
+    long long params = 0;
+    for (long long layer = 0; layer < nn->hidden_num + 2; layer++)
+    {
+        Matrix *weights = nn->layers[layer]->weights;
+        params += (weights->row + 1) * weights->col;
+    }
+    return params;
+}
+
+/**
+ * @brief Run the layers from first on into the states of the context, given the output of
+ * the layer before.
+ */
+static Matrix *_forward_layers(NNContext *ctx, long long first, Matrix *layer_input)
+{
+    NN *nn = ctx->nn;
+    MatrixEpilogue epilogue;
+    bool fused = nn_activationEpilogue(nn->activation, &epilogue);
+
+    for (long long layer = first; layer < nn->hidden_num + 2; layer++)
+    {
+        Layer *this_layer = nn->layers[layer];
+
+        // Bias and activation are applied inside the matrix multiplication.
+        Matrix *product = mat_multmatFused(layer_input, this_layer->weights, this_layer->bias, epilogue,
+                                           ctx->states[layer + 1]);
+        if (!fused)
+        {
+            product = xmat_traverseInPlace(product, nn->activation, true);
+        }
+        layer_input = product;
+    }
+
+    return layer_input;
+}
+
 Matrix *nn_forward(NN *nn, double *input, long long input_size)
 {
-    // Construct biased input.
-    double *biased_input_data = malloc((input_size + 1) * sizeof(double));
-    for (long long i = 0; i < input_size; i++)
+    return nn_forwardContext(_default_context(nn), input, input_size);
+}
+
+Matrix *nn_forwardContext(NNContext *ctx, double *input, long long input_size)
+{
+    TRACE_BEGIN();
+    NN *nn = ctx->nn;
+    if (input_size != nn->input_size)
+    {
+        fprintf(stderr, "Forward propagation failed: Input should have size %lld, got %lld.",
+                nn->input_size, input_size);
+        exit(1);
+    }
+
+    // Copy the input, it is needed again during back propagation.
+    _begin_pass(ctx, 1);
+    memcpy(ctx->states[0]->data, input, input_size * sizeof(double));
+
+    Matrix *output = mat_transpose(_forward_layers(ctx, 0, ctx->states[0]));
+    TRACE_END("nn_forward", nn->input_size, nn->hidden_size, nn->output_size,
+              _param_count(nn) * sizeof(double), 2 * _param_count(nn));
+    return output;
+}
+
+Matrix *nn_forwardBatch(NNContext *ctx, Matrix *input)
+{
+    TRACE_BEGIN();
+    NN *nn = ctx->nn;
+    if (input->col != nn->input_size || input->row > ctx->batch)
     {
-        biased_input_data[i] = input[i];
+        fprintf(stderr, "Batch forward propagation failed: "
+                        "Input should have at most %lld rows of size %lld, got %lld x %lld.",
+                ctx->batch, nn->input_size, input->row, input->col);
+        exit(1);
     }
 
-    biased_input_data[input_size] = 1;
+    _begin_pass(ctx, input->row);
+    for (long long i = 0; i < input->row; i++)
+    {
+        memcpy(mat_row(ctx->states[0], i), mat_row(input, i), input->col * sizeof(double));
+    }
 
-    Matrix *biased_input = mat_create(1, input_size + 1, biased_input_data);
+    Matrix *output = _forward_layers(ctx, 0, ctx->states[0]);
+    TRACE_END("nn_forwardBatch", input->row, nn->input_size, nn->output_size,
+              (_param_count(nn) + input->row * (nn->input_size + nn->output_size)) * sizeof(double),
+              2.0 * input->row * _param_count(nn));
+    return output;
+}
 
-    // Construct output states.
-    // nn->output_states[0] = temp;
+Matrix *nn_forwardSparse(NN *nn, SparseMatrix *input)
+{
+    return nn_forwardSparseContext(_default_context(nn), input);
+}
 
-    for (long long layer = 0; layer < nn->hidden_num + 2; layer++)
+Matrix *nn_forwardSparseContext(NNContext *ctx, SparseMatrix *input)
+{
+    TRACE_BEGIN();
+    NN *nn = ctx->nn;
+    if (input->row != 1 || input->col != nn->input_size)
     {
-        Matrix *weights = nn->layers[layer]->weights;
-        Matrix *product = mat_multmat(biased_input, weights);
+        fprintf(stderr, "Sparse forward propagation failed: "
+                        "Input should have size 1 x %lld, got %lld x %lld.",
+                nn->input_size, input->row, input->col);
+        exit(1);
+    }
 
-        // Activation
-        product = xmat_traverse(product, nn->activation, true);
+    // Keep a copy of the input for back propagation, in place of the dense input state.
+    _begin_pass(ctx, 1);
+    ctx->sparse_input = spmat_copy(input);
 
-        // Save output states
-        nn->output_states[layer] = product;
-        biased_input = product;
+    MatrixEpilogue epilogue;
+    bool fused = nn_activationEpilogue(nn->activation, &epilogue);
 
-        // printf("Output states of layer %lld: ", layer);
-        // mat_print(nn->output_states[layer]);
+    // Only the weight rows of nonzero inputs are read.
+    Layer *first_layer = nn->layers[0];
+    Matrix *product = spmat_multmatFused(input, first_layer->weights, first_layer->bias, epilogue, ctx->states[1]);
+    if (!fused)
+    {
+        product = xmat_traverseInPlace(product, nn->activation, true);
     }
 
-    return mat_transpose(biased_input);
+    Matrix *output = mat_transpose(_forward_layers(ctx, 1, product));
+    long long first_params = (input->nnz + 1) * first_layer->weights->col;
+    long long params = _param_count(nn) - (first_layer->weights->row + 1) * first_layer->weights->col + first_params;
+    TRACE_END("nn_forwardSparse", nn->input_size, nn->hidden_size, nn->output_size,
+              params * sizeof(double), 2 * params);
+    return output;
 }
 
-NN *nn_backward(NN *nn, Matrix *target, Matrix *forward_output, double lr)
+/**
+ * @brief Write the first layer's weight gradient of a sparse input, x^T * dLdb.
+ *
+ * Rows of the inputs that were nonzero in the previous sparse pass are cleared, the rest
+ * are already zero, so the work scales with the nonzeros instead of the input size.
+ */
+static void _sparse_weight_grad(NN *nn, SparseMatrix *x, Matrix *dLdW, const double *dLdb)
+{
+    long long out_size = dLdW->col;
+
+    if (nn->grad_pattern == NULL)
+    {
+        // The buffer may hold a dense gradient, clear all of it once.
+        for (long long i = 0; i < dLdW->row; i++)
+        {
+            memset(mat_row(dLdW, i), 0, out_size * sizeof(double));
+        }
+    }
+    else
+    {
+        SparseMatrix *old = nn->grad_pattern;
+        for (long long k = 0; k < old->nnz; k++)
+        {
+            memset(mat_row(dLdW, old->col_idx[k]), 0, out_size * sizeof(double));
+        }
+        spmat_free(old);
+    }
+
+    for (long long k = 0; k < x->nnz; k++)
+    {
+        double x_i = x->values[k];
+        double *dLdW_i = mat_row(dLdW, x->col_idx[k]);
+        for (long long j = 0; j < out_size; j++)
+        {
+            dLdW_i[j] = x_i * dLdb[j];
+        }
+    }
+    nn->grad_pattern = spmat_copy(x);
+}
+
+NN *nn_gradient(NN *nn, Matrix *target, Matrix *forward_output)
 {
+    return nn_gradientContext(_default_context(nn), target, forward_output);
+}
+
+NN *nn_gradientContext(NNContext *ctx, Matrix *target, Matrix *forward_output)
+{
+    TRACE_BEGIN();
+    NN *nn = ctx->nn;
+    if (ctx->rows != 1)
+    {
+        fprintf(stderr, "Backward propagation failed: "
+                        "The last forward pass of the context should have one sample, it had %lld.",
+                ctx->rows);
+        exit(1);
+    }
+
     // Target should be in column matrix.
     if (target->col != 1 || forward_output->col != 1)
     {
@@ -262,6 +743,80 @@ NN *nn_backward(NN *nn, Matrix *target, Matrix *forward_output, double lr)
         exit(1);
     }
 
+    MatrixEpilogue epilogue;
+    bool fused = nn_activationEpilogue(nn->activation, &epilogue);
+
+    // Total error gradient.
+    Matrix *loss_grad = nn->loss(target, forward_output);
+    Matrix *dLdz = loss_grad; // Running error. Shape: (row=output_size, col=1)
+
+    for (long long layer = nn->hidden_num + 1; layer >= 0; layer--)
+    {
+        Layer *this_layer = nn->layers[layer];
+        Matrix *x = ctx->states[layer]; // Input: (row=1, col=input_size), unused if sparse
+
+        // dL/dW = xT * dLdzT, written straight into the gradient buffers.
+        mat_detach(this_layer->grad_weights);
+        mat_detach(this_layer->grad_bias);
+        Matrix *dLdW = this_layer->grad_weights; // Grad: (row=input_size, col=output_size)
+        double *dLdb = this_layer->grad_bias->data; // Grad: (row=1, col=output_size)
+        long long out_size = this_layer->weights->col;
+        for (long long j = 0; j < out_size; j++)
+        {
+            dLdb[j] = dLdz->data[j * dLdz->stride];
+        }
+        if (layer == 0 && ctx->sparse_input != NULL)
+        {
+            _sparse_weight_grad(nn, ctx->sparse_input, dLdW, dLdb);
+        }
+        else
+        {
+            for (long long i = 0; i < x->col; i++)
+            {
+                double x_i = x->data[i];
+                double *dLdW_i = mat_row(dLdW, i);
+                for (long long j = 0; j < out_size; j++)
+                {
+                    dLdW_i[j] = x_i * dLdb[j];
+                }
+            }
+            if (layer == 0)
+            {
+                spmat_free(nn->grad_pattern);
+                nn->grad_pattern = NULL;
+            }
+        }
+
+        if (layer > 0)
+        {
+            // (row=input_size, col=1), into the workspace of the layer.
+            dLdz = mat_multmatFused(this_layer->weights, dLdz, NULL, MAT_EPI_NONE, ctx->deltas[layer]);
+            if (fused)
+            {
+                _activation_grad(dLdz, x, epilogue);
+            }
+            else
+            {
+                dLdz = xmat_traverseInPlace(dLdz, nn->activation, false); // Activation derivative
+            }
+        }
+    }
+    mat_free(loss_grad);
+
+    TRACE_END("nn_gradient", nn->input_size, nn->hidden_size, nn->output_size,
+              2 * _param_count(nn) * sizeof(double), 4 * _param_count(nn));
+    return nn;
+}
+
+NN *nn_backward(NN *nn, Matrix *target, Matrix *forward_output, double lr)
+{
+    return nn_backwardContext(_default_context(nn), target, forward_output, lr);
+}
+
+NN *nn_backwardContext(NNContext *ctx, Matrix *target, Matrix *forward_output, double lr)
+{
+    TRACE_BEGIN();
+    NN *nn = ctx->nn;
     // Learning rate should be valid.
     if (lr <= 0)
     {
@@ -269,26 +824,36 @@ NN *nn_backward(NN *nn, Matrix *target, Matrix *forward_output, double lr)
         exit(1);
     }
 
-    // Total error gradient.
-    Matrix *dLdy = nn->loss(target, forward_output); // Total error.
-    Matrix *dLdz = mat_copy(dLdy);                   // Running error. Shape: (row=output_size, col=1)
+    nn_gradientContext(ctx, target, forward_output);
 
-    for (long long layer = nn->hidden_num + 1; layer > 0; layer--)
+    // W_{t+1} = W_{t} - eps * (dL/dW), in place.
+    for (long long layer = 0; layer < nn->hidden_num + 2; layer++)
     {
-        Matrix *xT = mat_transpose(nn->output_states[layer - 1]); // Input: (row=input_size, col=1)
-        Matrix *dLdzT = mat_transpose(dLdz);                      // Err: (row=1, col=output_size)
-        Matrix *dLdW = mat_multmat(xT, dLdzT);                    // Grad: (row=input_size, col=outpu_size)
-
-        nn->layers[layer]->weights = mat_difmat(
-            nn->layers[layer]->weights,
-            mat_multscal(dLdW, lr)); // W_{t+1} = W_{t} - eps * (dL/dW)
+        Layer *this_layer = nn->layers[layer];
+        Matrix *params[2] = {this_layer->weights, this_layer->bias};
+        Matrix *grads[2] = {this_layer->grad_weights, this_layer->grad_bias};
 
-        if (layer > 1)
+        for (int p = 0; p < 2; p++)
         {
-            dLdz = mat_multmat(nn->layers[layer]->weights, dLdz); // (row=input_size, col=1)
-            dLdz = xmat_traverse(dLdz, nn->activation, false);    // Activation derivative
+            // Only the weight rows of nonzero sparse inputs have a gradient.
+            SparseMatrix *pattern = layer == 0 && p == 0 ? nn->grad_pattern : NULL;
+            long long rows = pattern != NULL ? pattern->nnz : params[p]->row;
+
+            mat_detach(params[p]);
+            for (long long k = 0; k < rows; k++)
+            {
+                long long r = pattern != NULL ? pattern->col_idx[k] : k;
+                double *w = mat_row(params[p], r);
+                double *g = mat_row(grads[p], r);
+                for (long long i = 0; i < params[p]->col; i++)
+                {
+                    w[i] -= lr * g[i];
+                }
+            }
         }
     }
 
+    TRACE_END("nn_backward", nn->input_size, nn->hidden_size, nn->output_size,
+              3 * _param_count(nn) * sizeof(double), 2 * _param_count(nn));
     return nn;
-}
\ No newline at end of file
+}
@@ -3,12 +3,25 @@
 
 #include "linalg.h"
 #include "xlinalg.h"
+#include "sparse.h"
 
 typedef struct
 {
     Matrix *weights;
+    Matrix *bias;
+    Matrix *grad_weights;
+    Matrix *grad_bias;
 } Layer;
 
+typedef struct NNContext NNContext;
+
+/**
+ * @brief Neural network model: architecture, weights and gradient buffers.
+ *
+ * Forward passes only read the model, their states live in an NNContext, so any number of
+ * contexts can run forward passes of the same model at once. Gradients and weight updates
+ * write the model and must not run concurrently with anything else on it.
+ */
 typedef struct
 {
     long long input_size;
@@ -16,12 +29,27 @@ typedef struct
     long long output_size;
     long long hidden_num;
     Layer **layers;
-    Matrix **output_states;
-    Matrix **delta_states;
+    SparseMatrix *grad_pattern; // Nonzero rows of the first layer's grad_weights, NULL if dense.
     MatrixElementOperation activation;
     MatrixPointwiseOperation loss;
+    NNContext *context; // Context of nn_forward and friends, created on first use.
 } NN;
 
+/**
+ * @brief Execution context of a network: the workspaces of forward and backward passes.
+ *
+ * Every buffer is allocated once, for up to batch samples, and reused by every pass.
+ */
+struct NNContext
+{
+    NN *nn;
+    long long batch;            // Samples the workspaces hold.
+    long long rows;             // Samples of the last forward pass.
+    Matrix **states;            // states[0] is the input, states[k + 1] the output of layer k.
+    Matrix **deltas;            // deltas[k] is dL/d(output of layer k - 1) for one sample, k >= 1.
+    SparseMatrix *sparse_input; // Input of the last forward pass if it was sparse, else NULL.
+};
+
 /**
  * @brief ReLU activation function.
  *
@@ -38,6 +66,14 @@ Matrix *ReLU(Matrix *mat, long long i, long long j, va_list args);
  */
 Matrix *Sigmoid(Matrix *mat, long long i, long long j, va_list args);
 
+/**
+ * @brief Tanh activation function.
+ *
+ * @param x Input.
+ * @return double
+ */
+Matrix *Tanh(Matrix *mat, long long i, long long j, va_list args);
+
 /**
  * @brief Calculate the gradient of cross-entropy loss.
  *
@@ -48,13 +84,36 @@ Matrix *Sigmoid(Matrix *mat, long long i, long long j, va_list args);
 Matrix *nngrad_CELoss(Matrix *truth, Matrix *pred);
 
 /**
- * @brief Calculate a softmaxed version of a vector.
+ * @brief Fused softmax and cross-entropy loss with its gradient.
+ *
+ * Numerically stable (the maximum is subtracted before exponentiation). A column vector
+ * is treated as one sample, any other shape as a batch with one sample per row.
+ * grad receives softmax(logits) - truth and may alias logits.
+ *
+ * @param logits Raw model outputs.
+ * @param truth Target distribution, same shape as logits.
+ * @param grad Output gradient dL/dlogits, same shape as logits.
+ * @return double Cross-entropy loss summed over all samples.
+ */
+double nn_softmaxCE(Matrix *logits, Matrix *truth, Matrix *grad);
+
+/**
+ * @brief Softmax a vector in place, numerically stable.
  *
  * @param vec Vector to be softmaxed.
  * @return Matrix*
  */
 Matrix *softMax(Matrix *vec);
 
+/**
+ * @brief Find the fused GEMM epilogue equivalent to an activation function.
+ *
+ * @param activation Pointer to the activation function.
+ * @param epilogue Output, the matching epilogue.
+ * @return bool Whether the activation can be fused into the matrix multiplication.
+ */
+bool nn_activationEpilogue(MatrixElementOperation activation, MatrixEpilogue *epilogue);
+
 /**
  * @brief Build a neural network.
  *
@@ -72,6 +131,34 @@ NN *nn_buildNN(long long input_size,
                MatrixElementOperation activation,
                MatrixPointwiseOperation loss);
 
+/**
+ * @brief Free a neural network, its layers and its default context.
+ *
+ * Contexts created with nn_createContext are freed separately, before the network.
+ *
+ * @param nn Pointer to neural network struct.
+ */
+void nn_free(NN *nn);
+
+/**
+ * @brief Create an execution context for a network.
+ *
+ * Each thread running passes of a shared network uses a context of its own; forward passes
+ * of different contexts need no locking and do not copy the weights.
+ *
+ * @param nn Neural network struct pointer.
+ * @param batch Largest number of samples of a forward pass, at least 1.
+ * @return NNContext*
+ */
+NNContext *nn_createContext(NN *nn, long long batch);
+
+/**
+ * @brief Free an execution context and its workspaces.
+ *
+ * @param ctx Context struct pointer.
+ */
+void nn_freeContext(NNContext *ctx);
+
 /**
  * @brief Print neural network.
  *
@@ -80,7 +167,7 @@ NN *nn_buildNN(long long input_size,
 void nn_printNN(NN *nn);
 
 /**
- * @brief Forward propagation.
+ * @brief Forward propagation, in the default context of the network.
  *
  * @param nn Neural network struct pointer.
  * @param input Input array.
@@ -90,7 +177,77 @@ void nn_printNN(NN *nn);
 Matrix *nn_forward(NN *nn, double *input, long long input_size);
 
 /**
- * @brief Backward propagation.
+ * @brief Forward propagation in a given context.
+ *
+ * @param ctx Context struct pointer.
+ * @param input Input array.
+ * @param input_size Input size.
+ * @return Matrix* Output column matrix, owned by the caller.
+ */
+Matrix *nn_forwardContext(NNContext *ctx, double *input, long long input_size);
+
+/**
+ * @brief Forward propagation of a batch of samples, one per row, in a given context.
+ *
+ * All layers run as matrix products over the whole batch and write into the workspaces of
+ * the context, nothing is allocated.
+ *
+ * @param ctx Context struct pointer.
+ * @param input Matrix of size samples x input_size, with at most ctx->batch samples.
+ * @return Matrix* Outputs of size samples x output_size, owned by the context and valid
+ * until its next pass.
+ */
+Matrix *nn_forwardBatch(NNContext *ctx, Matrix *input);
+
+/**
+ * @brief Forward propagation of a sparse input, in the default context of the network.
+ *
+ * The first layer multiplies only the nonzero inputs, and the following nn_gradient
+ * computes and clears only the weight gradient rows of those inputs.
+ *
+ * @param nn Neural network struct pointer.
+ * @param input Sparse row matrix of size 1 x input_size.
+ * @return Matrix*
+ */
+Matrix *nn_forwardSparse(NN *nn, SparseMatrix *input);
+
+/**
+ * @brief nn_forwardSparse in a given context.
+ *
+ * @param ctx Context struct pointer.
+ * @param input Sparse row matrix of size 1 x input_size.
+ * @return Matrix*
+ */
+Matrix *nn_forwardSparseContext(NNContext *ctx, SparseMatrix *input);
+
+/**
+ * @brief Backward propagation without updating the weights.
+ *
+ * Gradients are written into grad_weights and grad_bias of every layer, to be applied
+ * by an optimizer (see optim.h).
+ *
+ * @param nn Neural network struct pointer.
+ * @param target Desired output.
+ * @param forward_output Output of the forward propagation.
+ * @return NN*
+ */
+NN *nn_gradient(NN *nn, Matrix *target, Matrix *forward_output);
+
+/**
+ * @brief nn_gradient of the last single sample forward pass of a given context.
+ *
+ * The gradients are written into the network, so at most one context of a network may
+ * compute them at a time.
+ *
+ * @param ctx Context struct pointer.
+ * @param target Desired output.
+ * @param forward_output Output of the forward propagation.
+ * @return NN*
+ */
+NN *nn_gradientContext(NNContext *ctx, Matrix *target, Matrix *forward_output);
+
+/**
+ * @brief Backward propagation with a plain gradient descent update.
  *
  * @param nn Neural network struct pointer.
  * @param target Desired output.
@@ -100,4 +257,15 @@ Matrix *nn_forward(NN *nn, double *input, long long input_size);
  */
 NN *nn_backward(NN *nn, Matrix *target, Matrix *forward_output, double lr);
 
+/**
+ * @brief nn_backward of the last single sample forward pass of a given context.
+ *
+ * @param ctx Context struct pointer.
+ * @param target Desired output.
+ * @param forward_output Output of the forward propagation.
+ * @param lr Learning rate.
+ * @return NN*
+ */
+NN *nn_backwardContext(NNContext *ctx, Matrix *target, Matrix *forward_output, double lr);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,213 @@
+/**
+ * @file optim.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Optimizers updating neural network weights in place.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "linalg.h"
+#include "xlinalg.h"
+#include "nn.h"
+#include "optim.h"
+#include "trace.h"
+
+Optimizer *optim_create(NN *nn, OptimizerType type, double lr)
+{
+    if (lr <= 0)
+    {
+        fprintf(stderr, "Create optimizer failed: Invalid learning rate of %lf", lr);
+        exit(1);
+    }
+
+    Optimizer *opt = malloc(sizeof(Optimizer));
+    if (opt == NULL)
+    {
+        fprintf(stderr, "Create optimizer failed: Can't allocate memory for optimizer.");
+        return NULL;
+    }
+
+    opt->type = type;
+    opt->lr = lr;
+    opt->momentum = 0.9;
+    opt->beta1 = 0.9;
+    opt->beta2 = 0.999;
+    opt->eps = 1e-8;
+    opt->weight_decay = type == OPTIM_ADAMW ? 0.01 : 0;
+    opt->step = 0;
+    opt->layer_num = nn->hidden_num + 2;
+
+    bool has_m = type != OPTIM_SGD;
+    bool has_v = type == OPTIM_ADAM || type == OPTIM_ADAMW;
+
+    opt->m_weights = calloc(opt->layer_num, sizeof(Matrix *));
+    opt->m_bias = calloc(opt->layer_num, sizeof(Matrix *));
+    opt->v_weights = calloc(opt->layer_num, sizeof(Matrix *));
+    opt->v_bias = calloc(opt->layer_num, sizeof(Matrix *));
+
+    for (long long layer = 0; layer < opt->layer_num; layer++)
+    {
+        Matrix *weights = nn->layers[layer]->weights;
+        Matrix *bias = nn->layers[layer]->bias;
+        if (has_m)
+        {
+            opt->m_weights[layer] = xmat_zeros(weights->row, weights->col);
+            opt->m_bias[layer] = xmat_zeros(bias->row, bias->col);
+        }
+        if (has_v)
+        {
+            opt->v_weights[layer] = xmat_zeros(weights->row, weights->col);
+            opt->v_bias[layer] = xmat_zeros(bias->row, bias->col);
+        }
+    }
+
+    return opt;
+}
+
+static void _update_sgd(double *w, const double *g, long long n, double lr, double wd)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        w[i] -= lr * (g[i] + wd * w[i]);
+    }
+}
+
+// v = mu * v + g, w -= lr * v
+static void _update_momentum(double *w, const double *g, double *v, long long n,
+                             double lr, double mu, double wd)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        double g_i = g[i] + wd * w[i];
+        v[i] = mu * v[i] + g_i;
+        w[i] -= lr * v[i];
+    }
+}
+
+// v = mu * v + g, w -= lr * (g + mu * v)
+static void _update_nesterov(double *w, const double *g, double *v, long long n,
+                             double lr, double mu, double wd)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        double g_i = g[i] + wd * w[i];
+        v[i] = mu * v[i] + g_i;
+        w[i] -= lr * (g_i + mu * v[i]);
+    }
+}
+
+/**
+ * @brief Adam with the bias corrections folded into step_size and eps_hat.
+ *
+ * l2 is added to the gradient (Adam), decay is applied to the weights directly (AdamW).
+ */
+static void _update_adam(double *w, const double *g, double *m, double *v, long long n,
+                         double step_size, double b1, double b2, double eps_hat,
+                         double l2, double decay)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        double g_i = g[i] + l2 * w[i];
+        m[i] = b1 * m[i] + (1 - b1) * g_i;
+        v[i] = b2 * v[i] + (1 - b2) * g_i * g_i;
+        w[i] -= step_size * m[i] / (sqrt(v[i]) + eps_hat) + decay * w[i];
+    }
+}
+
+void optim_step(Optimizer *opt, NN *nn)
+{
+    if (nn->hidden_num + 2 != opt->layer_num)
+    {
+        fprintf(stderr, "Optimizer step failed: Optimizer was created for a different network.");
+        exit(1);
+    }
+
+    TRACE_BEGIN();
+    opt->step++;
+
+    // Adam bias corrections, computed once per step.
+    double bc1 = 1 - pow(opt->beta1, (double)opt->step);
+    double bc2 = 1 - pow(opt->beta2, (double)opt->step);
+    double step_size = opt->lr * sqrt(bc2) / bc1;
+    double eps_hat = opt->eps * sqrt(bc2);
+
+    for (long long layer = 0; layer < opt->layer_num; layer++)
+    {
+        Layer *this_layer = nn->layers[layer];
+        Matrix *params[2] = {this_layer->weights, this_layer->bias};
+        Matrix *grads[2] = {this_layer->grad_weights, this_layer->grad_bias};
+        Matrix *ms[2] = {opt->m_weights[layer], opt->m_bias[layer]};
+        Matrix *vs[2] = {opt->v_weights[layer], opt->v_bias[layer]};
+
+        for (int p = 0; p < 2; p++)
+        {
+            Matrix *m = ms[p];
+            Matrix *v = vs[p];
+            mat_detach(params[p]);
+
+            // One update over all elements when every buffer is contiguous, else one per row.
+            bool packed = mat_isContiguous(params[p]) && mat_isContiguous(grads[p]) &&
+                          (m == NULL || mat_isContiguous(m)) && (v == NULL || mat_isContiguous(v));
+            long long spans = packed ? 1 : params[p]->row;
+            long long n = packed ? params[p]->row * params[p]->col : params[p]->col;
+
+            for (long long r = 0; r < spans; r++)
+            {
+                double *w = mat_row(params[p], r);
+                double *g = mat_row(grads[p], r);
+                double *m_r = m != NULL ? mat_row(m, r) : NULL;
+                double *v_r = v != NULL ? mat_row(v, r) : NULL;
+
+                switch (opt->type)
+                {
+                case OPTIM_SGD:
+                    _update_sgd(w, g, n, opt->lr, opt->weight_decay);
+                    break;
+                case OPTIM_MOMENTUM:
+                    _update_momentum(w, g, m_r, n, opt->lr, opt->momentum, opt->weight_decay);
+                    break;
+                case OPTIM_NESTEROV:
+                    _update_nesterov(w, g, m_r, n, opt->lr, opt->momentum, opt->weight_decay);
+                    break;
+                case OPTIM_ADAM:
+                    _update_adam(w, g, m_r, v_r, n, step_size,
+                                 opt->beta1, opt->beta2, eps_hat, opt->weight_decay, 0);
+                    break;
+                case OPTIM_ADAMW:
+                    _update_adam(w, g, m_r, v_r, n, step_size,
+                                 opt->beta1, opt->beta2, eps_hat, 0, opt->lr * opt->weight_decay);
+                    break;
+                default:
+                    fprintf(stderr, "Optimizer step failed: Unknown optimizer type %d.", opt->type);
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    TRACE_END("optim_step", opt->layer_num, opt->type, 0, 0, 0);
+}
+
+void optim_free(Optimizer *opt)
+{
+    for (long long layer = 0; layer < opt->layer_num; layer++)
+    {
+        Matrix *state[4] = {opt->m_weights[layer], opt->m_bias[layer],
+                            opt->v_weights[layer], opt->v_bias[layer]};
+        for (int s = 0; s < 4; s++)
+        {
+            mat_free(state[s]);
+        }
+    }
+    free(opt->m_weights);
+    free(opt->m_bias);
+    free(opt->v_weights);
+    free(opt->v_bias);
+    free(opt);
+}
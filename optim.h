@@ -0,0 +1,74 @@
+#ifndef OPTIM_H
+#define OPTIM_H
+
+#include "linalg.h"
+#include "nn.h"
+
+/**
+ * @brief Update rule of an optimizer.
+ *
+ */
+typedef enum
+{
+    OPTIM_SGD,
+    OPTIM_MOMENTUM,
+    OPTIM_NESTEROV,
+    OPTIM_ADAM,
+    OPTIM_ADAMW
+} OptimizerType;
+
+/**
+ * @brief Optimizer with persistent per-layer state.
+ *
+ * Hyper-parameters can be changed after optim_create. The state buffers mirror the
+ * shapes of every layer's weights and bias and are updated in place.
+ */
+typedef struct
+{
+    OptimizerType type;
+    double lr;
+    double momentum;
+    double beta1;
+    double beta2;
+    double eps;
+    double weight_decay;
+    long long step;
+    long long layer_num;
+    Matrix **m_weights; // Velocity, or first moment for Adam.
+    Matrix **m_bias;
+    Matrix **v_weights; // Second moment, Adam only.
+    Matrix **v_bias;
+} Optimizer;
+
+/**
+ * @brief Create an optimizer for a neural network.
+ *
+ * Defaults: momentum 0.9, beta1 0.9, beta2 0.999, eps 1e-8, weight decay 0
+ * (0.01 for AdamW).
+ *
+ * @param nn Neural network struct pointer.
+ * @param type Update rule.
+ * @param lr Learning rate.
+ * @return Optimizer*
+ */
+Optimizer *optim_create(NN *nn, OptimizerType type, double lr);
+
+/**
+ * @brief Apply one update to every layer from the gradients left by nn_gradient.
+ *
+ * Each parameter tensor is updated in a single fused pass over weights, gradients
+ * and optimizer state, without allocating.
+ *
+ * @param opt Optimizer struct pointer.
+ * @param nn Neural network struct pointer.
+ */
+void optim_step(Optimizer *opt, NN *nn);
+
+/**
+ * @brief Free an optimizer and its state.
+ *
+ * @param opt Optimizer struct pointer.
+ */
+void optim_free(Optimizer *opt);
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file parallel.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief A persistent thread pool running parallel loops.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "parallel.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define PAR_MAX_THREADS 256
+
+// Held by the thread whose loop currently owns the workers.
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Protects the job state below.
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static long long generation = 0; // Incremented for every job.
+static int busy_workers = 0;     // Workers that have not finished the current job.
+static int participants = 0;     // Workers taking part in the current job.
+static int worker_count = 0;
+
+static atomic_int thread_count = 0; // 0 until first read.
+static _Thread_local int in_parallel = 0;
+
+static struct
+{
+    ParallelBody body;
+    void *ctx;
+    long long n;
+    long long chunk;
+    atomic_llong next;
+} job;
+
+static void _run_chunks(void)
+{
+    for (;;)
+    {
+        long long begin = atomic_fetch_add(&job.next, job.chunk);
+        if (begin >= job.n)
+        {
+            return;
+        }
+        long long end = begin + job.chunk < job.n ? begin + job.chunk : job.n;
+        job.body(job.ctx, begin, end);
+    }
+}
+
+typedef struct
+{
+    int id;
+    long long seen;
+} WorkerArgs;
+
+static void *_worker(void *arg)
+{
+    WorkerArgs args = *(WorkerArgs *)arg;
+    free(arg);
+    in_parallel = 1;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (;;)
+    {
+        while (generation == args.seen)
+        {
+            pthread_cond_wait(&job_ready, &pool_mutex);
+        }
+        args.seen = generation;
+        int take_part = args.id < participants;
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (take_part)
+        {
+            _run_chunks();
+        }
+
+        pthread_mutex_lock(&pool_mutex);
+        if (--busy_workers == 0)
+        {
+            pthread_cond_signal(&job_done);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start workers until there are count of them. Called with run_lock held.
+ */
+static void _start_workers(int count)
+{
+    pthread_mutex_lock(&pool_mutex);
+    while (worker_count < count)
+    {
+        WorkerArgs *args = malloc(sizeof(WorkerArgs));
+        if (args == NULL)
+        {
+            break; // Run with the workers we have.
+        }
+        args->id = worker_count;
+        args->seen = generation;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, _worker, args) != 0)
+        {
+            free(args);
+            break; // Run with the workers we have.
+        }
+        pthread_detach(thread);
+        worker_count++;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static int _online_processors(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+int par_threads(void)
+{
+    int threads = atomic_load_explicit(&thread_count, memory_order_relaxed);
+    if (threads == 0)
+    {
+        const char *env = getenv("CNN_THREADS");
+        threads = env != NULL ? atoi(env) : _online_processors();
+        threads = threads < 1 ? 1 : threads > PAR_MAX_THREADS ? PAR_MAX_THREADS : threads;
+        int expected = 0;
+        atomic_compare_exchange_strong(&thread_count, &expected, threads);
+        threads = atomic_load(&thread_count);
+    }
+    return threads;
+}
+
+void par_setThreads(int threads)
+{
+    threads = threads < 1 ? 1 : threads > PAR_MAX_THREADS ? PAR_MAX_THREADS : threads;
+    atomic_store(&thread_count, threads);
+}
+
+void par_for(long long n, long long grain, ParallelBody body, void *ctx)
+{
+    if (n <= 0)
+    {
+        return;
+    }
+    grain = grain < 1 ? 1 : grain;
+
+    int threads = par_threads();
+    if (threads <= 1 || n <= grain || in_parallel || pthread_mutex_trylock(&run_lock) != 0)
+    {
+        body(ctx, 0, n);
+        return;
+    }
+
+    _start_workers(threads - 1);
+
+    // A few chunks per thread, so that uneven iterations still balance.
+    long long chunks = n / grain < 4LL * threads ? n / grain : 4LL * threads;
+    job.body = body;
+    job.ctx = ctx;
+    job.n = n;
+    job.chunk = (n + chunks - 1) / chunks;
+    atomic_store(&job.next, 0);
+
+    pthread_mutex_lock(&pool_mutex);
+    participants = threads - 1;
+    busy_workers = worker_count;
+    generation++;
+    pthread_cond_broadcast(&job_ready);
+    pthread_mutex_unlock(&pool_mutex);
+
+    in_parallel = 1;
+    _run_chunks();
+    in_parallel = 0;
+
+    pthread_mutex_lock(&pool_mutex);
+    while (busy_workers > 0)
+    {
+        pthread_cond_wait(&job_done, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_mutex_unlock(&run_lock);
+}
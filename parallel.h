@@ -0,0 +1,43 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/**
+ * @brief Body of a parallel loop, runs the iterations [begin, end).
+ *
+ */
+typedef void (*ParallelBody)(void *ctx, long long begin, long long end);
+
+/**
+ * @brief Run body over the iterations [0, n) on the thread pool.
+ *
+ * Iterations are handed out in chunks of at least grain iterations, the calling thread
+ * takes part and the call returns once all of them are done. The loop runs serially on the
+ * calling thread when n <= grain, when there is one thread, when it is called from inside
+ * another parallel loop, or while another thread is running a parallel loop.
+ *
+ * @param n Number of iterations.
+ * @param grain Minimum number of iterations worth handing to another thread.
+ * @param body Loop body.
+ * @param ctx Passed to body.
+ */
+void par_for(long long n, long long grain, ParallelBody body, void *ctx);
+
+/**
+ * @brief Number of threads parallel loops run on, including the calling thread.
+ *
+ * Defaults to the number of online processors, or the environment variable CNN_THREADS.
+ *
+ * @return int
+ */
+int par_threads(void);
+
+/**
+ * @brief Set the number of threads parallel loops run on. 1 disables threading.
+ *
+ * Must not be called while a parallel loop is running.
+ *
+ * @param threads Number of threads, including the calling thread.
+ */
+void par_setThreads(int threads);
+
+#endif
@@ -0,0 +1,333 @@
+/**
+ * @file rng.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Counter based random matrices, reproducible for any number of threads.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+// As in xmath.c, the loops are written with selects only, so that GCC vectorizes them once
+// comparisons are known not to trap. Multiplications and additions are never fused, so the
+// values are rounded the same way by every instruction set.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("no-trapping-math", "tree-vectorize", "fp-contract=off")
+#endif
+#ifdef __clang__
+#pragma clang fp contract(off)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "rng.h"
+#include "xmath.h"
+#include "cpu.h"
+#include "parallel.h"
+#include "trace.h"
+
+// Threefry4x32-20 rotations and key schedule parity (Salmon et al., SC 2011). It needs
+// additions, rotations and xors only, which every vector unit has for 32 bit lanes.
+#define RNG_PARITY 0x1BD11BDAu
+#define RNG_ROUNDS 20
+#define RNG_LANES 16
+
+// Elements generated per task, a multiple of 2 * RNG_LANES so that chunks start on a group.
+#define RNG_CHUNK 4096
+// Chunks worth handing to another thread.
+#define RNG_PARALLEL_GRAIN 4
+
+#define RNG_PI_2 1.57079632679489661923
+
+typedef enum
+{
+    RNG_UNIFORM,
+    RNG_NORMAL
+} RngDistribution;
+
+static atomic_ullong rng_base = 0;
+static atomic_ullong rng_counter = 0;
+static atomic_int rng_seeded = 0;
+
+static unsigned long long _splitmix(unsigned long long x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+void rng_setSeed(unsigned long long seed)
+{
+    atomic_store(&rng_base, seed);
+    atomic_store(&rng_counter, 0);
+    atomic_store(&rng_seeded, 2);
+}
+
+unsigned long long rng_nextSeed(void)
+{
+    int expected = 0;
+    if (atomic_load(&rng_seeded) == 0 && atomic_compare_exchange_strong(&rng_seeded, &expected, 1))
+    {
+        const char *env = getenv("CNN_SEED");
+        unsigned long long seed = env != NULL && env[0] != '\0'
+                                      ? strtoull(env, NULL, 0)
+                                      : _splitmix((unsigned long long)time(NULL)) ^ (unsigned long long)trace_now();
+        atomic_store(&rng_base, seed);
+        atomic_store(&rng_seeded, 2);
+    }
+    while (atomic_load(&rng_seeded) != 2)
+    {
+    }
+    return _splitmix(atomic_load(&rng_base) + 0x9E3779B97F4A7C15ULL * atomic_fetch_add(&rng_counter, 1));
+}
+
+// Blocks of RNG_LANES counters, one per 32 bit lane.
+typedef uint32_t RngVec __attribute__((vector_size(RNG_LANES * sizeof(uint32_t))));
+typedef uint32_t RngHalf __attribute__((vector_size(RNG_LANES / 2 * sizeof(uint32_t))));
+typedef uint64_t RngBits __attribute__((vector_size(RNG_LANES / 2 * sizeof(uint64_t))));
+
+#define RNG_ROTL(x, r) ((x) << (r) | (x) >> (32 - (r)))
+
+// Rounds 2i and 2i + 1 of a group of four, with the rotations of the group.
+#define RNG_DOUBLE_ROUND(r0, r1, r2, r3) \
+    x0 += x1, x1 = RNG_ROTL(x1, r0) ^ x0; \
+    x2 += x3, x3 = RNG_ROTL(x3, r1) ^ x2; \
+    x0 += x3, x3 = RNG_ROTL(x3, r2) ^ x0; \
+    x2 += x1, x1 = RNG_ROTL(x1, r3) ^ x2;
+
+// Key injection s, after every four rounds.
+#define RNG_INJECT(s)                                                      \
+    x0 += ks[(s) % 5], x1 += ks[((s) + 1) % 5], x2 += ks[((s) + 2) % 5], \
+        x3 += ks[((s) + 3) % 5] + (s);
+
+// 52 bits of words hi:lo in the mantissa of a double in [1, 2), for half h of the lanes.
+#define RNG_BITS(hi, lo, h)                                                                                  \
+    (__builtin_convertvector(__builtin_shufflevector(hi, hi, 8 * (h), 8 * (h) + 1, 8 * (h) + 2, 8 * (h) + 3, \
+                                                     8 * (h) + 4, 8 * (h) + 5, 8 * (h) + 6, 8 * (h) + 7),    \
+                             RngBits)                                                                        \
+         << 20 |                                                                                             \
+     __builtin_convertvector(__builtin_shufflevector(lo, lo, 8 * (h), 8 * (h) + 1, 8 * (h) + 2, 8 * (h) + 3, \
+                                                     8 * (h) + 4, 8 * (h) + 5, 8 * (h) + 6, 8 * (h) + 7),    \
+                             RngBits) >>                                                                     \
+         12 |                                                                                                \
+     0x3FF0000000000000ULL)
+
+/**
+ * @brief 2 * RNG_LANES values in [1, 2) per group of RNG_LANES counters from block on, 52
+ * random mantissa bits each. Value l of a group comes from words 0 and 1 of block l of the
+ * group, value RNG_LANES + l from words 2 and 3.
+ */
+static inline __attribute__((always_inline)) void _threefry(double *dst, unsigned long long block, long long groups,
+                                                            unsigned long long seed)
+{
+    const uint32_t ks[5] = {(uint32_t)seed, (uint32_t)(seed >> 32), 0, 0,
+                            RNG_PARITY ^ (uint32_t)seed ^ (uint32_t)(seed >> 32)};
+    const RngVec lane = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    for (long long g = 0; g < groups; g++)
+    {
+        unsigned long long first = block + g * RNG_LANES;
+        RngVec x0 = (uint32_t)first + lane;
+        RngVec x1 = (uint32_t)(first >> 32) - (RngVec)(x0 < (uint32_t)first); // Carry.
+        RngVec x2 = {0}, x3 = {0};
+
+        RNG_INJECT(0);
+#pragma GCC unroll 5
+        for (int s = 1; s <= RNG_ROUNDS / 4; s++)
+        {
+            if (s % 2)
+            {
+                RNG_DOUBLE_ROUND(10, 26, 11, 21);
+                RNG_DOUBLE_ROUND(13, 27, 23, 5);
+            }
+            else
+            {
+                RNG_DOUBLE_ROUND(6, 20, 17, 11);
+                RNG_DOUBLE_ROUND(25, 10, 18, 20);
+            }
+            RNG_INJECT(s);
+        }
+
+        RngBits bits[4] = {RNG_BITS(x0, x1, 0), RNG_BITS(x0, x1, 1), RNG_BITS(x2, x3, 0), RNG_BITS(x2, x3, 1)};
+        memcpy(dst + 2 * RNG_LANES * g, bits, sizeof(bits));
+    }
+}
+
+/**
+ * @brief Square root of v >= 0 by Newton steps on its reciprocal, from a bit level first guess.
+ * Unlike sqrt it never sets errno, so it vectorizes without -fno-math-errno.
+ */
+static inline double _sqrt(double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bits = 0x5FE6EB50C7B537A9ULL - (bits >> 1);
+    double y;
+    memcpy(&y, &bits, sizeof(y));
+    double h = 0.5 * v;
+    y = y * (1.5 - h * y * y);
+    y = y * (1.5 - h * y * y);
+    y = y * (1.5 - h * y * y);
+    y = y * (1.5 - h * y * y);
+    return v > 0 ? v * y : 0;
+}
+
+/**
+ * @brief Normal pairs from the uniform values u1 in (0, 1] and u2 in [0, 1), RNG_LANES apart in
+ * every group of x, given log(u1). The angle 2 pi u2 is reduced to the nearest quarter turn,
+ * where the Taylor series of sin and cos to degree 15 and 16 are accurate to double precision.
+ */
+static inline __attribute__((always_inline)) void _box_muller(double *x, const double *log_u1, long long groups,
+                                                              double mean, double std)
+{
+    for (long long g = 0; g < groups; g++)
+    {
+        double *x1 = x + 2 * RNG_LANES * g, *x2 = x1 + RNG_LANES;
+        for (int l = 0; l < RNG_LANES; l++)
+        {
+            double r = std * _sqrt(-2.0 * log_u1[RNG_LANES * g + l]);
+            double t = 4.0 * x2[l];
+            double q = (t + 6755399441055744.0) - 6755399441055744.0;
+            double f = (t - q) * RNG_PI_2, f2 = f * f;
+
+            double s = f + f * f2 * (-1.0 / 6 + f2 * (1.0 / 120 + f2 * (-1.0 / 5040 + f2 * (1.0 / 362880 + f2 * (-1.0 / 39916800 + f2 * (1.0 / 6227020800.0 + f2 * (-1.0 / 1307674368000.0)))))));
+            double c = 1.0 + f2 * (-1.0 / 2 + f2 * (1.0 / 24 + f2 * (-1.0 / 720 + f2 * (1.0 / 40320 + f2 * (-1.0 / 3628800 + f2 * (1.0 / 479001600.0 + f2 * (-1.0 / 87178291200.0 + f2 * (1.0 / 20922789888000.0))))))));
+
+            // cos and sin of f plus q quarter turns, q = 4 being a full turn.
+            bool odd = q == 1.0 || q == 3.0;
+            double cos_part = odd ? s : c, sin_part = odd ? c : s;
+            double cos_t = q == 1.0 || q == 2.0 ? -cos_part : cos_part;
+            double sin_t = q == 2.0 || q == 3.0 ? -sin_part : sin_part;
+            x1[l] = mean + r * cos_t;
+            x2[l] = mean + r * sin_t;
+        }
+    }
+}
+
+/**
+ * @brief Values of the n elements from the group of counters at block on, into x of
+ * RNG_CHUNK elements. log_u1 is scratch of RNG_CHUNK / 2 elements for the normal distribution.
+ */
+#define RNG_CHUNK_FUNCTION(suffix)                                                                       \
+    static void _chunk_##suffix(double *x, double *log_u1, unsigned long long block, long long n,         \
+                                unsigned long long seed, RngDistribution dist, double a, double b)       \
+    {                                                                                                    \
+        long long groups = (n + 2 * RNG_LANES - 1) / (2 * RNG_LANES);                                    \
+        _threefry(x, block, groups, seed);                                                               \
+        if (dist == RNG_UNIFORM)                                                                         \
+        {                                                                                                \
+            for (long long i = 0; i < 2 * RNG_LANES * groups; i++)                                       \
+            {                                                                                            \
+                x[i] = a + (b - a) * (x[i] - 1.0);                                                       \
+            }                                                                                            \
+            return;                                                                                      \
+        }                                                                                                \
+        for (long long g = 0; g < groups; g++)                                                           \
+        {                                                                                                \
+            for (int l = 0; l < RNG_LANES; l++)                                                          \
+            {                                                                                            \
+                log_u1[RNG_LANES * g + l] = 2.0 - x[2 * RNG_LANES * g + l];                              \
+                x[2 * RNG_LANES * g + RNG_LANES + l] -= 1.0;                                             \
+            }                                                                                            \
+        }                                                                                                \
+        xmath_vlogScalar(log_u1, log_u1, RNG_LANES * groups);                                            \
+        _box_muller(x, log_u1, groups, a, b);                                                            \
+    }
+
+typedef void (*RngChunkFunction)(double *x, double *log_u1, unsigned long long block, long long n,
+                                 unsigned long long seed, RngDistribution dist, double a, double b);
+
+RNG_CHUNK_FUNCTION(scalar)
+
+#ifdef CPU_DISPATCH
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+RNG_CHUNK_FUNCTION(sse2)
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+RNG_CHUNK_FUNCTION(avx2)
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+RNG_CHUNK_FUNCTION(avx512)
+#pragma GCC pop_options
+
+static const RngChunkFunction chunk_variants[CPU_ISA_COUNT] = {_chunk_scalar, _chunk_sse2, _chunk_avx2, _chunk_avx512};
+
+#else
+
+static const RngChunkFunction chunk_variants[CPU_ISA_COUNT] = {_chunk_scalar};
+
+#endif
+
+typedef struct
+{
+    Matrix *mat;
+    long long size;
+    unsigned long long seed;
+    RngDistribution dist;
+    double a, b;
+    RngChunkFunction chunk;
+} RngArgs;
+
+static void _fill_chunks(void *ctx, long long begin, long long end)
+{
+    RngArgs *args = ctx;
+    Matrix *mat = args->mat;
+    double x[RNG_CHUNK], log_u1[RNG_CHUNK / 2];
+    for (long long c = begin; c < end; c++)
+    {
+        long long first = c * RNG_CHUNK;
+        long long n = args->size - first < RNG_CHUNK ? args->size - first : RNG_CHUNK;
+        args->chunk(x, log_u1, first / 2, n, args->seed, args->dist, args->a, args->b);
+
+        // Scatter into rows, element k of the chunk is element first + k in row major order.
+        for (long long k = 0; k < n;)
+        {
+            long long i = (first + k) / mat->col, j = (first + k) % mat->col;
+            long long len = mat->col - j < n - k ? mat->col - j : n - k;
+            memcpy(mat_row(mat, i) + j, x + k, len * sizeof(double));
+            k += len;
+        }
+    }
+}
+
+static void _fill(Matrix *mat, RngDistribution dist, double a, double b, unsigned long long seed, const char *name)
+{
+    TRACE_BEGIN();
+    mat_detach(mat);
+    RngArgs args = {mat, mat->row * mat->col, seed, dist, a, b, chunk_variants[cpu_isa()]};
+    par_for((args.size + RNG_CHUNK - 1) / RNG_CHUNK, RNG_PARALLEL_GRAIN, _fill_chunks, &args);
+    TRACE_END(name, mat->row, mat->col, 0, args.size * sizeof(double), 0);
+}
+
+void rng_uniform(Matrix *mat, double low, double high, unsigned long long seed)
+{
+    _fill(mat, RNG_UNIFORM, low, high, seed, "rng_uniform");
+}
+
+void rng_normal(Matrix *mat, double mean, double std, unsigned long long seed)
+{
+    _fill(mat, RNG_NORMAL, mean, std, seed, "rng_normal");
+}
+
+void rng_xavier(Matrix *mat, long long fan_in, long long fan_out, unsigned long long seed)
+{
+    double scale = sqrt(6.0 / (fan_in + fan_out));
+    _fill(mat, RNG_UNIFORM, -scale, scale, seed, "rng_xavier");
+}
+
+void rng_he(Matrix *mat, long long fan_in, unsigned long long seed)
+{
+    _fill(mat, RNG_NORMAL, 0, sqrt(2.0 / fan_in), seed, "rng_he");
+}
@@ -0,0 +1,77 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include "linalg.h"
+
+/**
+ * @brief Set the seed of the sequence rng_nextSeed draws from, and restart the sequence.
+ *
+ * Without a call the seed comes from the CNN_SEED environment variable, or from the clock
+ * when it is not set.
+ *
+ * @param seed Seed.
+ */
+void rng_setSeed(unsigned long long seed);
+
+/**
+ * @brief Next seed of the global sequence, distinct on every call. Thread safe.
+ *
+ * xmat_rand and the weight initialization of nn_buildLayer draw their seeds from it, so a
+ * program that calls rng_setSeed first builds the same matrices on every run.
+ *
+ * @return unsigned long long
+ */
+unsigned long long rng_nextSeed(void);
+
+/**
+ * @brief Fill a matrix with values uniformly distributed in [low, high).
+ *
+ * Values come from the Threefry4x32-20 counter based generator: element k, in row major order,
+ * is a function of the seed and k alone. The fill runs on the thread pool and gives the same
+ * matrix for any number of threads and any instruction set, so a seed rebuilds the same
+ * matrix on every x86 host.
+ *
+ * @param mat Matrix, overwritten.
+ * @param low Lower bound.
+ * @param high Upper bound.
+ * @param seed Seed.
+ */
+void rng_uniform(Matrix *mat, double low, double high, unsigned long long seed);
+
+/**
+ * @brief Fill a matrix with normally distributed values, by the Box-Muller transform.
+ *
+ * Reproducible like rng_uniform, in the XMATH_FAST and XMATH_FASTEST tiers; in XMATH_EXACT
+ * the logarithm comes from libm, which may round differently between hosts.
+ *
+ * @param mat Matrix, overwritten.
+ * @param mean Mean.
+ * @param std Standard deviation.
+ * @param seed Seed.
+ */
+void rng_normal(Matrix *mat, double mean, double std, unsigned long long seed);
+
+/**
+ * @brief Xavier (Glorot) uniform initialization, in +-sqrt(6 / (fan_in + fan_out)).
+ *
+ * Suited to layers followed by tanh or sigmoid.
+ *
+ * @param mat Matrix, overwritten.
+ * @param fan_in Number of inputs of the layer.
+ * @param fan_out Number of outputs of the layer.
+ * @param seed Seed.
+ */
+void rng_xavier(Matrix *mat, long long fan_in, long long fan_out, unsigned long long seed);
+
+/**
+ * @brief He (Kaiming) normal initialization, with standard deviation sqrt(2 / fan_in).
+ *
+ * Suited to layers followed by ReLU.
+ *
+ * @param mat Matrix, overwritten.
+ * @param fan_in Number of inputs of the layer.
+ * @param seed Seed.
+ */
+void rng_he(Matrix *mat, long long fan_in, unsigned long long seed);
+
+#endif
@@ -0,0 +1,668 @@
+/**
+ * @file serve.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief In-process inference server with dynamic micro-batching.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "serve.h"
+#include "trace.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#define SERVE_BUCKETS_PER_OCTAVE 16 // Latency histogram resolution, 2^(1/16) is about 4.4%.
+#define SERVE_BUCKETS (SERVE_BUCKETS_PER_OCTAVE * 32)
+#define SERVE_ACCEPT_BACKOFF_US 10000 // Pause of the acceptor when it is out of descriptors or memory.
+
+#ifdef MSG_NOSIGNAL
+#define SERVE_SEND_FLAGS MSG_NOSIGNAL // A client that hung up is not worth a SIGPIPE.
+#else
+#define SERVE_SEND_FLAGS 0
+#endif
+
+typedef struct ServeRequest ServeRequest;
+
+struct ServeRequest
+{
+    _Atomic(ServeRequest *) next; // Queue link.
+    double *input;
+    double *output;
+    long long output_size;
+    long long submitted; // trace_now at submission.
+    ServeCallback callback;
+    void *user;
+
+    // Completion of a future.
+    atomic_int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+typedef struct ServeConnection
+{
+    int fd;
+    pthread_t thread;
+    struct ServeConnection *next;
+} ServeConnection;
+
+struct NNServer
+{
+    NN *nn;
+    ServeConfig config;
+    NNContext *ctx;
+    Matrix *inputs; // max_batch x input_size staging rows of a batch.
+    ServeRequest **batch;
+
+    // Intrusive MPSC queue: producers exchange head, the scheduler alone follows tail.
+    _Atomic(ServeRequest *) head;
+    ServeRequest *tail;
+    ServeRequest stub;
+
+    // The scheduler sleeps on wake when the queue is empty, producers signal it only then.
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    atomic_int sleeping;
+    atomic_int stopping;
+    pthread_t scheduler;
+
+    atomic_llong requests;
+    atomic_llong batches;
+    atomic_llong max_ns;
+    atomic_llong histogram[SERVE_BUCKETS];
+
+    // Unix domain socket front end, listen_fd is -1 when not listening. Connections remove
+    // themselves from the list when their client hangs up, until closing is set.
+    int listen_fd;
+    char *path;
+    pthread_t acceptor;
+    atomic_int closing;
+    pthread_mutex_t conn_mutex;
+    ServeConnection *connections;
+};
+
+ServeConfig serve_defaultConfig(void)
+{
+    ServeConfig config = {64, 1000};
+    return config;
+}
+
+// ===== Queue =====
+
+static void _push(NNServer *server, ServeRequest *request)
+{
+    atomic_store_explicit(&request->next, NULL, memory_order_relaxed);
+    ServeRequest *prev = atomic_exchange(&server->head, request);
+    atomic_store_explicit(&prev->next, request, memory_order_release);
+}
+
+/**
+ * @brief Oldest request, or NULL when the queue is empty or its oldest push is not linked yet.
+ */
+static ServeRequest *_pop(NNServer *server)
+{
+    ServeRequest *tail = server->tail;
+    ServeRequest *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &server->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        server->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL)
+    {
+        server->tail = next;
+        return tail;
+    }
+
+    // tail is the last request, put the stub behind it so it can be taken out.
+    if (tail != atomic_load(&server->head))
+    {
+        return NULL;
+    }
+    _push(server, &server->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        server->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static bool _empty(NNServer *server)
+{
+    return server->tail == &server->stub && atomic_load(&server->head) == &server->stub;
+}
+
+static void _enqueue(NNServer *server, ServeRequest *request)
+{
+    request->submitted = trace_now();
+    _push(server, request);
+    if (atomic_load(&server->sleeping))
+    {
+        pthread_mutex_lock(&server->mutex);
+        pthread_cond_signal(&server->wake);
+        pthread_mutex_unlock(&server->mutex);
+    }
+}
+
+// ===== Scheduler =====
+
+/**
+ * @brief Sleep until a request arrives, the server stops or the deadline (trace_now time,
+ * negative for none) passes.
+ */
+static void _sleep(NNServer *server, long long deadline)
+{
+    pthread_mutex_lock(&server->mutex);
+    atomic_store(&server->sleeping, 1);
+    if (_empty(server) && !atomic_load(&server->stopping))
+    {
+        if (deadline < 0)
+        {
+            pthread_cond_wait(&server->wake, &server->mutex);
+        }
+        else
+        {
+            // Timed waits take the realtime clock.
+            long long remaining = deadline - trace_now();
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            long long ns = ts.tv_nsec + (remaining > 0 ? remaining : 0);
+            ts.tv_sec += ns / 1000000000LL;
+            ts.tv_nsec = ns % 1000000000LL;
+            pthread_cond_timedwait(&server->wake, &server->mutex, &ts);
+        }
+    }
+    atomic_store(&server->sleeping, 0);
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static void _record(NNServer *server, long long latency_ns)
+{
+    double us = latency_ns * 1e-3;
+    int bucket = (int)(log2(1.0 + us) * SERVE_BUCKETS_PER_OCTAVE);
+    bucket = bucket < 0 ? 0 : bucket >= SERVE_BUCKETS ? SERVE_BUCKETS - 1 : bucket;
+    atomic_fetch_add_explicit(&server->histogram[bucket], 1, memory_order_relaxed);
+    if (latency_ns > atomic_load_explicit(&server->max_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&server->max_ns, latency_ns, memory_order_relaxed);
+    }
+}
+
+static void _complete(ServeRequest *request)
+{
+    if (request->callback != NULL)
+    {
+        request->callback(request->output, request->output_size, request->user);
+        free(request);
+        return;
+    }
+    pthread_mutex_lock(&request->mutex);
+    atomic_store(&request->done, 1);
+    pthread_cond_signal(&request->cond);
+    pthread_mutex_unlock(&request->mutex);
+}
+
+static void _run_batch(NNServer *server, long long count)
+{
+    NN *nn = server->nn;
+    server->inputs->row = count;
+    for (long long i = 0; i < count; i++)
+    {
+        memcpy(mat_row(server->inputs, i), server->batch[i]->input, nn->input_size * sizeof(double));
+    }
+
+    Matrix *outputs = nn_forwardBatch(server->ctx, server->inputs);
+
+    // Counted before any client wakes, so serve_stats after serve_wait includes its request.
+    long long now = trace_now();
+    for (long long i = 0; i < count; i++)
+    {
+        _record(server, now - server->batch[i]->submitted);
+    }
+    atomic_fetch_add_explicit(&server->requests, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&server->batches, 1, memory_order_relaxed);
+
+    for (long long i = 0; i < count; i++)
+    {
+        ServeRequest *request = server->batch[i];
+        memcpy(request->output, mat_row(outputs, i), nn->output_size * sizeof(double));
+        _complete(request);
+    }
+}
+
+static void *_scheduler(void *arg)
+{
+    NNServer *server = arg;
+    long long max_delay_ns = server->config.max_delay_us * 1000;
+    for (;;)
+    {
+        ServeRequest *request = _pop(server);
+        if (request == NULL)
+        {
+            if (!_empty(server))
+            {
+                sched_yield(); // A producer is between its two steps of _push.
+            }
+            else if (atomic_load(&server->stopping))
+            {
+                break;
+            }
+            else
+            {
+                _sleep(server, -1);
+            }
+            continue;
+        }
+
+        // Gather more requests until the batch is full or the oldest one has waited enough.
+        long long count = 0;
+        server->batch[count++] = request;
+        long long deadline = request->submitted + max_delay_ns;
+        while (count < server->config.max_batch)
+        {
+            request = _pop(server);
+            if (request != NULL)
+            {
+                server->batch[count++] = request;
+            }
+            else if (!_empty(server))
+            {
+                sched_yield();
+            }
+            else if (atomic_load(&server->stopping) || trace_now() >= deadline)
+            {
+                break;
+            }
+            else
+            {
+                _sleep(server, deadline);
+            }
+        }
+        _run_batch(server, count);
+    }
+    return NULL;
+}
+
+// ===== Requests =====
+
+/**
+ * @brief Allocate a request with its input copied, input and output live in the same block.
+ */
+static ServeRequest *_request(NNServer *server, const double *input)
+{
+    long long in = server->nn->input_size, out = server->nn->output_size;
+    ServeRequest *request = malloc(sizeof(ServeRequest) + (in + out) * sizeof(double));
+    if (request == NULL)
+    {
+        fprintf(stderr, "Serve submit failed: Can't allocate memory for the request.");
+        exit(1);
+    }
+    request->input = (double *)(request + 1);
+    request->output = request->input + in;
+    request->output_size = out;
+    memcpy(request->input, input, in * sizeof(double));
+    return request;
+}
+
+NNServer *serve_create(NN *nn, ServeConfig config)
+{
+    if (config.max_batch <= 0 || config.max_delay_us < 0)
+    {
+        fprintf(stderr, "Serve create failed: Invalid batch size %lld or delay %lld us.",
+                config.max_batch, config.max_delay_us);
+        exit(1);
+    }
+
+    NNServer *server = calloc(1, sizeof(NNServer));
+    if (server == NULL)
+    {
+        fprintf(stderr, "Serve create failed: Can't allocate memory for the server.");
+        exit(1);
+    }
+    server->nn = nn;
+    server->config = config;
+    server->ctx = nn_createContext(nn, config.max_batch);
+    server->inputs = mat_alloc(config.max_batch, nn->input_size);
+    server->batch = malloc(config.max_batch * sizeof(ServeRequest *));
+
+    atomic_init(&server->stub.next, NULL);
+    atomic_init(&server->head, &server->stub);
+    server->tail = &server->stub;
+    pthread_mutex_init(&server->mutex, NULL);
+    pthread_cond_init(&server->wake, NULL);
+    pthread_mutex_init(&server->conn_mutex, NULL);
+    server->listen_fd = -1;
+
+    if (pthread_create(&server->scheduler, NULL, _scheduler, server) != 0)
+    {
+        fprintf(stderr, "Serve create failed: Can't start the scheduler thread.");
+        exit(1);
+    }
+    return server;
+}
+
+ServeFuture *serve_submit(NNServer *server, const double *input)
+{
+    ServeRequest *request = _request(server, input);
+    request->callback = NULL;
+    request->user = NULL;
+    atomic_init(&request->done, 0);
+    pthread_mutex_init(&request->mutex, NULL);
+    pthread_cond_init(&request->cond, NULL);
+    _enqueue(server, request);
+    return request;
+}
+
+void serve_submitCallback(NNServer *server, const double *input, ServeCallback callback, void *user)
+{
+    ServeRequest *request = _request(server, input);
+    request->callback = callback;
+    request->user = user;
+    _enqueue(server, request);
+}
+
+bool serve_ready(ServeFuture *future)
+{
+    return atomic_load(&future->done);
+}
+
+void serve_wait(ServeFuture *future, double *output)
+{
+    pthread_mutex_lock(&future->mutex);
+    while (!atomic_load(&future->done))
+    {
+        pthread_cond_wait(&future->cond, &future->mutex);
+    }
+    pthread_mutex_unlock(&future->mutex);
+
+    memcpy(output, future->output, future->output_size * sizeof(double));
+    pthread_mutex_destroy(&future->mutex);
+    pthread_cond_destroy(&future->cond);
+    free(future);
+}
+
+static double _percentile(long long *histogram, long long total, double fraction)
+{
+    long long rank = (long long)ceil(fraction * total), seen = 0;
+    for (int b = 0; b < SERVE_BUCKETS; b++)
+    {
+        seen += histogram[b];
+        if (seen >= rank && seen > 0)
+        {
+            return exp2((double)(b + 1) / SERVE_BUCKETS_PER_OCTAVE) - 1.0; // Upper edge of the bucket.
+        }
+    }
+    return 0;
+}
+
+ServeStats serve_stats(NNServer *server)
+{
+    long long histogram[SERVE_BUCKETS], total = 0;
+    for (int b = 0; b < SERVE_BUCKETS; b++)
+    {
+        histogram[b] = atomic_load_explicit(&server->histogram[b], memory_order_relaxed);
+        total += histogram[b];
+    }
+
+    ServeStats stats;
+    stats.requests = atomic_load(&server->requests);
+    stats.batches = atomic_load(&server->batches);
+    stats.mean_batch = stats.batches > 0 ? (double)stats.requests / stats.batches : 0;
+    stats.p50_us = _percentile(histogram, total, 0.50);
+    stats.p99_us = _percentile(histogram, total, 0.99);
+    stats.max_us = atomic_load(&server->max_ns) * 1e-3;
+    return stats;
+}
+
+// ===== Unix domain socket front end =====
+
+#ifndef _WIN32
+
+static bool _transfer(int fd, void *buf, size_t bytes, bool sending)
+{
+    char *p = buf;
+    while (bytes > 0)
+    {
+        ssize_t n = sending ? send(fd, p, bytes, SERVE_SEND_FLAGS) : recv(fd, p, bytes, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+typedef struct
+{
+    NNServer *server;
+    ServeConnection *connection;
+} ConnectionArgs;
+
+static void *_serve_connection(void *arg)
+{
+    ConnectionArgs *args = arg;
+    NNServer *server = args->server;
+    ServeConnection *connection = args->connection;
+    int fd = connection->fd;
+    free(args);
+
+    long long in = server->nn->input_size, out = server->nn->output_size;
+    double *buf = malloc((in > out ? in : out) * sizeof(double));
+    while (_transfer(fd, buf, in * sizeof(double), false))
+    {
+        serve_wait(serve_submit(server, buf), buf);
+        if (!_transfer(fd, buf, out * sizeof(double), true))
+        {
+            break;
+        }
+    }
+    free(buf);
+
+    // The client hung up: release the connection here, unless _stop_listening joins it.
+    pthread_mutex_lock(&server->conn_mutex);
+    if (!atomic_load(&server->closing))
+    {
+        ServeConnection **link = &server->connections;
+        while (*link != connection)
+        {
+            link = &(*link)->next;
+        }
+        *link = connection->next;
+        close(fd);
+        free(connection);
+        pthread_detach(pthread_self());
+    }
+    pthread_mutex_unlock(&server->conn_mutex);
+    return NULL;
+}
+
+static bool _transient(int err)
+{
+    return err == EINTR || err == ECONNABORTED || err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+
+static void *_acceptor(void *arg)
+{
+    NNServer *server = arg;
+    for (;;)
+    {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (atomic_load(&server->closing))
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            break; // The listening socket was shut down by serve_free.
+        }
+        if (fd < 0)
+        {
+            if (!_transient(errno))
+            {
+                fprintf(stderr, "Serve accept failed: %s, no longer accepting on %s.\n", strerror(errno), server->path);
+                break;
+            }
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                // Out of descriptors or memory until connections close, retry shortly.
+                struct timespec pause = {0, SERVE_ACCEPT_BACKOFF_US * 1000L};
+                nanosleep(&pause, NULL);
+            }
+            continue;
+        }
+
+        ServeConnection *connection = malloc(sizeof(ServeConnection));
+        ConnectionArgs *args = malloc(sizeof(ConnectionArgs));
+        if (connection == NULL || args == NULL)
+        {
+            close(fd);
+            free(connection);
+            free(args);
+            continue;
+        }
+        connection->fd = fd;
+        args->server = server;
+        args->connection = connection;
+
+        // Listed before the thread starts, so that it always finds itself when it ends.
+        pthread_mutex_lock(&server->conn_mutex);
+        connection->next = server->connections;
+        server->connections = connection;
+        if (pthread_create(&connection->thread, NULL, _serve_connection, args) != 0)
+        {
+            server->connections = connection->next;
+            close(fd);
+            free(connection);
+            free(args);
+        }
+        pthread_mutex_unlock(&server->conn_mutex);
+    }
+    return NULL;
+}
+
+void serve_listen(NNServer *server, const char *path)
+{
+    struct sockaddr_un addr;
+    if (server->listen_fd >= 0 || strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Serve listen failed: Already listening, or socket path %s is too long.", path);
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Serve listen failed: Can't listen on %s: %s.", path, strerror(errno));
+        exit(1);
+    }
+    server->listen_fd = fd;
+    server->path = strdup(path);
+    if (pthread_create(&server->acceptor, NULL, _acceptor, server) != 0)
+    {
+        fprintf(stderr, "Serve listen failed: Can't start the accept thread.");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Stop accepting, hang up on every client and wait for the connection threads.
+ */
+static void _stop_listening(NNServer *server)
+{
+    if (server->listen_fd < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&server->conn_mutex);
+    atomic_store(&server->closing, 1);
+    pthread_mutex_unlock(&server->conn_mutex);
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->acceptor, NULL);
+    close(server->listen_fd);
+    unlink(server->path);
+    free(server->path);
+
+    // The acceptor is gone and connections no longer remove themselves, the list is fixed.
+    ServeConnection *connection = server->connections;
+    while (connection != NULL)
+    {
+        ServeConnection *next = connection->next;
+        shutdown(connection->fd, SHUT_RDWR);
+        pthread_join(connection->thread, NULL);
+        close(connection->fd);
+        free(connection);
+        connection = next;
+    }
+    server->connections = NULL;
+    server->listen_fd = -1;
+    atomic_store(&server->closing, 0);
+}
+
+#else
+
+static void _stop_listening(NNServer *server)
+{
+    (void)server;
+}
+
+#endif
+
+void serve_free(NNServer *server)
+{
+    if (server == NULL)
+    {
+        return;
+    }
+
+    // Connections may still wait on requests, stop them while the scheduler runs.
+    _stop_listening(server);
+
+    // No request comes in any more, the scheduler drains the queue before it exits.
+    atomic_store(&server->stopping, 1);
+    pthread_mutex_lock(&server->mutex);
+    pthread_cond_signal(&server->wake);
+    pthread_mutex_unlock(&server->mutex);
+    pthread_join(server->scheduler, NULL);
+
+    pthread_mutex_destroy(&server->mutex);
+    pthread_cond_destroy(&server->wake);
+    pthread_mutex_destroy(&server->conn_mutex);
+    nn_freeContext(server->ctx);
+    mat_free(server->inputs);
+    free(server->batch);
+    free(server);
+}
@@ -0,0 +1,132 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdbool.h>
+#include "nn.h"
+
+/**
+ * @brief Batching limits of an inference server.
+ *
+ */
+typedef struct
+{
+    long long max_batch;    // Most requests run in one forward pass.
+    long long max_delay_us; // Longest time the oldest request of a batch waits for more requests.
+} ServeConfig;
+
+/**
+ * @brief Counters of an inference server since it was created.
+ *
+ * Latencies run from submission to completion and are read from a histogram with about 5%
+ * resolution.
+ */
+typedef struct
+{
+    long long requests;
+    long long batches;
+    double mean_batch;
+    double p50_us;
+    double p99_us;
+    double max_us;
+} ServeStats;
+
+typedef struct NNServer NNServer;
+typedef struct ServeRequest ServeFuture;
+
+/**
+ * @brief Called with the output of a request, on the scheduler thread, so it should be short.
+ *
+ * @param output Output array of size output_size, valid during the call.
+ * @param output_size Output size of the network.
+ * @param user Passed to serve_submitCallback.
+ */
+typedef void (*ServeCallback)(const double *output, long long output_size, void *user);
+
+/**
+ * @brief Default limits, batches of up to 64 requests and 1 ms of queueing delay.
+ *
+ * @return ServeConfig
+ */
+ServeConfig serve_defaultConfig(void);
+
+/**
+ * @brief Start an inference server for a network.
+ *
+ * A scheduler thread takes requests from a lock-free queue, coalesces them into batches of
+ * up to max_batch requests, waiting at most max_delay_us after the oldest one arrived, and
+ * runs each batch as one nn_forwardBatch in a context of its own. The network must not be
+ * trained while the server runs.
+ *
+ * @param nn Neural network struct pointer.
+ * @param config Batching limits.
+ * @return NNServer*
+ */
+NNServer *serve_create(NN *nn, ServeConfig config);
+
+/**
+ * @brief Complete the pending requests, stop the server and its socket, and free it.
+ *
+ * No request may be submitted during or after the call.
+ *
+ * @param server Server struct pointer.
+ */
+void serve_free(NNServer *server);
+
+/**
+ * @brief Submit one sample for inference, from any thread, without blocking.
+ *
+ * @param server Server struct pointer.
+ * @param input Input array of size input_size, copied before the call returns.
+ * @return ServeFuture* To be passed to serve_wait exactly once.
+ */
+ServeFuture *serve_submit(NNServer *server, const double *input);
+
+/**
+ * @brief Submit one sample for inference and have its output passed to a callback.
+ *
+ * @param server Server struct pointer.
+ * @param input Input array of size input_size, copied before the call returns.
+ * @param callback Called once with the output.
+ * @param user Passed to callback.
+ */
+void serve_submitCallback(NNServer *server, const double *input, ServeCallback callback, void *user);
+
+/**
+ * @brief Whether the output of a submitted request is ready, so serve_wait will not block.
+ *
+ * @param future Future of serve_submit.
+ * @return bool
+ */
+bool serve_ready(ServeFuture *future);
+
+/**
+ * @brief Wait for the output of a submitted request and release its future.
+ *
+ * @param future Future of serve_submit.
+ * @param output Output array of size output_size.
+ */
+void serve_wait(ServeFuture *future, double *output);
+
+/**
+ * @brief Counters of a server.
+ *
+ * @param server Server struct pointer.
+ * @return ServeStats
+ */
+ServeStats serve_stats(NNServer *server);
+
+#ifndef _WIN32
+/**
+ * @brief Accept connections on a Unix domain socket, served until serve_free.
+ *
+ * A client writes requests of input_size doubles and reads one reply of output_size doubles
+ * per request, in order, in the byte order of the host. Each connection is handled by a
+ * thread that keeps one request in flight; use several connections for concurrency.
+ *
+ * @param server Server struct pointer.
+ * @param path Path of the socket, replaced if it exists.
+ */
+void serve_listen(NNServer *server, const char *path);
+#endif
+
+#endif
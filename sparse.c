@@ -0,0 +1,338 @@
+/**
+ * @file sparse.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Sparse matrices in CSR format and their products with dense matrices.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sparse.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "trace.h"
+
+// Least number of multiply-adds worth handing to another thread.
+#define SPMM_PARALLEL_GRAIN (1 << 15)
+
+/**
+ * @brief Allocate a sparse matrix with room for nnz nonzeros.
+ */
+static SparseMatrix *_spmat_alloc(long long row, long long col, long long nnz)
+{
+    if (row <= 0 || col <= 0 || nnz < 0)
+    {
+        fprintf(stderr, "Sparse Matrix Create Failed: Invalid matrix size %lld x %lld with %lld nonzeros.\n", row, col, nnz);
+        exit(1);
+    }
+
+    SparseMatrix *sp = malloc(sizeof(SparseMatrix));
+    long long *row_ptr = calloc(row + 1, sizeof(long long));
+    long long *col_idx = malloc((nnz > 0 ? nnz : 1) * sizeof(long long));
+    double *values = malloc((nnz > 0 ? nnz : 1) * sizeof(double));
+    if (sp == NULL || row_ptr == NULL || col_idx == NULL || values == NULL)
+    {
+        fprintf(stderr, "Sparse Matrix Create Failed: Can't allocate %lld x %lld matrix with %lld nonzeros.\n", row, col, nnz);
+        exit(1);
+    }
+
+    sp->row = row;
+    sp->col = col;
+    sp->nnz = nnz;
+    sp->row_ptr = row_ptr;
+    sp->col_idx = col_idx;
+    sp->values = values;
+    return sp;
+}
+
+SparseMatrix *spmat_fromDense(Matrix *mat)
+{
+    TRACE_BEGIN();
+    long long nnz = 0;
+    for (long long i = 0; i < mat->row; i++)
+    {
+        const double *x = mat_row(mat, i);
+        for (long long j = 0; j < mat->col; j++)
+        {
+            nnz += x[j] != 0;
+        }
+    }
+
+    SparseMatrix *sp = _spmat_alloc(mat->row, mat->col, nnz);
+    long long k = 0;
+    for (long long i = 0; i < mat->row; i++)
+    {
+        const double *x = mat_row(mat, i);
+        for (long long j = 0; j < mat->col; j++)
+        {
+            if (x[j] != 0)
+            {
+                sp->col_idx[k] = j;
+                sp->values[k] = x[j];
+                k++;
+            }
+        }
+        sp->row_ptr[i + 1] = k;
+    }
+
+    TRACE_END("spmat_fromDense", mat->row, mat->col, 0, mat->row * mat->col * sizeof(double), 0);
+    return sp;
+}
+
+typedef struct
+{
+    long long col;
+    double value;
+} SparseEntry;
+
+static int _cmp_entry(const void *a, const void *b)
+{
+    long long x = ((const SparseEntry *)a)->col;
+    long long y = ((const SparseEntry *)b)->col;
+    return (x > y) - (x < y);
+}
+
+SparseMatrix *spmat_fromCOO(long long row, long long col, long long nnz,
+                            const long long *rows, const long long *cols, const double *values)
+{
+    TRACE_BEGIN();
+    SparseMatrix *sp = _spmat_alloc(row, col, nnz);
+
+    // Bucket the triplets by row.
+    for (long long k = 0; k < nnz; k++)
+    {
+        if (rows[k] < 0 || rows[k] >= row || cols[k] < 0 || cols[k] >= col)
+        {
+            fprintf(stderr, "Sparse Matrix Create Failed: Triplet %lld at (%lld, %lld) is out of bounds.\n",
+                    k, rows[k], cols[k]);
+            exit(1);
+        }
+        sp->row_ptr[rows[k] + 1]++;
+    }
+    for (long long i = 0; i < row; i++)
+    {
+        sp->row_ptr[i + 1] += sp->row_ptr[i];
+    }
+
+    SparseEntry *entries = malloc((nnz > 0 ? nnz : 1) * sizeof(SparseEntry));
+    long long *next = malloc(row * sizeof(long long));
+    memcpy(next, sp->row_ptr, row * sizeof(long long));
+    for (long long k = 0; k < nnz; k++)
+    {
+        SparseEntry *entry = &entries[next[rows[k]]++];
+        entry->col = cols[k];
+        entry->value = values[k];
+    }
+
+    // Sort every row by column and sum duplicates, compacting in place.
+    long long out = 0;
+    for (long long i = 0; i < row; i++)
+    {
+        long long begin = sp->row_ptr[i];
+        long long end = sp->row_ptr[i + 1];
+        qsort(entries + begin, end - begin, sizeof(SparseEntry), _cmp_entry);
+
+        sp->row_ptr[i] = out;
+        for (long long k = begin; k < end; k++)
+        {
+            if (out > sp->row_ptr[i] && sp->col_idx[out - 1] == entries[k].col)
+            {
+                sp->values[out - 1] += entries[k].value;
+            }
+            else
+            {
+                sp->col_idx[out] = entries[k].col;
+                sp->values[out] = entries[k].value;
+                out++;
+            }
+        }
+    }
+    sp->row_ptr[row] = out;
+    sp->nnz = out;
+
+    free(entries);
+    free(next);
+    TRACE_END("spmat_fromCOO", row, col, nnz, nnz * (2 * sizeof(long long) + sizeof(double)), 0);
+    return sp;
+}
+
+SparseMatrix *spmat_copy(SparseMatrix *sp)
+{
+    SparseMatrix *copy = _spmat_alloc(sp->row, sp->col, sp->nnz);
+    memcpy(copy->row_ptr, sp->row_ptr, (sp->row + 1) * sizeof(long long));
+    memcpy(copy->col_idx, sp->col_idx, sp->nnz * sizeof(long long));
+    memcpy(copy->values, sp->values, sp->nnz * sizeof(double));
+    return copy;
+}
+
+void spmat_free(SparseMatrix *sp)
+{
+    if (sp == NULL)
+    {
+        return;
+    }
+    free(sp->row_ptr);
+    free(sp->col_idx);
+    free(sp->values);
+    free(sp);
+}
+
+Matrix *spmat_toDense(SparseMatrix *sp)
+{
+    Matrix *dense = mat_alloc(sp->row, sp->col);
+    for (long long i = 0; i < sp->row; i++)
+    {
+        double *y = mat_row(dense, i);
+        memset(y, 0, sp->col * sizeof(double));
+        for (long long k = sp->row_ptr[i]; k < sp->row_ptr[i + 1]; k++)
+        {
+            y[sp->col_idx[k]] = sp->values[k];
+        }
+    }
+    return dense;
+}
+
+typedef struct
+{
+    SparseMatrix *sp;
+    Matrix *mat;
+    Matrix *bias;
+    MatrixEpilogue act;
+    Matrix *out;
+    const MatKernels *kern;
+} SpmmArgs;
+
+static void _spmm_rows(void *ctx, long long begin, long long end)
+{
+    SpmmArgs *args = ctx;
+    SparseMatrix *sp = args->sp;
+    long long n = args->mat->col;
+
+    for (long long i = begin; i < end; i++)
+    {
+        double *y = mat_row(args->out, i);
+        if (args->bias != NULL)
+        {
+            memcpy(y, args->bias->data, n * sizeof(double));
+        }
+        else
+        {
+            memset(y, 0, n * sizeof(double));
+        }
+
+        // y += v * mat[k] for every nonzero v at column k.
+        for (long long k = sp->row_ptr[i]; k < sp->row_ptr[i + 1]; k++)
+        {
+            double v = sp->values[k];
+            const double *x = mat_row(args->mat, sp->col_idx[k]);
+            for (long long j = 0; j < n; j++)
+            {
+                y[j] += v * x[j];
+            }
+        }
+        kern_epilogue(args->kern, y, n, args->act);
+    }
+}
+
+Matrix *spmat_multmatFused(SparseMatrix *sp, Matrix *mat, Matrix *bias, MatrixEpilogue act, Matrix *out)
+{
+    TRACE_BEGIN();
+    if (sp->col != mat->row)
+    {
+        fprintf(stderr,
+                "Sparse Matrix Multiply Matrix Failed: "
+                "Cannot multiply matrix with size %lld x %lld and size %lld x %lld.",
+                sp->row, sp->col, mat->row, mat->col);
+        exit(1);
+    }
+
+    if (bias != NULL && (bias->row != 1 || bias->col != mat->col))
+    {
+        fprintf(stderr,
+                "Sparse Matrix Multiply Matrix Failed: "
+                "Bias should have size 1 x %lld, got %lld x %lld.",
+                mat->col, bias->row, bias->col);
+        exit(1);
+    }
+
+    if (out == NULL)
+    {
+        out = mat_alloc(sp->row, mat->col);
+    }
+    else if (out->row != sp->row || out->col != mat->col)
+    {
+        fprintf(stderr,
+                "Sparse Matrix Multiply Matrix Failed: "
+                "Output should have size %lld x %lld, got %lld x %lld.",
+                sp->row, mat->col, out->row, out->col);
+        exit(1);
+    }
+    else
+    {
+        mat_detach(out);
+    }
+
+    SpmmArgs args = {sp, mat, bias, act, out, kern_get()};
+    long long work_per_row = (sp->nnz / sp->row + 1) * mat->col;
+    par_for(sp->row, SPMM_PARALLEL_GRAIN / work_per_row + 1, _spmm_rows, &args);
+
+    TRACE_END("spmat_multmat", sp->row, mat->col, sp->col,
+              (sp->nnz * (mat->col + 2) + out->row * out->col) * sizeof(double), 2.0 * sp->nnz * mat->col);
+    return out;
+}
+
+Matrix *spmat_multmat(SparseMatrix *sp, Matrix *mat)
+{
+    return spmat_multmatFused(sp, mat, NULL, MAT_EPI_NONE, NULL);
+}
+
+typedef struct
+{
+    SparseMatrix *sp;
+    Matrix *vec;
+    Matrix *out;
+} SpmvArgs;
+
+static void _spmv_rows(void *ctx, long long begin, long long end)
+{
+    SpmvArgs *args = ctx;
+    SparseMatrix *sp = args->sp;
+    const double *x = args->vec->data;
+    long long stride = args->vec->stride;
+
+    for (long long i = begin; i < end; i++)
+    {
+        double sum = 0;
+        for (long long k = sp->row_ptr[i]; k < sp->row_ptr[i + 1]; k++)
+        {
+            sum += sp->values[k] * x[sp->col_idx[k] * stride];
+        }
+        args->out->data[i] = sum;
+    }
+}
+
+Matrix *spmat_multvec(SparseMatrix *sp, Matrix *vec)
+{
+    TRACE_BEGIN();
+    if (vec->col != 1 || vec->row != sp->col)
+    {
+        fprintf(stderr,
+                "Sparse Matrix Multiply Vector Failed: "
+                "Vector should have size %lld x 1, got %lld x %lld.",
+                sp->col, vec->row, vec->col);
+        exit(1);
+    }
+
+    Matrix *out = mat_alloc(sp->row, 1);
+    SpmvArgs args = {sp, vec, out};
+    par_for(sp->row, SPMM_PARALLEL_GRAIN / (sp->nnz / sp->row + 1) + 1, _spmv_rows, &args);
+
+    TRACE_END("spmat_multvec", sp->row, 1, sp->col,
+              (sp->nnz * 2 + sp->row) * sizeof(double), 2.0 * sp->nnz);
+    return out;
+}
@@ -0,0 +1,102 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "linalg.h"
+
+/**
+ * @brief Sparse matrix in compressed sparse row (CSR) format.
+ *
+ * The nonzeros of row i are values[row_ptr[i] .. row_ptr[i + 1]), in columns col_idx of
+ * the same range, sorted ascending within every row.
+ */
+typedef struct
+{
+    long long row;
+    long long col;
+    long long nnz;
+    long long *row_ptr;
+    long long *col_idx;
+    double *values;
+} SparseMatrix;
+
+/**
+ * @brief Create a sparse matrix holding the nonzero elements of a dense matrix.
+ *
+ * @param mat Dense matrix.
+ * @return SparseMatrix*
+ */
+SparseMatrix *spmat_fromDense(Matrix *mat);
+
+/**
+ * @brief Create a sparse matrix from coordinate (COO) triplets.
+ *
+ * Triplets may come in any order, duplicated coordinates are summed.
+ *
+ * @param row Row size of matrix.
+ * @param col Column size of matrix.
+ * @param nnz Number of triplets.
+ * @param rows Row index of every triplet.
+ * @param cols Column index of every triplet.
+ * @param values Value of every triplet.
+ * @return SparseMatrix*
+ */
+SparseMatrix *spmat_fromCOO(long long row, long long col, long long nnz,
+                            const long long *rows, const long long *cols, const double *values);
+
+/**
+ * @brief Copy a sparse matrix.
+ *
+ * @param sp Sparse matrix.
+ * @return SparseMatrix*
+ */
+SparseMatrix *spmat_copy(SparseMatrix *sp);
+
+/**
+ * @brief Free a sparse matrix.
+ *
+ * @param sp Sparse matrix, may be NULL.
+ */
+void spmat_free(SparseMatrix *sp);
+
+/**
+ * @brief Convert a sparse matrix to a dense one.
+ *
+ * @param sp Sparse matrix.
+ * @return Matrix*
+ */
+Matrix *spmat_toDense(SparseMatrix *sp);
+
+/**
+ * @brief Sparse matrix times dense column vector (SpMV).
+ *
+ * @param sp Sparse matrix of size m x n.
+ * @param vec Column matrix of size n x 1.
+ * @return Matrix* Column matrix of size m x 1.
+ */
+Matrix *spmat_multvec(SparseMatrix *sp, Matrix *vec);
+
+/**
+ * @brief Sparse matrix times dense matrix (SpMM).
+ *
+ * @param sp Sparse matrix of size m x k.
+ * @param mat Dense matrix of size k x n.
+ * @return Matrix* Dense matrix of size m x n.
+ */
+Matrix *spmat_multmat(SparseMatrix *sp, Matrix *mat);
+
+/**
+ * @brief Sparse matrix times dense matrix with a fused bias and activation epilogue,
+ * see mat_multmatFused.
+ *
+ * Rows are distributed over the thread pool (parallel.h).
+ *
+ * @param sp Sparse matrix of size m x k.
+ * @param mat Dense matrix of size k x n.
+ * @param bias Row matrix of size 1 x n added to every output row, or NULL.
+ * @param act Activation applied to every output element.
+ * @param out Output matrix of size m x n, or NULL to allocate one.
+ * @return Matrix*
+ */
+Matrix *spmat_multmatFused(SparseMatrix *sp, Matrix *mat, Matrix *bias, MatrixEpilogue act, Matrix *out);
+
+#endif
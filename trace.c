@@ -0,0 +1,219 @@
+/**
+ * @file trace.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Per-operation tracing with Chrome trace export.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "trace.h"
+
+// Events kept per thread before the oldest ones are overwritten.
+#define TRACE_CAPACITY (1 << 16)
+
+typedef struct
+{
+    const char *name;
+    long long start;
+    long long end;
+    long long m;
+    long long n;
+    long long k;
+    double bytes;
+    double flops;
+} TraceEvent;
+
+typedef struct TraceBuffer
+{
+    TraceEvent events[TRACE_CAPACITY];
+    atomic_llong head; // Total events written, only advanced by the owning thread.
+    int tid;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+atomic_bool trace_enabled = false;
+
+static _Atomic(TraceBuffer *) buffers = NULL;
+static atomic_int next_tid = 0;
+static _Thread_local TraceBuffer *local_buffer = NULL;
+
+void trace_enable(bool enabled)
+{
+    atomic_store_explicit(&trace_enabled, enabled, memory_order_relaxed);
+}
+
+long long trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static TraceBuffer *_local_buffer(void)
+{
+    if (local_buffer != NULL)
+    {
+        return local_buffer;
+    }
+
+    TraceBuffer *buffer = malloc(sizeof(TraceBuffer));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Trace failed: Can't allocate memory for trace buffer.");
+        exit(1);
+    }
+    atomic_init(&buffer->head, 0);
+    buffer->tid = atomic_fetch_add(&next_tid, 1);
+
+    // Lock-free push onto the global list of buffers.
+    TraceBuffer *old_head = atomic_load(&buffers);
+    do
+    {
+        buffer->next = old_head;
+    } while (!atomic_compare_exchange_weak(&buffers, &old_head, buffer));
+
+    local_buffer = buffer;
+    return buffer;
+}
+
+void trace_record(const char *name, long long start,
+                  long long m, long long n, long long k,
+                  double bytes, double flops)
+{
+    // Tracing was switched on in the middle of the operation.
+    if (start == 0)
+    {
+        return;
+    }
+
+    long long end = trace_now();
+    TraceBuffer *buffer = _local_buffer();
+    long long head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+
+    TraceEvent *event = &buffer->events[head % TRACE_CAPACITY];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    event->m = m;
+    event->n = n;
+    event->k = k;
+    event->bytes = bytes;
+    event->flops = flops;
+
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+void trace_reset(void)
+{
+    for (TraceBuffer *buffer = atomic_load(&buffers); buffer != NULL; buffer = buffer->next)
+    {
+        atomic_store(&buffer->head, 0);
+    }
+}
+
+/**
+ * @brief Index range [first, head) of the events still held by a buffer.
+ */
+static long long _first_event(long long head)
+{
+    return head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+}
+
+bool trace_exportChrome(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Trace export failed: Can't open %s for writing.\n", path);
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    bool first = true;
+    for (TraceBuffer *buffer = atomic_load(&buffers); buffer != NULL; buffer = buffer->next)
+    {
+        long long head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        for (long long i = _first_event(head); i < head; i++)
+        {
+            TraceEvent *event = &buffer->events[i % TRACE_CAPACITY];
+            fprintf(file,
+                    "%s{\"name\": \"%s\", \"cat\": \"c-nn\", \"ph\": \"X\", "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, "
+                    "\"args\": {\"shape\": \"%lldx%lldx%lld\", \"bytes\": %.0f, \"flops\": %.0f}}",
+                    first ? "" : ",\n",
+                    event->name, event->start / 1e3, (event->end - event->start) / 1e3,
+                    buffer->tid, event->m, event->n, event->k, event->bytes, event->flops);
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
+
+typedef struct
+{
+    const char *name;
+    long long calls;
+    long long total_ns;
+    double bytes;
+    double flops;
+} TraceSummary;
+
+void trace_summary(void)
+{
+    long long capacity = 64;
+    long long count = 0;
+    TraceSummary *rows = malloc(capacity * sizeof(TraceSummary));
+
+    for (TraceBuffer *buffer = atomic_load(&buffers); buffer != NULL; buffer = buffer->next)
+    {
+        long long head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        for (long long i = _first_event(head); i < head; i++)
+        {
+            TraceEvent *event = &buffer->events[i % TRACE_CAPACITY];
+
+            long long r = 0;
+            while (r < count && strcmp(rows[r].name, event->name) != 0)
+            {
+                r++;
+            }
+            if (r == count)
+            {
+                if (count == capacity)
+                {
+                    capacity *= 2;
+                    rows = realloc(rows, capacity * sizeof(TraceSummary));
+                }
+                rows[count++] = (TraceSummary){event->name, 0, 0, 0, 0};
+            }
+
+            rows[r].calls++;
+            rows[r].total_ns += event->end - event->start;
+            rows[r].bytes += event->bytes;
+            rows[r].flops += event->flops;
+        }
+    }
+
+    printf("%-20s %10s %12s %12s %10s %10s\n",
+           "operation", "calls", "total(ms)", "mean(us)", "GFLOP/s", "GB/s");
+    for (long long r = 0; r < count; r++)
+    {
+        double seconds = rows[r].total_ns * 1e-9;
+        printf("%-20s %10lld %12.3f %12.3f %10.3f %10.3f\n",
+               rows[r].name, rows[r].calls, seconds * 1e3,
+               seconds * 1e6 / rows[r].calls,
+               seconds > 0 ? rows[r].flops / seconds * 1e-9 : 0,
+               seconds > 0 ? rows[r].bytes / seconds * 1e-9 : 0);
+    }
+
+    free(rows);
+}
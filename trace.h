@@ -0,0 +1,103 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/**
+ * @brief Whether operations are being recorded. Toggle with trace_enable.
+ *
+ */
+extern atomic_bool trace_enabled;
+
+#if defined(__GNUC__)
+#define TRACE_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define TRACE_UNLIKELY(x) (x)
+#endif
+
+/**
+ * @brief Mark the start of a traced operation. Costs one predictable branch when disabled.
+ *
+ * The flag is read once, relaxed: an operation is recorded if tracing was on when it began.
+ */
+#define TRACE_BEGIN()                                                                          \
+    long long _trace_start = TRACE_UNLIKELY(atomic_load_explicit(&trace_enabled, memory_order_relaxed)) \
+                                 ? trace_now()                                                 \
+                                 : 0
+
+/**
+ * @brief Record a traced operation started by TRACE_BEGIN in the same scope.
+ *
+ * @param name Operation name, must be a string literal.
+ * @param m First dimension of the operation shape.
+ * @param n Second dimension of the operation shape.
+ * @param k Third dimension of the operation shape, 0 if unused.
+ * @param bytes Bytes read and written.
+ * @param flops Estimated floating point operations.
+ */
+#define TRACE_END(name, m, n, k, bytes, flops)                                  \
+    do                                                                          \
+    {                                                                           \
+        if (TRACE_UNLIKELY(_trace_start != 0))                                  \
+        {                                                                       \
+            trace_record(name, _trace_start, m, n, k, (double)(bytes), (double)(flops)); \
+        }                                                                       \
+    } while (0)
+
+/**
+ * @brief Turn recording on or off.
+ *
+ * @param enabled Whether to record.
+ */
+void trace_enable(bool enabled);
+
+/**
+ * @brief Monotonic timestamp in nanoseconds.
+ *
+ * @return long long
+ */
+long long trace_now(void);
+
+/**
+ * @brief Append an event to the calling thread's ring buffer.
+ *
+ * Every thread owns its buffer, so recording takes no lock. When a buffer is full the
+ * oldest events are overwritten.
+ *
+ * @param name Operation name, must outlive the trace.
+ * @param start Start timestamp from trace_now, 0 if tracing was off at the start.
+ * @param m First dimension of the operation shape.
+ * @param n Second dimension of the operation shape.
+ * @param k Third dimension of the operation shape.
+ * @param bytes Bytes read and written.
+ * @param flops Estimated floating point operations.
+ */
+void trace_record(const char *name, long long start,
+                  long long m, long long n, long long k,
+                  double bytes, double flops);
+
+/**
+ * @brief Drop all recorded events.
+ *
+ */
+void trace_reset(void);
+
+/**
+ * @brief Write all recorded events as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ *
+ * Call while no other thread is recording.
+ *
+ * @param path Output file path.
+ * @return bool Whether the file was written.
+ */
+bool trace_exportChrome(const char *path);
+
+/**
+ * @brief Print calls, time, flops and bytes aggregated per operation.
+ *
+ * Time is inclusive, an operation calling another traced operation counts both.
+ */
+void trace_summary(void);
+
+#endif
@@ -0,0 +1,268 @@
+/**
+ * @file tune.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Per host tuning of the matrix multiplication, cached in a file.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tune.h"
+#include "cpu.h"
+#include "parallel.h"
+#include "trace.h"
+
+#define TUNE_KEY_SIZE 160
+#define TUNE_LINE_SIZE 256
+#define TUNE_MAX_ENTRIES 64
+
+// Product the block sizes are tuned on, several blocks deep in every direction.
+#define TUNE_BLOCK_PRODUCT 512
+// Flops timed per candidate of the small and parallel crossovers.
+#define TUNE_CROSSOVER_FLOPS 2e7
+
+static Matrix *_fill(long long row, long long col, unsigned long long seed)
+{
+    Matrix *mat = mat_alloc(row, col);
+    for (long long i = 0; i < row; i++)
+    {
+        double *x = mat_row(mat, i);
+        for (long long j = 0; j < col; j++)
+        {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            x[j] = (double)(seed >> 11) / 9007199254740992.0 - 0.5;
+        }
+    }
+    return mat;
+}
+
+/**
+ * @brief Best time in seconds of count products of square size n under a configuration.
+ */
+static double _time(const MatGemmConfig *config, long long n, long long count, int reps)
+{
+    Matrix *a = _fill(n, n, 1), *b = _fill(n, n, 2), *out = mat_alloc(n, n);
+    double best = HUGE_VAL;
+    for (int r = 0; r <= reps; r++)
+    {
+        long long start = trace_now();
+        for (long long i = 0; i < count; i++)
+        {
+            mat_multmatConfig(a, b, NULL, MAT_EPI_NONE, out, config);
+        }
+        double elapsed = (trace_now() - start) * 1e-9;
+        best = r > 0 && elapsed < best ? elapsed : best; // The first run warms up.
+    }
+    mat_free(a);
+    mat_free(b);
+    mat_free(out);
+    return best;
+}
+
+static long long _repeats(long long n)
+{
+    return (long long)(TUNE_CROSSOVER_FLOPS / (2.0 * n * n * n)) + 1;
+}
+
+MatGemmConfig tune_gemm(bool full)
+{
+    MatGemmConfig best = mat_defaultGemmConfig();
+
+    long long block_ns[] = {128, 256, 512};
+    long long block_ks[] = {64, 128, 256};
+    double best_time = HUGE_VAL;
+    for (size_t i = 0; i < sizeof(block_ns) / sizeof(block_ns[0]); i++)
+    {
+        for (size_t j = 0; j < sizeof(block_ks) / sizeof(block_ks[0]); j++)
+        {
+            MatGemmConfig candidate = best;
+            candidate.block_n = block_ns[i];
+            candidate.block_k = block_ks[j];
+            double elapsed = _time(&candidate, TUNE_BLOCK_PRODUCT, 1, 3);
+            if (elapsed < best_time)
+            {
+                best_time = elapsed;
+                best.block_n = candidate.block_n;
+                best.block_k = candidate.block_k;
+            }
+        }
+    }
+
+    // Unblocked loops, up to the largest product where they still win.
+    long long small_sizes[] = {2, 4, 8, 12, 16, 24, 32, 48, 64};
+    for (size_t i = 0; i < sizeof(small_sizes) / sizeof(small_sizes[0]); i++)
+    {
+        long long n = small_sizes[i];
+        MatGemmConfig blocked = best, unblocked = best;
+        blocked.small_flops = 0;
+        unblocked.small_flops = HUGE_VAL;
+        if (_time(&unblocked, n, _repeats(n), 3) >= _time(&blocked, n, _repeats(n), 3))
+        {
+            break;
+        }
+        best.small_flops = 2.0 * n * n * n;
+    }
+
+    // Threads, from the smallest product where they pay off.
+    long long parallel_sizes[] = {64, 96, 128, 192, 256, 384, 512};
+    for (size_t i = 0; par_threads() > 1 && i < sizeof(parallel_sizes) / sizeof(parallel_sizes[0]); i++)
+    {
+        long long n = parallel_sizes[i];
+        MatGemmConfig serial = best, parallel = best;
+        serial.parallel_flops = HUGE_VAL;
+        parallel.parallel_flops = 0;
+        if (_time(&parallel, n, _repeats(n), 3) < 0.9 * _time(&serial, n, _repeats(n), 3))
+        {
+            best.parallel_flops = 2.0 * n * n * n;
+            break;
+        }
+    }
+
+    // One level of Strassen-Winograd, from the smallest size where it pays off.
+    long long strassen_sizes[] = {2048, 4096};
+    for (size_t i = 0; full && i < sizeof(strassen_sizes) / sizeof(strassen_sizes[0]); i++)
+    {
+        long long n = strassen_sizes[i];
+        MatGemmConfig strassen = best;
+        strassen.strassen_min = n;
+        if (_time(&strassen, n, 1, 1) < _time(&best, n, 1, 1))
+        {
+            best.strassen_min = n;
+            break;
+        }
+    }
+    return best;
+}
+
+static void _host_key(char *key, size_t size)
+{
+    snprintf(key, size, "%s/%s/%d", cpu_model(), cpu_isaName(cpu_isa()), par_threads());
+}
+
+const char *tune_cachePath(void)
+{
+    static char path[4096];
+    const char *env = getenv("CNN_TUNE_FILE");
+    const char *home = getenv("HOME");
+    if (env != NULL && env[0] != '\0')
+    {
+        snprintf(path, sizeof(path), "%s", env);
+    }
+    else if (home != NULL && home[0] != '\0')
+    {
+        snprintf(path, sizeof(path), "%s/.cnn_tune", home);
+    }
+    else
+    {
+        snprintf(path, sizeof(path), ".cnn_tune");
+    }
+    return path;
+}
+
+// A cache line is the host key, a tab, then the configuration.
+static bool _parse(const char *line, const char *key, MatGemmConfig *config)
+{
+    const char *tab = strchr(line, '\t');
+    if (tab == NULL || (size_t)(tab - line) != strlen(key) || strncmp(line, key, tab - line) != 0)
+    {
+        return false;
+    }
+    MatGemmConfig parsed;
+    if (sscanf(tab + 1, "%lld %lld %lf %lf %lld", &parsed.block_n, &parsed.block_k,
+               &parsed.small_flops, &parsed.parallel_flops, &parsed.strassen_min) != 5)
+    {
+        return false;
+    }
+    *config = parsed;
+    return true;
+}
+
+bool tune_load(const char *path, MatGemmConfig *config)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    char key[TUNE_KEY_SIZE], line[TUNE_LINE_SIZE];
+    _host_key(key, sizeof(key));
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file) != NULL)
+    {
+        found = line[0] != '#' && _parse(line, key, config);
+    }
+    fclose(file);
+    return found;
+}
+
+bool tune_save(const char *path, const MatGemmConfig *config)
+{
+    char key[TUNE_KEY_SIZE];
+    _host_key(key, sizeof(key));
+
+    // Keep the entries of other hosts sharing the file.
+    char kept[TUNE_MAX_ENTRIES][TUNE_LINE_SIZE];
+    int count = 0;
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
+    {
+        char line[TUNE_LINE_SIZE];
+        MatGemmConfig ignored;
+        while (count < TUNE_MAX_ENTRIES && fgets(line, sizeof(line), file) != NULL)
+        {
+            if (line[0] != '#' && strchr(line, '\t') != NULL && !_parse(line, key, &ignored))
+            {
+                memcpy(kept[count++], line, sizeof(line));
+            }
+        }
+        fclose(file);
+    }
+
+    file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return false;
+    }
+    fprintf(file, "# c-nn matrix multiplication tuning: host\tblock_n block_k small_flops parallel_flops strassen_min\n");
+    for (int i = 0; i < count; i++)
+    {
+        fputs(kept[i], file);
+    }
+    fprintf(file, "%s\t%lld %lld %.17g %.17g %lld\n", key, config->block_n, config->block_k,
+            config->small_flops, config->parallel_flops, config->strassen_min);
+    return fclose(file) == 0;
+}
+
+void tune_ensure(void)
+{
+    const char *mode = getenv("CNN_TUNE");
+    MatGemmConfig config = mat_defaultGemmConfig();
+    if (mode != NULL && strcmp(mode, "0") == 0)
+    {
+        mat_setGemmConfig(&config);
+        return;
+    }
+
+    bool full = mode != NULL && strcmp(mode, "full") == 0;
+    bool force = full || (mode != NULL && strcmp(mode, "force") == 0);
+    const char *path = tune_cachePath();
+    if (!force && tune_load(path, &config))
+    {
+        mat_setGemmConfig(&config);
+        return;
+    }
+
+    config = tune_gemm(full);
+    mat_setGemmConfig(&config);
+    if (!tune_save(path, &config))
+    {
+        fprintf(stderr, "Tuning: Can't write %s, mat_multmat will be tuned again on the next run.\n", path);
+    }
+}
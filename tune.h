@@ -0,0 +1,56 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdbool.h>
+#include "linalg.h"
+
+/**
+ * @brief Benchmark candidate block sizes and crossovers of mat_multmat on this host.
+ *
+ * Times the blocked GEMM with every candidate block size, then finds the largest tiny
+ * product still faster unblocked and the smallest one faster on the thread pool. Takes
+ * well under a second, or tens of seconds with the Strassen-Winograd crossover.
+ *
+ * @param full Also time Strassen-Winograd against the blocked GEMM at 2048 and 4096.
+ * @return MatGemmConfig
+ */
+MatGemmConfig tune_gemm(bool full);
+
+/**
+ * @brief Path of the tuning cache: CNN_TUNE_FILE if set, otherwise .cnn_tune in the home
+ * directory, or in the working directory without one.
+ *
+ * @return const char*
+ */
+const char *tune_cachePath(void);
+
+/**
+ * @brief Read the configuration cached for this host from a tuning cache.
+ *
+ * Entries are keyed by CPU model, instruction set and number of threads.
+ *
+ * @param path Cache file.
+ * @param config Set to the cached configuration.
+ * @return true if the file has an entry for this host.
+ */
+bool tune_load(const char *path, MatGemmConfig *config);
+
+/**
+ * @brief Write the configuration of this host to a tuning cache, keeping other hosts' entries.
+ *
+ * @param path Cache file.
+ * @param config Configuration.
+ * @return true on success.
+ */
+bool tune_save(const char *path, const MatGemmConfig *config);
+
+/**
+ * @brief Configure mat_multmat for this host, called by the first product.
+ *
+ * Uses the cached configuration of this host, or tunes and caches one. The environment
+ * variable CNN_TUNE selects "0" to keep the defaults, "force" to tune again and "full" to
+ * tune again including the Strassen-Winograd crossover.
+ */
+void tune_ensure(void);
+
+#endif
@@ -12,26 +12,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <math.h>
 #include <stdarg.h>
-#include <time.h>
+#include <float.h>
 #include "linalg.h"
 #include "xlinalg.h"
+#include "parallel.h"
+#include "kernels.h"
+#include "trace.h"
+#include "rng.h"
 
-Matrix *xmat_traverse(Matrix *mat, MatrixElementOperation operation, ...)
+/**
+ * @brief Apply an element operation to every element of mat, which must not share storage.
+ */
+static Matrix *_traverse(Matrix *mat, MatrixElementOperation operation, va_list args)
 {
-    va_list args;
-    va_start(args, operation);
-    Matrix *new_mat = mat_copy(mat);
+    Matrix *new_mat = mat;
     for (long long i = 0; i < new_mat->row; i++)
     {
         for (long long j = 0; j < new_mat->col; j++)
         {
-            new_mat = operation(new_mat, i, j, args);
+            // Every element sees the dynamic arguments from the start.
+            va_list elem_args;
+            va_copy(elem_args, args);
+            new_mat = operation(new_mat, i, j, elem_args);
+            va_end(elem_args);
         }
     }
+    return new_mat;
+}
+
+Matrix *xmat_traverse(Matrix *mat, MatrixElementOperation operation, ...)
+{
+    TRACE_BEGIN();
+    va_list args;
+    va_start(args, operation);
+    // Operations may write data directly, so the copy gets its own storage up front.
+    Matrix *new_mat = mat_copy(mat);
+    mat_detach(new_mat);
+    new_mat = _traverse(new_mat, operation, args);
+    va_end(args);
+    TRACE_END("xmat_traverse", mat->row, mat->col, 0, 3 * mat->row * mat->col * sizeof(double), mat->row * mat->col);
+    return new_mat;
+}
 
+Matrix *xmat_traverseInPlace(Matrix *mat, MatrixElementOperation operation, ...)
+{
+    TRACE_BEGIN();
+    va_list args;
+    va_start(args, operation);
+    mat_detach(mat);
+    Matrix *new_mat = _traverse(mat, operation, args);
     va_end(args);
+    TRACE_END("xmat_traverseInPlace", mat->row, mat->col, 0, 2 * mat->row * mat->col * sizeof(double), mat->row * mat->col);
     return new_mat;
 }
 
@@ -45,25 +79,23 @@ Matrix *_set_diagonal(Matrix *mat, long long i, long long j, va_list args)
     return mat;
 }
 
-Matrix *_set_random(Matrix *mat, long long i, long long j, va_list args)
-{
-    double val = ((float)rand() / RAND_MAX) * 2.0f - 1.0f;
-    mat_write(mat, i, j, val);
-    return mat;
-}
-
 Matrix *xmat_diag(long long row, long long col, double val)
 {
-    double *empty_data = malloc(row * col * sizeof(double));
-    Matrix *diag_mat = mat_create(row, col, empty_data);
+    TRACE_BEGIN();
+    Matrix *diag_mat = mat_alloc(row, col);
+    memset(diag_mat->data, 0, row * col * sizeof(double));
 
-    return xmat_traverse(diag_mat, _set_diagonal, val);
+    diag_mat = xmat_traverseInPlace(diag_mat, _set_diagonal, val);
+    TRACE_END("xmat_diag", row, col, 0, row * col * sizeof(double), 0);
+    return diag_mat;
 }
 
 Matrix *xmat_zeros(long long row, long long col)
 {
-    double *empty_data = calloc(row * col, sizeof(double));
-    Matrix *zeros = mat_create(row, col, empty_data);
+    TRACE_BEGIN();
+    Matrix *zeros = mat_alloc(row, col);
+    memset(zeros->data, 0, row * col * sizeof(double));
+    TRACE_END("xmat_zeros", row, col, 0, row * col * sizeof(double), 0);
     return zeros;
 }
 
@@ -74,16 +106,16 @@ Matrix *xmat_identity(long long size)
 
 Matrix *xmat_rand(long long row, long long col)
 {
-    srand((unsigned int)time(NULL));
-
-    double *empty_data = malloc(row * col * sizeof(double));
-    Matrix *rand_mat = mat_create(row, col, empty_data);
-
-    return xmat_traverse(rand_mat, _set_random);
+    TRACE_BEGIN();
+    Matrix *rand_mat = mat_alloc(row, col);
+    rng_uniform(rand_mat, -1.0, 1.0, rng_nextSeed());
+    TRACE_END("xmat_rand", row, col, 0, row * col * sizeof(double), 0);
+    return rand_mat;
 }
 
 Matrix *xmat_submat(Matrix *mat, long long i_st, long long i_ed, long long j_st, long long j_ed)
 {
+    TRACE_BEGIN();
     if (i_st > i_ed || j_st > j_ed)
     {
         fprintf(stderr,
@@ -98,8 +130,7 @@ Matrix *xmat_submat(Matrix *mat, long long i_st, long long i_ed, long long j_st,
         exit(1);
     }
 
-    double *empty_data = malloc((i_ed - i_st) * (j_ed - j_st) * sizeof(double));
-    Matrix *submat = mat_create(i_ed - i_st, j_ed - j_st, empty_data);
+    Matrix *submat = mat_alloc(i_ed - i_st, j_ed - j_st);
 
     for (long long i = i_st; i < i_ed; i++)
     {
@@ -110,123 +141,150 @@ Matrix *xmat_submat(Matrix *mat, long long i_st, long long i_ed, long long j_st,
         }
     }
 
+    TRACE_END("xmat_submat", i_ed - i_st, j_ed - j_st, 0, 2 * (i_ed - i_st) * (j_ed - j_st) * sizeof(double), 0);
     return submat;
 }
 
-Matrix *xmat_hstack(Matrix *mat_l, Matrix *mat_r)
+Matrix *xmat_hconcat(Matrix **mats, long long count)
 {
-    if (mat_l->row != mat_r->row)
+    TRACE_BEGIN();
+    if (count <= 0)
     {
-        fprintf(stderr,
-                "Hstack failed: Invalid matrix size. "
-                "mal_l: %lld x %lld, mat_r: %lld x %lld.",
-                mat_l->row, mat_l->col, mat_r->row, mat_r->col);
+        fprintf(stderr, "Hconcat failed: No matrix to concatenate.");
         exit(1);
     }
 
-    Matrix *hstack = xmat_diag(mat_l->row, mat_l->col + mat_r->col, 0.0);
-
-    // Copy mat_l
-    for (long long i = 0; i < mat_l->row; i++)
+    long long col = 0;
+    for (long long m = 0; m < count; m++)
     {
-        for (long long j = 0; j < mat_l->col; j++)
+        if (mats[m]->row != mats[0]->row)
         {
-            double this_val = mat_read(mat_l, i, j);
-            mat_write(hstack, i, j, this_val);
+            fprintf(stderr,
+                    "Hconcat failed: Invalid matrix size. "
+                    "mats[0]: %lld x %lld, mats[%lld]: %lld x %lld.",
+                    mats[0]->row, mats[0]->col, m, mats[m]->row, mats[m]->col);
+            exit(1);
         }
+        col += mats[m]->col;
     }
 
-    // Copy mat_r
-    for (long long i = 0; i < mat_r->row; i++)
+    Matrix *hconcat = mat_alloc(mats[0]->row, col);
+    for (long long i = 0; i < hconcat->row; i++)
     {
-        for (long long j = 0; j < mat_r->col; j++)
+        double *dst = mat_row(hconcat, i);
+        for (long long m = 0; m < count; m++)
         {
-            double this_val = mat_read(mat_r, i, j);
-            mat_write(hstack, i, j + mat_l->col, this_val);
+            memcpy(dst, mat_row(mats[m], i), mats[m]->col * sizeof(double));
+            dst += mats[m]->col;
         }
     }
 
-    return hstack;
+    TRACE_END("xmat_hconcat", hconcat->row, hconcat->col, 0, 2 * hconcat->row * hconcat->col * sizeof(double), 0);
+    return hconcat;
 }
 
-Matrix *xmat_hrepeat(Matrix *mat, int n)
+Matrix *xmat_vconcat(Matrix **mats, long long count)
 {
-    if (n <= 0)
+    TRACE_BEGIN();
+    if (count <= 0)
     {
-        fprintf(stderr, "HRepeat failed: Repeat number should be larger than 0.");
+        fprintf(stderr, "Vconcat failed: No matrix to concatenate.");
+        exit(1);
     }
-    else if (n == 1)
+
+    long long row = 0;
+    for (long long m = 0; m < count; m++)
     {
-        return mat_copy(mat);
+        if (mats[m]->col != mats[0]->col)
+        {
+            fprintf(stderr,
+                    "Vconcat failed: Invalid matrix size. "
+                    "mats[0]: %lld x %lld, mats[%lld]: %lld x %lld.",
+                    mats[0]->row, mats[0]->col, m, mats[m]->row, mats[m]->col);
+            exit(1);
+        }
+        row += mats[m]->row;
     }
 
-    Matrix *hrepeat = mat_copy(mat);
-    for (int i = 0; i < n; i++)
+    Matrix *vconcat = mat_alloc(row, mats[0]->col);
+    long long i = 0;
+    for (long long m = 0; m < count; m++)
     {
-        hrepeat = xmat_hstack(hrepeat, mat);
+        if (mat_isContiguous(mats[m]))
+        {
+            memcpy(mat_row(vconcat, i), mats[m]->data, mats[m]->row * mats[m]->col * sizeof(double));
+            i += mats[m]->row;
+            continue;
+        }
+        for (long long r = 0; r < mats[m]->row; r++, i++)
+        {
+            memcpy(mat_row(vconcat, i), mat_row(mats[m], r), vconcat->col * sizeof(double));
+        }
     }
 
-    return hrepeat;
+    TRACE_END("xmat_vconcat", vconcat->row, vconcat->col, 0, 2 * vconcat->row * vconcat->col * sizeof(double), 0);
+    return vconcat;
 }
 
-Matrix *xmat_vstack(Matrix *mat_u, Matrix *mat_d)
+Matrix *xmat_hstack(Matrix *mat_l, Matrix *mat_r)
+{
+    return xmat_hconcat((Matrix *[]){mat_l, mat_r}, 2);
+}
+
+Matrix *xmat_hrepeat(Matrix *mat, int n)
 {
-    if (mat_u->col != mat_d->col)
+    TRACE_BEGIN();
+    if (n <= 0)
     {
-        fprintf(stderr,
-                "Vstack failed: Invalid matrix size. "
-                "mat_u: %lld x %lld, mat_d: %lld x %lld.",
-                mat_u->row, mat_u->col, mat_d->row, mat_d->col);
+        fprintf(stderr, "HRepeat failed: Repeat number should be larger than 0.");
         exit(1);
     }
 
-    Matrix *vstack = xmat_diag(mat_u->row + mat_u->row, mat_u->col, 0.0);
-
-    // Copy mat_u
-    for (long long i = 0; i < mat_u->row; i++)
+    Matrix *hrepeat = mat_alloc(mat->row, mat->col * n);
+    for (long long i = 0; i < mat->row; i++)
     {
-        for (long long j = 0; j < mat_u->col; j++)
+        const double *src = mat_row(mat, i);
+        double *dst = mat_row(hrepeat, i);
+        for (int r = 0; r < n; r++)
         {
-            double this_val = mat_read(mat_u, i, j);
-            mat_write(vstack, i, j, this_val);
+            memcpy(dst + r * mat->col, src, mat->col * sizeof(double));
         }
     }
 
-    // Copy mat_d
-    for (long long i = 0; i < mat_d->row; i++)
-    {
-        for (long long j = 0; j < mat_d->col; j++)
-        {
-            double this_val = mat_read(mat_d, i, j);
-            mat_write(vstack, i + mat_u->row, j, this_val);
-        }
-    }
+    TRACE_END("xmat_hrepeat", hrepeat->row, hrepeat->col, 0, (mat->row * mat->col + hrepeat->row * hrepeat->col) * sizeof(double), 0);
+    return hrepeat;
+}
 
-    return vstack;
+Matrix *xmat_vstack(Matrix *mat_u, Matrix *mat_d)
+{
+    return xmat_vconcat((Matrix *[]){mat_u, mat_d}, 2);
 }
 
 Matrix *xmat_vrepeat(Matrix *mat, int n)
 {
+    TRACE_BEGIN();
     if (n <= 0)
     {
-        fprintf(stderr, "HRepeat failed: Repeat number should be larger than 0.");
-    }
-    else if (n == 1)
-    {
-        return mat_copy(mat);
+        fprintf(stderr, "VRepeat failed: Repeat number should be larger than 0.");
+        exit(1);
     }
 
-    Matrix *vrepeat = mat_copy(mat);
-    for (int i = 0; i < n; i++)
+    Matrix *vrepeat = mat_alloc(mat->row * n, mat->col);
+    for (int r = 0; r < n; r++)
     {
-        vrepeat = xmat_vstack(vrepeat, mat);
+        for (long long i = 0; i < mat->row; i++)
+        {
+            memcpy(mat_row(vrepeat, r * mat->row + i), mat_row(mat, i), mat->col * sizeof(double));
+        }
     }
 
+    TRACE_END("xmat_vrepeat", vrepeat->row, vrepeat->col, 0, (mat->row * mat->col + vrepeat->row * vrepeat->col) * sizeof(double), 0);
     return vrepeat;
 }
 
 double xmat_det(Matrix *mat)
 {
+    TRACE_BEGIN();
     if (mat->row != mat->col)
     {
         fprintf(stderr,
@@ -249,7 +307,7 @@ double xmat_det(Matrix *mat)
     {
         double anchor = mat_read(mat, 0, j);
 
-        Matrix *sub_matrix = (Matrix *)malloc(sizeof(Matrix));
+        Matrix *sub_matrix;
 
         // Sub-matrix
         if (j == 0)
@@ -265,16 +323,18 @@ double xmat_det(Matrix *mat)
             Matrix *submat_l = xmat_submat(mat, 1, mat->row, 0, j);
             Matrix *submat_r = xmat_submat(mat, 1, mat->row, j + 1, mat->col);
             sub_matrix = xmat_hstack(submat_l, submat_r);
-            free(submat_l);
-            free(submat_r);
+            mat_free(submat_l);
+            mat_free(submat_r);
         }
 
         // Accumulate
         double increment = anchor * sign * xmat_det(sub_matrix);
+        mat_free(sub_matrix);
         sign *= -1;
         det_val += increment;
     }
 
+    TRACE_END("xmat_det", mat->row, mat->col, 0, mat->row * mat->col * sizeof(double), 0);
     return det_val;
 }
 
@@ -312,6 +372,7 @@ Matrix *xmat_readcol(Matrix *mat, long long j)
 
 Matrix *xmat_solve(Matrix *A, Matrix *b)
 {
+    TRACE_BEGIN();
     if (A->col != b->row)
     {
         fprintf(stderr,
@@ -415,174 +476,1451 @@ Matrix *xmat_solve(Matrix *A, Matrix *b)
     // Matrix* x = xmat_readcol(hybrid_mat, -1);
 
     Matrix *x = xmat_submat(hybrid_mat, 0, hybrid_mat->row, hybrid_mat->col - b->col, hybrid_mat->col);
+    mat_free(hybrid_mat);
 
+    TRACE_END("xmat_solve", A->row, A->col, b->col, (A->row * A->col + 2 * A->row * b->col) * sizeof(double), 2.0 * A->row * A->row * (A->col + b->col));
     return x;
 }
 
-Matrix *xmat_inv(Matrix *mat)
+/**
+ * @brief Read the n elements of a column matrix into a contiguous array.
+ */
+static void _read_column(Matrix *vec, double *out, long long n)
 {
-    if (mat->row != mat->col)
+    for (long long i = 0; i < n; i++)
     {
-        fprintf(stderr, "Inverse matrix failed: Matrix is not square.");
-        exit(1);
+        out[i] = vec->data[i * vec->stride];
     }
-
-    Matrix *identity = xmat_identity(mat->row);
-    return xmat_solve(mat, identity);
 }
 
-bool xmat_isEqual(Matrix *mat_1, Matrix *mat_2)
+static double _dot(const double *x, const double *y, long long n)
 {
-    if (mat_1->row != mat_2->row ||
-        mat_1->col != mat_2->col)
+    double sum = 0;
+    for (long long i = 0; i < n; i++)
     {
-        return false;
+        sum += x[i] * y[i];
     }
-
-    return memcmp(mat_1->data, mat_2->data, mat_1->row * mat_1->col * sizeof(double)) == 0;
+    return sum;
 }
 
-bool xmat_isRow(Matrix *matrix)
+static void _check_column(const char *name, Matrix *vec, long long n)
 {
-    return matrix->row == 1;
+    if (vec != NULL && (vec->row != n || vec->col != 1))
+    {
+        fprintf(stderr,
+                "Conjugate gradient failed: %s should have size %lld x 1, got %lld x %lld.\n",
+                name, n, vec->row, vec->col);
+        exit(1);
+    }
 }
 
-bool xmat_isCol(Matrix *matrix)
+Matrix *xmat_cgOperator(MatrixLinearOperator op, void *ctx, Matrix *diag, Matrix *b, Matrix *x0,
+                        double tol, long long max_iter, SolverStats *stats)
 {
-    return matrix->col == 1;
+    TRACE_BEGIN();
+    long long n = b->row;
+    _check_column("b", b, n);
+    _check_column("Initial guess", x0, n);
+    _check_column("Diagonal", diag, n);
+
+    // Work vectors, one per row: residual r, preconditioned residual z, direction p and A p.
+    Matrix *work = mat_allocPadded(4, n);
+    double *r = mat_row(work, 0);
+    double *z = mat_row(work, 1);
+    double *p = mat_row(work, 2);
+    double *Ap = mat_row(work, 3);
+    Matrix *p_vec = mat_createStrided(n, 1, 1, p);
+    Matrix *Ap_vec = mat_createStrided(n, 1, 1, Ap);
+    Matrix *x_mat = mat_alloc(n, 1);
+    double *x = x_mat->data;
+
+    // Jacobi preconditioner M^-1 = diag(A)^-1.
+    Matrix *inv_diag = mat_alloc(n, 1);
+    for (long long i = 0; i < n; i++)
+    {
+        double d = diag != NULL ? diag->data[i * diag->stride] : 1;
+        if (!(d > 0))
+        {
+            fprintf(stderr, "Conjugate gradient failed: Diagonal element %lld is %lf, "
+                            "the matrix is not positive definite.\n",
+                    i, d);
+            exit(1);
+        }
+        inv_diag->data[i] = 1 / d;
+    }
+
+    // r = b - A x0
+    _read_column(b, r, n);
+    double b_norm = sqrt(_dot(r, r, n));
+    if (x0 != NULL)
+    {
+        _read_column(x0, x, n);
+        memcpy(p, x, n * sizeof(double));
+        op(p_vec, Ap_vec, ctx);
+        for (long long i = 0; i < n; i++)
+        {
+            r[i] -= Ap[i];
+        }
+    }
+    else
+    {
+        memset(x, 0, n * sizeof(double));
+    }
+
+    double scale = b_norm > 0 ? 1 / b_norm : 1;
+    double residual = sqrt(_dot(r, r, n)) * scale;
+    long long iter = 0;
+
+    // z = M^-1 r, p = z
+    for (long long i = 0; i < n; i++)
+    {
+        z[i] = inv_diag->data[i] * r[i];
+        p[i] = z[i];
+    }
+    double rz = _dot(r, z, n);
+
+    while (residual > tol && iter < max_iter)
+    {
+        op(p_vec, Ap_vec, ctx);
+        iter++;
+
+        double pAp = _dot(p, Ap, n);
+        if (!(pAp > 0))
+        {
+            break; // A is not positive definite along p, no further progress is possible.
+        }
+
+        double alpha = rz / pAp;
+        double rr = 0;
+        for (long long i = 0; i < n; i++)
+        {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * Ap[i];
+            rr += r[i] * r[i];
+        }
+        residual = sqrt(rr) * scale;
+        if (residual <= tol)
+        {
+            break;
+        }
+
+        double rz_next = 0;
+        for (long long i = 0; i < n; i++)
+        {
+            z[i] = inv_diag->data[i] * r[i];
+            rz_next += r[i] * z[i];
+        }
+        double beta = rz_next / rz;
+        rz = rz_next;
+        for (long long i = 0; i < n; i++)
+        {
+            p[i] = z[i] + beta * p[i];
+        }
+    }
+
+    if (stats != NULL)
+    {
+        stats->iterations = iter;
+        stats->residual = residual;
+        stats->converged = residual <= tol;
+    }
+
+    mat_free(p_vec);
+    mat_free(Ap_vec);
+    mat_free(inv_diag);
+    mat_free(work);
+    TRACE_END("xmat_cg", n, 1, iter, 7 * iter * n * sizeof(double), 10.0 * iter * n);
+    return x_mat;
 }
 
-bool xmat_isSquare(Matrix *mat)
+static void _dense_operator(Matrix *x, Matrix *y, void *ctx)
 {
-    return mat->row == mat->col;
+    mat_multmatFused((Matrix *)ctx, x, NULL, MAT_EPI_NONE, y);
 }
 
-bool xmat_isSymm(Matrix *mat)
+Matrix *xmat_cg(Matrix *A, Matrix *b, Matrix *x0, double tol, long long max_iter, SolverStats *stats)
 {
-    if (!xmat_isSquare(mat))
-        return false;
-    return xmat_isEqual(mat, mat_transpose(mat));
+    if (A->row != A->col || A->col != b->row)
+    {
+        fprintf(stderr,
+                "Conjugate gradient failed: Unable to solve incompatible matrices. \n"
+                "A: %lld x %lld, b: %lld x %lld\n",
+                A->row, A->col, b->row, b->col);
+        exit(1);
+    }
+
+    Matrix *diag = mat_alloc(A->row, 1);
+    for (long long i = 0; i < A->row; i++)
+    {
+        diag->data[i] = mat_row(A, i)[i];
+    }
+    Matrix *x = xmat_cgOperator(_dense_operator, A, diag, b, x0, tol, max_iter, stats);
+    mat_free(diag);
+    return x;
 }
 
-bool xmat_isOrth(Matrix *mat)
+// Columns per block of the blocked QR, columns factored without recursion (one cache line),
+// rows per chunk of its GEMM updates, and the narrowest update worth a GEMM (narrower ones
+// stream over the rows).
+#define QR_BLOCK 16
+#define QR_LEAF 8
+#define QR_CHUNK 256
+#define QR_GEMM_MIN_COLS 8
+#define QR_PARALLEL_COLS 64 // Fewest columns of a block reflector update handed to another thread.
+
+/**
+ * @brief Element (i, p) of the unit lower trapezoidal Householder vectors V stored below the
+ * diagonal of v.
+ */
+static inline double _v_at(const double *v, long long ldv, long long i, long long p)
 {
-    Matrix *mat_T = mat_transpose(mat);
-    Matrix *eye = xmat_diag(mat->row, mat->col, 1);
+    return i == p ? 1 : i > p ? v[i * ldv + p] : 0;
+}
 
-    return xmat_isEqual(mat_multmat(mat, mat_T), eye);
+/**
+ * @brief Row i of the Householder vectors V stored below the diagonal of v, written to out
+ * unless i >= k, where it is read in place.
+ */
+static inline const double *_v_row(const double *v, long long ldv, long long k, long long i, double *out)
+{
+    if (i >= k)
+    {
+        return v + i * ldv;
+    }
+    for (long long p = 0; p < k; p++)
+    {
+        out[p] = _v_at(v, ldv, i, p);
+    }
+    return out;
 }
 
-bool xmat_isZero(Matrix *mat)
+/**
+ * @brief w = V^T B for the m x k vectors V and an m x n matrix B, in one pass over the rows.
+ */
+static void _vt_times(const double *v, long long ldv, long long m, long long k,
+                      const double *b, long long ldb, long long n, double *w)
 {
-    for (long long i = 0; i < mat->row * mat->col; i++)
+    double head[QR_BLOCK];
+    memset(w, 0, k * n * sizeof(double));
+    for (long long i = 0; i < m; i++)
     {
-        if (mat->data[i] != 0)
+        const double *v_i = _v_row(v, ldv, k, i, head);
+        const double *b_i = b + i * ldb;
+        for (long long p = 0; p < k; p++)
         {
-            return false;
+            double coef = v_i[p];
+            double *w_p = w + p * n;
+            for (long long j = 0; j < n; j++)
+            {
+                w_p[j] += coef * b_i[j];
+            }
         }
     }
-    return true;
 }
 
-double xmat_mean(Matrix *mat)
+/**
+ * @brief B -= V w for the m x k vectors V and a k x n matrix w, in one pass over the rows.
+ */
+static void _sub_v_times(const double *v, long long ldv, long long m, long long k,
+                         const double *w, long long n, double *b, long long ldb)
 {
-    return mat_elemSum(mat) / (mat->row * mat->col);
+    double head[QR_BLOCK];
+    for (long long i = 0; i < m; i++)
+    {
+        const double *v_i = _v_row(v, ldv, k, i, head);
+        double *b_i = b + i * ldb;
+        for (long long p = 0; p < k; p++)
+        {
+            double coef = v_i[p];
+            const double *w_p = w + p * n;
+            for (long long j = 0; j < n; j++)
+            {
+                b_i[j] -= coef * w_p[j];
+            }
+        }
+    }
 }
 
-double xmat_std(Matrix *mat)
+/**
+ * @brief w = T w, or T^T w when transpose, in place, for an upper triangular k x k T.
+ */
+static void _trmm(const double *t, long long k, double *w, long long ldw, long long n, bool transpose)
 {
-    long long mean = xmat_mean(mat);
-    long long _std = 0;
-    for (long long i = 0; i < mat->row * mat->col; i++)
+    for (long long s = 0; s < k; s++)
     {
-        _std += pow(mat->data[i] - mean, 2);
+        // Rows are overwritten in the order that leaves the ones still to be read untouched.
+        long long p = transpose ? k - 1 - s : s;
+        double *w_p = w + p * ldw;
+        for (long long j = 0; j < n; j++)
+        {
+            w_p[j] *= t[p * k + p];
+        }
+        long long q_begin = transpose ? 0 : p + 1;
+        long long q_end = transpose ? p : k;
+        for (long long q = q_begin; q < q_end; q++)
+        {
+            double coef = transpose ? t[q * k + p] : t[p * k + q];
+            const double *w_q = w + q * ldw;
+            for (long long j = 0; j < n; j++)
+            {
+                w_p[j] += coef * w_q[j];
+            }
+        }
     }
-    return _std / (mat->row * mat->col);
 }
 
-double xmat_dist(Matrix *mat1, Matrix *mat2, int l)
+/**
+ * @brief Triangular factor T of H_0 H_1 ... H_{k-1} = I - V T V^T (compact WY form).
+ */
+static void _larft(const double *v, long long ldv, long long m, long long k, const double *tau, double *t)
 {
-    if (mat1->row != mat2->row || mat1->col != mat2->col)
-    {
-        fprintf(stderr, "Calculate distance failed. Matrices are not equal size.");
-        exit(1);
-    }
-    switch (l)
+    // t first holds the strictly upper part of V^T V.
+    memset(t, 0, k * k * sizeof(double));
+    double head[QR_BLOCK];
+    if (k < QR_GEMM_MIN_COLS)
     {
-    case 0:
-        // l0-distance: Num. of non-equal elements.
-        long long l0 = 0;
-        for (long long i = 0; i < mat1->row * mat1->col; i++)
+        for (long long i = 0; i < m; i++)
         {
-            if (mat1->data[i] != mat2->data[i])
+            const double *v_i = _v_row(v, ldv, k, i, head);
+            for (long long p = 0; p < k; p++)
             {
-                l0++;
+                for (long long q = p + 1; q < k; q++)
+                {
+                    t[p * k + q] += v_i[p] * v_i[q];
+                }
             }
         }
-        return l0;
-    case 1:
-        // l1-distance: Sum of absolute differences.
-        long long l1 = 0;
-        for (long long i = 0; i < mat1->row * mat1->col; i++)
+    }
+    else
+    {
+        // Accumulated by GEMMs over chunks of rows.
+        Matrix *gram = xmat_zeros(k, k);
+        Matrix *vt = mat_alloc(k, QR_CHUNK);
+        Matrix *vc = mat_alloc(QR_CHUNK, k);
+        for (long long r0 = 0; r0 < m; r0 += QR_CHUNK)
         {
-            l1 += abs(mat1->data[i] - mat2->data[i]);
+            long long rc = m - r0 < QR_CHUNK ? m - r0 : QR_CHUNK;
+            for (long long i = 0; i < rc; i++)
+            {
+                const double *v_i = _v_row(v, ldv, k, r0 + i, head);
+                memcpy(mat_row(vc, i), v_i, k * sizeof(double));
+                for (long long p = 0; p < k; p++)
+                {
+                    mat_row(vt, p)[i] = v_i[p];
+                }
+            }
+            Matrix *vt_view = mat_createStrided(k, rc, vt->stride, vt->data);
+            Matrix *vc_view = mat_createStrided(rc, k, vc->stride, vc->data);
+            mat_multmatAdd(vt_view, vc_view, gram);
+            mat_free(vt_view);
+            mat_free(vc_view);
         }
-    case 2:
-        // l2-distance: Sum of rooted-squared differences.
-        long long _l2 = 0;
-        for (long long i = 0; i < mat1->row * mat1->col; i++)
+        for (long long p = 0; p < k; p++)
         {
-            _l2 += pow(mat1->data[i] - mat2->data[i], 2);
+            memcpy(t + p * k + p + 1, mat_row(gram, p) + p + 1, (k - p - 1) * sizeof(double));
         }
-        return sqrt(_l2);
-    case -1:
-        // Chebyshev's distance: Maximum of absolute differences.
-        long long linf = 0;
-        for (long long i = 0; i < mat1->row * mat1->col; i++)
+        mat_free(gram);
+        mat_free(vt);
+        mat_free(vc);
+    }
+
+    // T[0:i, i] = -tau_i T[0:i, 0:i] (V^T v_i), in place over column i. Row r reads only
+    // column i entries at or below r, so ascending rows never read an overwritten one.
+    for (long long i = 0; i < k; i++)
+    {
+        for (long long r = 0; r < i; r++)
         {
-            linf = max(linf, abs(mat1->data[i] - mat2->data[i]));
+            double sum = 0;
+            for (long long c = r; c < i; c++)
+            {
+                sum += t[r * k + c] * t[c * k + i];
+            }
+            t[r * k + i] = -tau[i] * sum;
         }
-    default:
-        fprintf(stderr, "Input error: Invalid distance. l should only be 0, 1, 2, or -1.");
-        exit(1);
+        t[i * k + i] = tau[i];
     }
 }
 
-double xmat_norm(Matrix *mat, long long l)
+typedef struct
 {
-    Matrix *zero = xmat_zeros(mat->row, mat->col);
-    return xmat_dist(mat, zero, l);
-}
+    const double *v;
+    long long ldv;
+    long long m;
+    long long k;
+    const double *t;
+    bool transpose;
+    double *c;
+    long long ldc;
+} QRApplyArgs;
 
-double xmat_cossim(Matrix *mat1, Matrix *mat2)
+/**
+ * @brief GEMM based block reflector update of the columns [begin, end) of C, see _apply_block.
+ */
+static void _apply_block_cols(void *ctx, long long begin, long long end)
 {
-    if (mat1->row != mat2->row || mat1->col != mat2->col)
+    QRApplyArgs *args = ctx;
+    const double *v = args->v;
+    long long m = args->m;
+    long long k = args->k;
+    long long n = end - begin;
+    double *c = args->c + begin;
+    long long ldc = args->ldc;
+
+    Matrix *w = xmat_zeros(k, n);
+    Matrix *vt = mat_alloc(k, QR_CHUNK);
+    Matrix *vc = mat_alloc(QR_CHUNK, k);
+    double head[QR_BLOCK];
+
+    // W = V^T C
+    for (long long r0 = 0; r0 < m; r0 += QR_CHUNK)
     {
-        fprintf(stderr, "Calculate cosine-similarity failed. Matrices are not equal size.");
-        exit(1);
-    }
-    
-    double mul = 1;
-    for (long long i = 0; i < mat1->row * mat1->col; i++){
-         mul *= mat1->data[i] * mat2->data[i];
+        long long rc = m - r0 < QR_CHUNK ? m - r0 : QR_CHUNK;
+        for (long long i = 0; i < rc; i++)
+        {
+            const double *v_i = _v_row(v, args->ldv, k, r0 + i, head);
+            for (long long p = 0; p < k; p++)
+            {
+                mat_row(vt, p)[i] = v_i[p];
+            }
+        }
+        Matrix *vt_view = mat_createStrided(k, rc, vt->stride, vt->data);
+        Matrix *c_view = mat_createStrided(rc, n, ldc, c + r0 * ldc);
+        mat_multmatAdd(vt_view, c_view, w);
+        mat_free(vt_view);
+        mat_free(c_view);
     }
 
-    double mat1_l1 = xmat_norm(mat1, 1);
-    double mat2_l1 = xmat_norm(mat2, 1);
+    // W = -T W, then C += V W
+    _trmm(args->t, k, w->data, w->stride, n, args->transpose);
+    for (long long p = 0; p < k; p++)
+    {
+        double *w_p = mat_row(w, p);
+        for (long long j = 0; j < n; j++)
+        {
+            w_p[j] = -w_p[j];
+        }
+    }
+    for (long long r0 = 0; r0 < m; r0 += QR_CHUNK)
+    {
+        long long rc = m - r0 < QR_CHUNK ? m - r0 : QR_CHUNK;
+        for (long long i = 0; i < rc; i++)
+        {
+            memcpy(mat_row(vc, i), _v_row(v, args->ldv, k, r0 + i, head), k * sizeof(double));
+        }
+        Matrix *vc_view = mat_createStrided(rc, k, vc->stride, vc->data);
+        Matrix *c_view = mat_createStrided(rc, n, ldc, c + r0 * ldc);
+        mat_multmatAdd(vc_view, w, c_view);
+        mat_free(vc_view);
+        mat_free(c_view);
+    }
 
-    long long i = 1;
-    double eps = *(double *)&i;     // long long i=1 -> 00 00 ... 00 01
-    return mul / (mat1_l1 * mat2_l1 + eps);
+    mat_free(w);
+    mat_free(vt);
+    mat_free(vc);
 }
 
-// long long xmat_svd(Matrix *A)
-// {
-//     Matrix *AT = mat_transpose(A);
+/**
+ * @brief C = (I - V T V^T) C, or (I - V T^T V^T) C when transpose, for the m x k Householder
+ * vectors V and an m x n matrix C.
+ *
+ * Wide C is updated with two accumulating GEMMs over chunks of rows, so that the explicit
+ * copies of V stay small, and slabs of its columns are spread over the thread pool.
+ */
+static void _apply_block(const double *v, long long ldv, long long m, long long k, const double *t,
+                         bool transpose, double *c, long long ldc, long long n)
+{
+    if (n < QR_GEMM_MIN_COLS)
+    {
+        double *w = malloc(k * n * sizeof(double));
+        _vt_times(v, ldv, m, k, c, ldc, n, w);
+        _trmm(t, k, w, n, n, transpose);
+        _sub_v_times(v, ldv, m, k, w, n, c, ldc);
+        free(w);
+        return;
+    }
 
-//     // V * ST * S * VT
-//     Matrix *AT_A = mat_multmat(AT, A);
+    QRApplyArgs args = {v, ldv, m, k, t, transpose, c, ldc};
+    par_for(n, QR_PARALLEL_COLS, _apply_block_cols, &args);
+}
 
-//     // U * S * ST * U
-//     Matrix *A_AT = mat_multmat(A, AT);
+/**
+ * @brief Unblocked QR of an m x n panel, n <= QR_LEAF, two passes over the rows per column.
+ *
+ * Column j is reflected to (beta, 0, ..., 0) by H = I - tau v v^T, with v_0 = 1 and the rest
+ * of v stored in place of the zeroed elements. The first pass scales v and takes its dot
+ * products with the columns to the right, the second updates them and takes the norm of the
+ * next column.
+ */
+static void _qr_leaf(double *a, long long lda, long long m, long long n, double *tau)
+{
+    double sigma = 0;
+    for (long long i = 1; i < m; i++)
+    {
+        sigma += a[i * lda] * a[i * lda];
+    }
 
-// }
+    for (long long j = 0; j < n; j++)
+    {
+        double *a_j = a + j * lda + j; // Diagonal element, rows below are lda apart.
+        long long rows = m - j;
+        long long cols = n - j - 1;
+        double w[QR_LEAF];
+
+        double alpha = a_j[0];
+        double beta = -copysign(sqrt(alpha * alpha + sigma), alpha);
+        tau[j] = sigma == 0 ? 0 : (beta - alpha) / beta;
+        double scale = sigma == 0 ? 1 : 1 / (alpha - beta);
+        if (sigma != 0)
+        {
+            a_j[0] = beta;
+        }
+
+        // w = v^T A[:, j + 1:n], scaling v on the way.
+        for (long long c = 0; c < cols; c++)
+        {
+            w[c] = a_j[1 + c];
+        }
+        for (long long i = 1; i < rows; i++)
+        {
+            double *row = a_j + i * lda;
+            double v_i = row[0] * scale;
+            row[0] = v_i;
+            for (long long c = 0; c < cols; c++)
+            {
+                w[c] += v_i * row[1 + c];
+            }
+        }
+
+        // A[:, j + 1:n] -= tau v w^T, and the norm below the next diagonal element.
+        sigma = 0;
+        for (long long c = 0; c < cols; c++)
+        {
+            w[c] *= tau[j];
+            a_j[1 + c] -= w[c];
+        }
+        for (long long i = 1; i < rows; i++)
+        {
+            double *row = a_j + i * lda;
+            double v_i = row[0];
+            for (long long c = 0; c < cols; c++)
+            {
+                row[1 + c] -= v_i * w[c];
+            }
+            if (i > 1 && cols > 0)
+            {
+                sigma += row[1] * row[1];
+            }
+        }
+    }
+}
+
+/**
+ * @brief QR of an m x n panel, m >= n, by recursive halving.
+ *
+ * The left half is factored and applied to the right half as one block reflector, so that
+ * only the leaves stream over the rows once per column.
+ */
+static void _qr_panel(double *a, long long lda, long long m, long long n, double *tau)
+{
+    if (n <= QR_LEAF)
+    {
+        _qr_leaf(a, lda, m, n, tau);
+        return;
+    }
+
+    long long n1 = n / 2;
+    _qr_panel(a, lda, m, n1, tau);
+
+    double *t = malloc(n1 * n1 * sizeof(double));
+    _larft(a, lda, m, n1, tau, t);
+    _apply_block(a, lda, m, n1, t, true, a + n1, lda, n - n1);
+    free(t);
+
+    _qr_panel(a + n1 * lda + n1, lda, m - n1, n - n1, tau + n1);
+}
+
+/**
+ * @brief Apply the reflectors of a compact QR to the m x n matrix c, Q^T c when transpose,
+ * otherwise Q c.
+ */
+static void _qr_apply(Matrix *qr, Matrix *tau, bool transpose, double *c, long long ldc, long long n)
+{
+    long long m = qr->row;
+    long long k = tau->col;
+    long long blocks = (k + QR_BLOCK - 1) / QR_BLOCK;
+    double *t = malloc(QR_BLOCK * QR_BLOCK * sizeof(double));
+
+    // Q = H_0 H_1 ... H_{k-1}: Q^T applies the blocks forwards, Q backwards.
+    for (long long s = 0; s < blocks; s++)
+    {
+        long long j0 = (transpose ? s : blocks - 1 - s) * QR_BLOCK;
+        long long jb = k - j0 < QR_BLOCK ? k - j0 : QR_BLOCK;
+        double *v = mat_row(qr, j0) + j0;
+        _larft(v, qr->stride, m - j0, jb, tau->data + j0, t);
+        _apply_block(v, qr->stride, m - j0, jb, t, transpose, c + j0 * ldc, ldc, n);
+    }
+    free(t);
+}
+
+Matrix *xmat_qr(Matrix *A, Matrix **tau)
+{
+    TRACE_BEGIN();
+    long long m = A->row;
+    long long n = A->col;
+    long long k = m < n ? m : n;
+
+    Matrix *qr = mat_alloc(m, n);
+    for (long long i = 0; i < m; i++)
+    {
+        memcpy(mat_row(qr, i), mat_row(A, i), n * sizeof(double));
+    }
+    Matrix *tau_mat = mat_alloc(1, k);
+    double *t = malloc(QR_BLOCK * QR_BLOCK * sizeof(double));
+
+    for (long long j0 = 0; j0 < k; j0 += QR_BLOCK)
+    {
+        long long jb = k - j0 < QR_BLOCK ? k - j0 : QR_BLOCK;
+        double *panel = mat_row(qr, j0) + j0;
+
+        // Factor a packed copy of the panel, whose rows are adjacent in memory.
+        Matrix *packed = mat_alloc(m - j0, jb);
+        for (long long i = 0; i < m - j0; i++)
+        {
+            memcpy(mat_row(packed, i), panel + i * qr->stride, jb * sizeof(double));
+        }
+        _qr_panel(packed->data, packed->stride, m - j0, jb, tau_mat->data + j0);
+        for (long long i = 0; i < m - j0; i++)
+        {
+            memcpy(panel + i * qr->stride, mat_row(packed, i), jb * sizeof(double));
+        }
+        mat_free(packed);
+
+        // Trailing update with the whole block at once.
+        if (j0 + jb < n)
+        {
+            _larft(panel, qr->stride, m - j0, jb, tau_mat->data + j0, t);
+            _apply_block(panel, qr->stride, m - j0, jb, t, true, panel + jb, qr->stride, n - j0 - jb);
+        }
+    }
+    free(t);
+
+    *tau = tau_mat;
+    TRACE_END("xmat_qr", m, n, 0, 2 * m * n * sizeof(double), 2.0 * m * n * k - 2.0 / 3.0 * k * k * k);
+    return qr;
+}
+
+Matrix *xmat_qrR(Matrix *qr)
+{
+    long long k = qr->row < qr->col ? qr->row : qr->col;
+    Matrix *R = mat_alloc(k, qr->col);
+    for (long long i = 0; i < k; i++)
+    {
+        double *r = mat_row(R, i);
+        memset(r, 0, i * sizeof(double));
+        memcpy(r + i, mat_row(qr, i) + i, (qr->col - i) * sizeof(double));
+    }
+    return R;
+}
+
+Matrix *xmat_qrQ(Matrix *qr, Matrix *tau)
+{
+    TRACE_BEGIN();
+    long long m = qr->row;
+    long long k = tau->col;
+    Matrix *Q = xmat_diag(m, k, 1);
+    _qr_apply(qr, tau, false, Q->data, Q->stride, k);
+    TRACE_END("xmat_qrQ", m, k, 0, 2 * m * k * sizeof(double), 4.0 * m * k * k);
+    return Q;
+}
+
+Matrix *xmat_lstsq(Matrix *A, Matrix *b)
+{
+    TRACE_BEGIN();
+    long long m = A->row;
+    long long n = A->col;
+    if (b->row != m)
+    {
+        fprintf(stderr,
+                "Least squares failed: Unable to solve incompatible matrices. \n"
+                "A: %lld x %lld, b: %lld x %lld\n",
+                A->row, A->col, b->row, b->col);
+        exit(1);
+    }
+    if (m < n)
+    {
+        fprintf(stderr, "Least squares failed: Underdetermined system with %lld equations and %lld unknowns.", m, n);
+        exit(1);
+    }
+
+    Matrix *tau;
+    Matrix *qr = xmat_qr(A, &tau);
+
+    // c = Q^T b
+    long long p = b->col;
+    Matrix *c = mat_alloc(m, p);
+    for (long long i = 0; i < m; i++)
+    {
+        memcpy(mat_row(c, i), mat_row(b, i), p * sizeof(double));
+    }
+    _qr_apply(qr, tau, true, c->data, c->stride, p);
+
+    // R is numerically singular if a diagonal element vanishes next to the largest one.
+    double r_max = 0;
+    for (long long i = 0; i < n; i++)
+    {
+        r_max = fmax(r_max, fabs(mat_row(qr, i)[i]));
+    }
+    for (long long i = 0; i < n; i++)
+    {
+        if (fabs(mat_row(qr, i)[i]) <= r_max * DBL_EPSILON * m)
+        {
+            fprintf(stderr, "Least squares failed: Matrix is rank deficient at column %lld.", i);
+            exit(1);
+        }
+    }
+
+    // Back substitution R x = c[0:n].
+    Matrix *x = mat_alloc(n, p);
+    for (long long i = n - 1; i >= 0; i--)
+    {
+        const double *r = mat_row(qr, i);
+        double *x_i = mat_row(x, i);
+        memcpy(x_i, mat_row(c, i), p * sizeof(double));
+        for (long long j = i + 1; j < n; j++)
+        {
+            const double *x_j = mat_row(x, j);
+            for (long long l = 0; l < p; l++)
+            {
+                x_i[l] -= r[j] * x_j[l];
+            }
+        }
+        for (long long l = 0; l < p; l++)
+        {
+            x_i[l] /= r[i];
+        }
+    }
+
+    mat_free(c);
+    mat_free(qr);
+    mat_free(tau);
+    TRACE_END("xmat_lstsq", m, n, p, (2 * m * n + m * p) * sizeof(double), 2.0 * m * n * n + 4.0 * m * n * p);
+    return x;
+}
+
+Matrix *xmat_inv(Matrix *mat)
+{
+    if (mat->row != mat->col)
+    {
+        fprintf(stderr, "Inverse matrix failed: Matrix is not square.");
+        exit(1);
+    }
+
+    TRACE_BEGIN();
+    Matrix *identity = xmat_identity(mat->row);
+    Matrix *inv = xmat_solve(mat, identity);
+    mat_free(identity);
+    TRACE_END("xmat_inv", mat->row, mat->col, 0, 3 * mat->row * mat->col * sizeof(double), 2.0 * mat->row * mat->row * mat->col);
+    return inv;
+}
+
+#define PRED_BLOCK 256          // Elements compared between two early exit checks of a row scan.
+#define PRED_TILE 32            // Tile side of the transposed scan of xmat_isSymm and of the Gram tiles.
+#define PRED_DEPTH 128          // Depth of a Gram tile update, so both operand tiles stay in L1.
+#define PRED_PARALLEL_MIN 256   // Order from which xmat_isOrth spreads Gram tiles over the thread pool.
+
+static inline bool _close(double x, double y, double atol, double rtol)
+{
+    // Fails on NaN, and on infinities unless they are equal.
+    return x == y || fabs(x - y) <= atol + rtol * fmax(fabs(x), fabs(y));
+}
+
+/**
+ * @brief Whether x[j] and y[j] are close for j in [0, n), checked a block at a time.
+ */
+static bool _row_close(const double *x, const double *y, long long n, double atol, double rtol)
+{
+    for (long long j0 = 0; j0 < n; j0 += PRED_BLOCK)
+    {
+        long long jn = n - j0 < PRED_BLOCK ? n - j0 : PRED_BLOCK;
+        bool far = false;
+        for (long long j = j0; j < j0 + jn; j++)
+        {
+            far |= !_close(x[j], y[j], atol, rtol);
+        }
+        if (far)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Whether |x[j]| <= tol for j in [0, n), checked a block at a time.
+ */
+static bool _row_small(const double *x, long long n, double tol)
+{
+    for (long long j0 = 0; j0 < n; j0 += PRED_BLOCK)
+    {
+        long long jn = n - j0 < PRED_BLOCK ? n - j0 : PRED_BLOCK;
+        bool large = false;
+        for (long long j = j0; j < j0 + jn; j++)
+        {
+            large |= !(fabs(x[j]) <= tol);
+        }
+        if (large)
+            return false;
+    }
+    return true;
+}
+
+bool xmat_isEqualTol(Matrix *mat_1, Matrix *mat_2, double atol, double rtol)
+{
+    if (mat_1->row != mat_2->row ||
+        mat_1->col != mat_2->col)
+    {
+        return false;
+    }
+
+    TRACE_BEGIN();
+    long long i = 0;
+    while (i < mat_1->row && _row_close(mat_row(mat_1, i), mat_row(mat_2, i), mat_1->col, atol, rtol))
+    {
+        i++;
+    }
+    TRACE_END("xmat_isEqual", mat_1->row, mat_1->col, 0, 2 * i * mat_1->col * sizeof(double), 0);
+    return i == mat_1->row;
+}
+
+bool xmat_isEqual(Matrix *mat_1, Matrix *mat_2)
+{
+    return xmat_isEqualTol(mat_1, mat_2, 0, 0);
+}
+
+bool xmat_isRow(Matrix *matrix)
+{
+    return matrix->row == 1;
+}
+
+bool xmat_isCol(Matrix *matrix)
+{
+    return matrix->col == 1;
+}
+
+bool xmat_isSquare(Matrix *mat)
+{
+    return mat->row == mat->col;
+}
+
+bool xmat_isSymmTol(Matrix *mat, double atol, double rtol)
+{
+    if (!xmat_isSquare(mat))
+        return false;
+    TRACE_BEGIN();
+    long long n = mat->row;
+    bool symm = true;
+
+    // Compare the tiles above the diagonal with their mirrors below it, a pair at a time.
+    for (long long i0 = 0; i0 < n && symm; i0 += PRED_TILE)
+    {
+        long long i1 = i0 + PRED_TILE < n ? i0 + PRED_TILE : n;
+        for (long long j0 = i0; j0 < n && symm; j0 += PRED_TILE)
+        {
+            long long j1 = j0 + PRED_TILE < n ? j0 + PRED_TILE : n;
+            for (long long i = i0; i < i1 && symm; i++)
+            {
+                const double *a = mat_row(mat, i);
+                for (long long j = j0 > i + 1 ? j0 : i + 1; j < j1; j++)
+                {
+                    symm &= _close(a[j], mat_row(mat, j)[i], atol, rtol);
+                }
+            }
+        }
+    }
+    TRACE_END("xmat_isSymm", n, n, 0, n * n * sizeof(double), 0);
+    return symm;
+}
+
+bool xmat_isSymm(Matrix *mat)
+{
+    return xmat_isSymmTol(mat, 0, 0);
+}
+
+typedef struct
+{
+    Matrix *mat;
+    long long tiles;
+    double tol;
+    atomic_bool failed;
+} OrthArgs;
+
+/**
+ * @brief Whether the Gram tile A[i0:i1] A[j0:j1]^T is within tol of the identity.
+ */
+static bool _gram_tile(const MatKernels *kern, Matrix *mat, long long i0, long long i1, long long j0, long long j1,
+                       double tol)
+{
+    double g[PRED_TILE * PRED_TILE] = {0};
+    double bt[PRED_DEPTH * PRED_TILE];
+    long long mi = i1 - i0, nj = j1 - j0, n = mat->col;
+    for (long long k0 = 0; k0 < n; k0 += PRED_DEPTH)
+    {
+        long long kb = n - k0 < PRED_DEPTH ? n - k0 : PRED_DEPTH;
+        kern->transpose(bt, PRED_TILE, mat_row(mat, j0) + k0, mat->stride, nj, kb);
+        for (long long r = 0; r < mi; r += KERN_GEMM_MR)
+        {
+            long long mr = mi - r < KERN_GEMM_MR ? mi - r : KERN_GEMM_MR;
+            kern->gemm(g + r * PRED_TILE, PRED_TILE, mat_row(mat, i0 + r) + k0, mat->stride, bt, PRED_TILE, mr, kb, nj);
+        }
+    }
+
+    bool orth = true;
+    for (long long i = 0; i < mi; i++)
+    {
+        for (long long j = 0; j < nj; j++)
+        {
+            orth &= fabs(g[i * PRED_TILE + j] - (i0 + i == j0 + j)) <= tol;
+        }
+    }
+    return orth;
+}
+
+static void _gram_rows(void *ctx, long long begin, long long end)
+{
+    OrthArgs *args = ctx;
+    const MatKernels *kern = kern_get();
+    long long n = args->mat->row;
+    for (long long t = begin; t < end; t++)
+    {
+        long long i0 = t * PRED_TILE, i1 = i0 + PRED_TILE < n ? i0 + PRED_TILE : n;
+        for (long long j0 = i0; j0 < n; j0 += PRED_TILE)
+        {
+            if (atomic_load_explicit(&args->failed, memory_order_relaxed))
+                return;
+            long long j1 = j0 + PRED_TILE < n ? j0 + PRED_TILE : n;
+            if (!_gram_tile(kern, args->mat, i0, i1, j0, j1, args->tol))
+            {
+                atomic_store_explicit(&args->failed, true, memory_order_relaxed);
+                return;
+            }
+        }
+    }
+}
+
+bool xmat_isOrthTol(Matrix *mat, double tol)
+{
+    if (!xmat_isSquare(mat))
+        return false;
+    TRACE_BEGIN();
+    long long n = mat->row;
+
+    // Row norms first, they catch most non-orthogonal matrices in O(n^2).
+    bool orth = true;
+    for (long long i = 0; i < n && orth; i++)
+    {
+        const double *a = mat_row(mat, i);
+        double norm = 0;
+        for (long long k = 0; k < n; k++)
+        {
+            norm += a[k] * a[k];
+        }
+        orth = fabs(norm - 1.0) <= tol;
+    }
+
+    // Then the upper triangle of A A^T, tile by tile, until a tile is off the identity.
+    if (orth)
+    {
+        OrthArgs args = {mat, (n + PRED_TILE - 1) / PRED_TILE, tol, false};
+        if (n >= PRED_PARALLEL_MIN)
+        {
+            par_for(args.tiles, 1, _gram_rows, &args);
+        }
+        else
+        {
+            _gram_rows(&args, 0, args.tiles);
+        }
+        orth = !atomic_load(&args.failed);
+    }
+    TRACE_END("xmat_isOrth", n, n, 0, n * n * sizeof(double), 1.0 * n * n * n);
+    return orth;
+}
+
+bool xmat_isOrth(Matrix *mat)
+{
+    return xmat_isOrthTol(mat, 0);
+}
+
+bool xmat_isZeroTol(Matrix *mat, double tol)
+{
+    TRACE_BEGIN();
+    long long i = 0;
+    while (i < mat->row && _row_small(mat_row(mat, i), mat->col, tol))
+    {
+        i++;
+    }
+    TRACE_END("xmat_isZero", mat->row, mat->col, 0, i * mat->col * sizeof(double), 0);
+    return i == mat->row;
+}
+
+bool xmat_isZero(Matrix *mat)
+{
+    return xmat_isZeroTol(mat, 0);
+}
+
+bool xmat_isTriangularTol(Matrix *mat, bool upper, double tol)
+{
+    TRACE_BEGIN();
+    long long i = 0;
+    for (; i < mat->row; i++)
+    {
+        const double *a = mat_row(mat, i);
+        long long diag = i < mat->col ? i : mat->col;
+        bool zero = upper ? _row_small(a, diag, tol)
+                          : i + 1 >= mat->col || _row_small(a + i + 1, mat->col - i - 1, tol);
+        if (!zero)
+            break;
+    }
+    TRACE_END("xmat_isTriangular", mat->row, mat->col, 0, i * mat->col * sizeof(double), 0);
+    return i == mat->row;
+}
+
+bool xmat_isTriangular(Matrix *mat, bool upper)
+{
+    return xmat_isTriangularTol(mat, upper, 0);
+}
+
+bool xmat_isDiagonalTol(Matrix *mat, double tol)
+{
+    TRACE_BEGIN();
+    long long i = 0;
+    for (; i < mat->row; i++)
+    {
+        const double *a = mat_row(mat, i);
+        long long diag = i < mat->col ? i : mat->col;
+        if (!_row_small(a, diag, tol) ||
+            (i + 1 < mat->col && !_row_small(a + i + 1, mat->col - i - 1, tol)))
+            break;
+    }
+    TRACE_END("xmat_isDiagonal", mat->row, mat->col, 0, i * mat->col * sizeof(double), 0);
+    return i == mat->row;
+}
+
+bool xmat_isDiagonal(Matrix *mat)
+{
+    return xmat_isDiagonalTol(mat, 0);
+}
+
+double xmat_mean(Matrix *mat)
+{
+    TRACE_BEGIN();
+    double mean = mat_elemSum(mat) / (mat->row * mat->col);
+    TRACE_END("xmat_mean", mat->row, mat->col, 0, mat->row * mat->col * sizeof(double), mat->row * mat->col);
+    return mean;
+}
+
+double xmat_std(Matrix *mat)
+{
+    TRACE_BEGIN();
+    long long mean = xmat_mean(mat);
+    long long _std = 0;
+    for (long long i = 0; i < mat->row; i++)
+    {
+        const double *x = mat_row(mat, i);
+        for (long long j = 0; j < mat->col; j++)
+        {
+            _std += pow(x[j] - mean, 2);
+        }
+    }
+    TRACE_END("xmat_std", mat->row, mat->col, 0, 2 * mat->row * mat->col * sizeof(double), 4 * mat->row * mat->col);
+    return _std / (mat->row * mat->col);
+}
+
+double xmat_dist(Matrix *mat1, Matrix *mat2, int l)
+{
+    if (mat1->row != mat2->row || mat1->col != mat2->col)
+    {
+        fprintf(stderr, "Calculate distance failed. Matrices are not equal size.");
+        exit(1);
+    }
+    switch (l)
+    {
+    case 0:
+        // l0-distance: Num. of non-equal elements.
+        long long l0 = 0;
+        for (long long i = 0; i < mat1->row; i++)
+        {
+            const double *x1 = mat_row(mat1, i);
+            const double *x2 = mat_row(mat2, i);
+            for (long long j = 0; j < mat1->col; j++)
+            {
+                if (x1[j] != x2[j])
+                {
+                    l0++;
+                }
+            }
+        }
+        return l0;
+    case 1:
+        // l1-distance: Sum of absolute differences.
+        double l1 = 0;
+        for (long long i = 0; i < mat1->row; i++)
+        {
+            const double *x1 = mat_row(mat1, i);
+            const double *x2 = mat_row(mat2, i);
+            for (long long j = 0; j < mat1->col; j++)
+            {
+                l1 += fabs(x1[j] - x2[j]);
+            }
+        }
+        return l1;
+    case 2:
+        // l2-distance: Sum of rooted-squared differences.
+        double _l2 = 0;
+        for (long long i = 0; i < mat1->row; i++)
+        {
+            const double *x1 = mat_row(mat1, i);
+            const double *x2 = mat_row(mat2, i);
+            for (long long j = 0; j < mat1->col; j++)
+            {
+                _l2 += pow(x1[j] - x2[j], 2);
+            }
+        }
+        return sqrt(_l2);
+    case -1:
+        // Chebyshev's distance: Maximum of absolute differences.
+        double linf = 0;
+        for (long long i = 0; i < mat1->row; i++)
+        {
+            const double *x1 = mat_row(mat1, i);
+            const double *x2 = mat_row(mat2, i);
+            for (long long j = 0; j < mat1->col; j++)
+            {
+                linf = fmax(linf, fabs(x1[j] - x2[j]));
+            }
+        }
+        return linf;
+    default:
+        fprintf(stderr, "Input error: Invalid distance. l should only be 0, 1, 2, or -1.");
+        exit(1);
+    }
+}
+
+double xmat_norm(Matrix *mat, long long l)
+{
+    TRACE_BEGIN();
+    Matrix *zero = xmat_zeros(mat->row, mat->col);
+    double norm = xmat_dist(mat, zero, l);
+    mat_free(zero);
+    TRACE_END("xmat_norm", mat->row, mat->col, 0, 2 * mat->row * mat->col * sizeof(double), 2 * mat->row * mat->col);
+    return norm;
+}
+
+double xmat_cossim(Matrix *mat1, Matrix *mat2)
+{
+    TRACE_BEGIN();
+    if (mat1->row != mat2->row || mat1->col != mat2->col)
+    {
+        fprintf(stderr, "Calculate cosine-similarity failed. Matrices are not equal size.");
+        exit(1);
+    }
+    
+    double mul = 1;
+    for (long long i = 0; i < mat1->row; i++){
+        const double *x1 = mat_row(mat1, i);
+        const double *x2 = mat_row(mat2, i);
+        for (long long j = 0; j < mat1->col; j++){
+            mul *= x1[j] * x2[j];
+        }
+    }
+
+    double mat1_l1 = xmat_norm(mat1, 1);
+    double mat2_l1 = xmat_norm(mat2, 1);
+
+    long long i = 1;
+    double eps = *(double *)&i;     // long long i=1 -> 00 00 ... 00 01
+    TRACE_END("xmat_cossim", mat1->row, mat1->col, 0, 2 * mat1->row * mat1->col * sizeof(double), 6 * mat1->row * mat1->col);
+    return mul / (mat1_l1 * mat2_l1 + eps);
+}
+
+// Extra sketch columns beyond the requested rank, and the sweep limit of the small Jacobi SVD.
+#define SVD_OVERSAMPLE 10
+#define SVD_MAX_SWEEPS 60
+
+/**
+ * @brief Thin orthonormal basis of the columns of Y, freeing Y.
+ */
+static Matrix *_orthonormalize(Matrix *Y)
+{
+    Matrix *tau;
+    Matrix *qr = xmat_qr(Y, &tau);
+    Matrix *Q = xmat_qrQ(qr, tau);
+    mat_free(qr);
+    mat_free(tau);
+    mat_free(Y);
+    return Q;
+}
+
+/**
+ * @brief A Q for the implicitly centered A - 1 mean^T (mean may be NULL).
+ */
+static Matrix *_times_right(Matrix *A, Matrix *mean, Matrix *Q)
+{
+    Matrix *Y = mat_multmat(A, Q);
+    if (mean != NULL)
+    {
+        Matrix *shift = mat_multmat(mean, Q); // 1 x l
+        for (long long i = 0; i < Y->row; i++)
+        {
+            double *y = mat_row(Y, i);
+            for (long long j = 0; j < Y->col; j++)
+            {
+                y[j] -= shift->data[j];
+            }
+        }
+        mat_free(shift);
+    }
+    return Y;
+}
+
+/**
+ * @brief Q^T A for the implicitly centered A - 1 mean^T (mean may be NULL), without forming A^T.
+ */
+static Matrix *_times_left(Matrix *Q, Matrix *A, Matrix *mean)
+{
+    Matrix *Qt = mat_transpose(Q);
+    Matrix *B = mat_multmat(Qt, A); // l x n
+    if (mean != NULL)
+    {
+        for (long long p = 0; p < Qt->row; p++)
+        {
+            double q_sum = 0;
+            const double *q = mat_row(Qt, p);
+            for (long long i = 0; i < Qt->col; i++)
+            {
+                q_sum += q[i];
+            }
+            double *b = mat_row(B, p);
+            for (long long j = 0; j < B->col; j++)
+            {
+                b[j] -= q_sum * mean->data[j];
+            }
+        }
+    }
+    mat_free(Qt);
+    return B;
+}
+
+/**
+ * @brief One-sided Jacobi: rotate the rows of the square R until they are orthogonal,
+ * applying the same rotations to the rows of Z.
+ */
+static void _jacobi_rows(Matrix *R, Matrix *Z)
+{
+    long long l = R->row;
+    for (int sweep = 0; sweep < SVD_MAX_SWEEPS; sweep++)
+    {
+        bool rotated = false;
+        for (long long p = 0; p < l - 1; p++)
+        {
+            for (long long q = p + 1; q < l; q++)
+            {
+                double *r_p = mat_row(R, p);
+                double *r_q = mat_row(R, q);
+                double alpha = 0, beta = 0, gamma = 0;
+                for (long long j = 0; j < R->col; j++)
+                {
+                    alpha += r_p[j] * r_p[j];
+                    beta += r_q[j] * r_q[j];
+                    gamma += r_p[j] * r_q[j];
+                }
+                if (fabs(gamma) <= DBL_EPSILON * sqrt(alpha * beta))
+                {
+                    continue;
+                }
+                rotated = true;
+
+                double zeta = (beta - alpha) / (2 * gamma);
+                double t = copysign(1.0, zeta) / (fabs(zeta) + sqrt(1 + zeta * zeta));
+                double c = 1 / sqrt(1 + t * t);
+                double s = c * t;
+                Matrix *rows[2] = {R, Z};
+                for (int m = 0; m < 2; m++)
+                {
+                    double *x_p = mat_row(rows[m], p);
+                    double *x_q = mat_row(rows[m], q);
+                    for (long long j = 0; j < rows[m]->col; j++)
+                    {
+                        double x = x_p[j];
+                        x_p[j] = c * x - s * x_q[j];
+                        x_q[j] = s * x + c * x_q[j];
+                    }
+                }
+            }
+        }
+        if (!rotated)
+        {
+            break;
+        }
+    }
+}
+
+typedef struct
+{
+    double sigma;
+    long long index;
+} SingularValue;
+
+static int _cmp_singular(const void *a, const void *b)
+{
+    double x = ((const SingularValue *)a)->sigma;
+    double y = ((const SingularValue *)b)->sigma;
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Randomized SVD of A - 1 mean^T, see xmat_svd.
+ */
+static Matrix *_rsvd(Matrix *A, Matrix *mean, long long k, long long power_iters, Matrix **U, Matrix **V)
+{
+    long long m = A->row;
+    long long n = A->col;
+    long long rank = m < n ? m : n;
+    if (k <= 0 || k > rank)
+    {
+        fprintf(stderr, "SVD failed: Rank %lld is out of range for a %lld x %lld matrix.", k, m, n);
+        exit(1);
+    }
+    long long l = k + SVD_OVERSAMPLE < rank ? k + SVD_OVERSAMPLE : rank;
+
+    // Range finder: Q spans the dominant columns of A, refined by power iterations.
+    Matrix *omega = xmat_rand(n, l);
+    Matrix *Q = _orthonormalize(_times_right(A, mean, omega));
+    mat_free(omega);
+    for (long long it = 0; it < power_iters; it++)
+    {
+        Matrix *B = _times_left(Q, A, mean); // l x n
+        mat_free(Q);
+        Matrix *P = _orthonormalize(mat_transpose(B)); // n x l
+        mat_free(B);
+        Q = _orthonormalize(_times_right(A, mean, P));
+        mat_free(P);
+    }
+
+    // B = Q^T A = R2^T Q2^T from the QR of B^T, then the SVD of the small R2^T by Jacobi.
+    Matrix *B = _times_left(Q, A, mean);
+    Matrix *Bt = mat_transpose(B);
+    mat_free(B);
+    Matrix *tau;
+    Matrix *qr = xmat_qr(Bt, &tau);
+    mat_free(Bt);
+    Matrix *Q2 = xmat_qrQ(qr, tau); // n x l
+    Matrix *R2 = xmat_qrR(qr);      // l x l
+    mat_free(qr);
+    mat_free(tau);
+
+    // Rows of R2 are the columns of R2^T: rotating them to orthogonality gives
+    // R2^T = U_small S Z, with U_small S the rotated rows and Z the accumulated rotations.
+    Matrix *Z = xmat_identity(l);
+    _jacobi_rows(R2, Z);
+
+    SingularValue *order = malloc(l * sizeof(SingularValue));
+    for (long long p = 0; p < l; p++)
+    {
+        const double *r = mat_row(R2, p);
+        double norm = 0;
+        for (long long j = 0; j < l; j++)
+        {
+            norm += r[j] * r[j];
+        }
+        order[p].sigma = sqrt(norm);
+        order[p].index = p;
+    }
+    qsort(order, l, sizeof(SingularValue), _cmp_singular);
+
+    Matrix *S = mat_alloc(1, k);
+    Matrix *U_small_t = mat_alloc(k, l); // Rows are the leading left singular vectors of B.
+    Matrix *Z_top = mat_alloc(k, l);
+    for (long long p = 0; p < k; p++)
+    {
+        long long src = order[p].index;
+        double sigma = order[p].sigma;
+        S->data[p] = sigma;
+        const double *r = mat_row(R2, src);
+        double *u = mat_row(U_small_t, p);
+        for (long long j = 0; j < l; j++)
+        {
+            u[j] = sigma > 0 ? r[j] / sigma : 0;
+        }
+        memcpy(mat_row(Z_top, p), mat_row(Z, src), l * sizeof(double));
+    }
+    free(order);
+    mat_free(R2);
+    mat_free(Z);
+
+    if (U != NULL)
+    {
+        // U = Q U_small
+        Matrix *U_small = mat_transpose(U_small_t);
+        *U = mat_multmat(Q, U_small);
+        mat_free(U_small);
+    }
+    if (V != NULL)
+    {
+        // V = Q2 Z^T
+        Matrix *Zt = mat_transpose(Z_top);
+        *V = mat_multmat(Q2, Zt);
+        mat_free(Zt);
+    }
+
+    mat_free(U_small_t);
+    mat_free(Z_top);
+    mat_free(Q);
+    mat_free(Q2);
+    return S;
+}
+
+Matrix *xmat_svd(Matrix *A, long long k, long long power_iters, Matrix **U, Matrix **V)
+{
+    TRACE_BEGIN();
+    Matrix *S = _rsvd(A, NULL, k, power_iters, U, V);
+    long long l = k + SVD_OVERSAMPLE;
+    TRACE_END("xmat_svd", A->row, A->col, k, (2 + 2 * power_iters) * A->row * A->col * sizeof(double),
+              (4.0 + 4.0 * power_iters) * A->row * A->col * l);
+    return S;
+}
+
+Matrix *xmat_pca(Matrix *X, long long k, Matrix **components)
+{
+    TRACE_BEGIN();
+    // Column means; the data is centered implicitly inside the products.
+    Matrix *mean = xmat_zeros(1, X->col);
+    for (long long i = 0; i < X->row; i++)
+    {
+        const double *x = mat_row(X, i);
+        for (long long j = 0; j < X->col; j++)
+        {
+            mean->data[j] += x[j];
+        }
+    }
+    for (long long j = 0; j < X->col; j++)
+    {
+        mean->data[j] /= X->row;
+    }
+
+    Matrix *U;
+    Matrix *S = _rsvd(X, mean, k, 2, &U, components);
+
+    // Scores U S, the centered data projected onto the components.
+    for (long long i = 0; i < U->row; i++)
+    {
+        double *u = mat_row(U, i);
+        for (long long p = 0; p < k; p++)
+        {
+            u[p] *= S->data[p];
+        }
+    }
+
+    mat_free(S);
+    mat_free(mean);
+    TRACE_END("xmat_pca", X->row, X->col, k, 7 * X->row * X->col * sizeof(double),
+              12.0 * X->row * X->col * (k + SVD_OVERSAMPLE));
+    return U;
+}
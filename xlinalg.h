@@ -26,17 +26,27 @@ typedef Matrix *(*MatrixElementOperation)(Matrix *, long long, long long, va_lis
 typedef Matrix *(*MatrixPointwiseOperation)(Matrix *, Matrix *);
 
 /**
- * @brief Traverse a matrix and operate on single element.
+ * @brief Traverse a copy of a matrix and operate on single element. The input is unchanged.
  *
  * @param mat Matrix struct pointer.
- * @param row Matrix height, number of rows.
- * @param col Matrix width, number of columns.
  * @param operation Operation function pointer.
  * @param ... Dynamic arguments.
- * @return Matrix*
+ * @return Matrix* The traversed copy, to be freed by the caller.
  */
 Matrix *xmat_traverse(Matrix *mat, MatrixElementOperation operation, ...);
 
+/**
+ * @brief Traverse a matrix and operate on single element, in place.
+ *
+ * A matrix sharing its storage with copies gets a private copy first, so the copies are unchanged.
+ *
+ * @param mat Matrix struct pointer.
+ * @param operation Operation function pointer.
+ * @param ... Dynamic arguments.
+ * @return Matrix* The traversed matrix, mat itself.
+ */
+Matrix *xmat_traverseInPlace(Matrix *mat, MatrixElementOperation operation, ...);
+
 /**
  * @brief Generate a diagonal matrix.
  *
@@ -65,7 +75,7 @@ Matrix *xmat_zeros(long long row, long long col);
 Matrix *xmat_identity(long long size);
 
 /**
- * @brief Generate a random matrix.
+ * @brief Generate a random matrix, uniform in [-1, 1), seeded from rng_nextSeed.
  *
  * @param row Matrix height, number of rows.
  * @param col Matrix width, number of columns.
@@ -85,6 +95,28 @@ Matrix *xmat_rand(long long row, long long col);
  */
 Matrix *xmat_submat(Matrix *mat, long long i_st, long long i_ed, long long j_st, long long j_ed);
 
+/**
+ * @brief Concatenate matrices with the same number of rows horizontally, left to right.
+ *
+ * The result is allocated once and filled with a row copy per input row.
+ *
+ * @param mats Array of matrix struct pointers.
+ * @param count Number of matrices, at least 1.
+ * @return Matrix*
+ */
+Matrix *xmat_hconcat(Matrix **mats, long long count);
+
+/**
+ * @brief Concatenate matrices with the same number of columns vertically, top to bottom.
+ *
+ * The result is allocated once and filled with a block copy per contiguous input.
+ *
+ * @param mats Array of matrix struct pointers.
+ * @param count Number of matrices, at least 1.
+ * @return Matrix*
+ */
+Matrix *xmat_vconcat(Matrix **mats, long long count);
+
 /**
  * @brief Stack a left and right matrix horizontally.
  *
@@ -95,10 +127,10 @@ Matrix *xmat_submat(Matrix *mat, long long i_st, long long i_ed, long long j_st,
 Matrix *xmat_hstack(Matrix *mat_l, Matrix *mat_r);
 
 /**
- * @brief Horizontally repeat a matrix.
+ * @brief Horizontally repeat a matrix, in a single allocation.
  *
- * @param mat
- * @param n
+ * @param mat Matrix struct pointer.
+ * @param n Number of copies, at least 1.
  * @return Matrix*
  */
 Matrix *xmat_hrepeat(Matrix *mat, int n);
@@ -113,13 +145,14 @@ Matrix *xmat_hrepeat(Matrix *mat, int n);
 Matrix *xmat_vstack(Matrix *mat_u, Matrix *mat_d);
 
 /**
- * @brief Vertically repeate a matrix.
+ * @brief Vertically repeat a matrix, in a single allocation.
  *
- * @param mat
- * @param n
+ * To repeat a single row without copying it, use mat_broadcast.
+ *
+ * @param mat Matrix struct pointer.
+ * @param n Number of copies, at least 1.
  * @return Matrix*
  */
-
 Matrix *xmat_vrepeat(Matrix *mat, int n);
 
 /**
@@ -157,6 +190,97 @@ Matrix *xmat_readcol(Matrix *mat, long long j);
  */
 Matrix *xmat_solve(Matrix *A, Matrix *b);
 
+/**
+ * @brief Householder QR decomposition A = QR in compact form, blocked so that the trailing
+ * updates are matrix multiplications (compact WY representation).
+ *
+ * The returned m x n matrix holds R on and above the diagonal and the Householder vectors
+ * below it, see xmat_qrQ and xmat_qrR.
+ *
+ * @param A Matrix of size m x n.
+ * @param tau Output row matrix of size 1 x min(m, n), the scalar factors of the reflectors.
+ * @return Matrix*
+ */
+Matrix *xmat_qr(Matrix *A, Matrix **tau);
+
+/**
+ * @brief Thin orthogonal factor Q of a compact QR decomposition.
+ *
+ * @param qr Compact QR returned by xmat_qr, of size m x n.
+ * @param tau Reflector factors returned by xmat_qr.
+ * @return Matrix* Q of size m x min(m, n) with orthonormal columns.
+ */
+Matrix *xmat_qrQ(Matrix *qr, Matrix *tau);
+
+/**
+ * @brief Upper triangular factor R of a compact QR decomposition.
+ *
+ * @param qr Compact QR returned by xmat_qr, of size m x n.
+ * @return Matrix* R of size min(m, n) x n.
+ */
+Matrix *xmat_qrR(Matrix *qr);
+
+/**
+ * @brief Least squares solution of Ax=b, minimizing ||Ax - b||, through a QR decomposition
+ * of A (A^T A is never formed).
+ *
+ * @param A Matrix of size m x n with m >= n and full column rank.
+ * @param b Matrix of size m x p, one right hand side per column.
+ * @return Matrix* Solution of size n x p.
+ */
+Matrix *xmat_lstsq(Matrix *A, Matrix *b);
+
+/**
+ * @brief Linear operator y = A x on column matrices, used by the iterative solvers.
+ *
+ * x and y are n x 1 and preallocated by the solver, y is overwritten.
+ */
+typedef void (*MatrixLinearOperator)(Matrix *x, Matrix *y, void *ctx);
+
+/**
+ * @brief Convergence report of an iterative solver.
+ *
+ */
+typedef struct
+{
+    long long iterations; // Matrix-vector products after the initial residual.
+    double residual;      // Final ||b - Ax|| / ||b||.
+    bool converged;       // Whether residual <= tol was reached.
+} SolverStats;
+
+/**
+ * @brief Solve Ax=b for a symmetric positive definite A by conjugate gradients with a Jacobi
+ * (diagonal) preconditioner.
+ *
+ * @param A Symmetric positive definite matrix of size n x n.
+ * @param b Column matrix of size n x 1.
+ * @param x0 Initial guess of size n x 1, or NULL to start from 0.
+ * @param tol Relative residual ||b - Ax|| / ||b|| to stop at.
+ * @param max_iter Maximum number of iterations.
+ * @param stats Output convergence report, or NULL.
+ * @return Matrix* Solution of size n x 1.
+ */
+Matrix *xmat_cg(Matrix *A, Matrix *b, Matrix *x0, double tol, long long max_iter, SolverStats *stats);
+
+/**
+ * @brief Conjugate gradients on a matrix-free operator, see xmat_cg.
+ *
+ * Every iteration calls op once and otherwise only updates the preallocated work vectors,
+ * so op decides the cost (e.g. a sparse product for large systems).
+ *
+ * @param op Symmetric positive definite operator y = A x.
+ * @param ctx Passed to op.
+ * @param diag Diagonal of A of size n x 1 for Jacobi preconditioning, or NULL for none.
+ * @param b Column matrix of size n x 1.
+ * @param x0 Initial guess of size n x 1, or NULL to start from 0.
+ * @param tol Relative residual ||b - Ax|| / ||b|| to stop at.
+ * @param max_iter Maximum number of iterations.
+ * @param stats Output convergence report, or NULL.
+ * @return Matrix* Solution of size n x 1.
+ */
+Matrix *xmat_cgOperator(MatrixLinearOperator op, void *ctx, Matrix *diag, Matrix *b, Matrix *x0,
+                        double tol, long long max_iter, SolverStats *stats);
+
 /**
  * @brief Calculate the inverse of a matrix.
  *
@@ -166,7 +290,7 @@ Matrix *xmat_solve(Matrix *A, Matrix *b);
 Matrix *xmat_inv(Matrix *mat);
 
 /**
- * @brief Identify if two matrices are equal.
+ * @brief Identify if two matrices are equal, element by element.
  *
  * @param mat_1 First matrix struct pointer.
  * @param mat_2 Second matrix struct pointer.
@@ -174,6 +298,21 @@ Matrix *xmat_inv(Matrix *mat);
  */
 bool xmat_isEqual(Matrix *mat_1, Matrix *mat_2);
 
+/**
+ * @brief Identify if two matrices are equal within a tolerance.
+ *
+ * Elements x and y match when |x - y| <= atol + rtol * max(|x|, |y|); NaN never matches.
+ * The predicates below scan rows in blocks, allocate nothing and stop at the first block
+ * that does not match.
+ *
+ * @param mat_1 First matrix struct pointer.
+ * @param mat_2 Second matrix struct pointer.
+ * @param atol Absolute tolerance.
+ * @param rtol Relative tolerance.
+ * @return bool
+ */
+bool xmat_isEqualTol(Matrix *mat_1, Matrix *mat_2, double atol, double rtol);
+
 /**
  * @brief Identify if a matrix is a row matrix.
  *
@@ -206,6 +345,18 @@ bool xmat_isSquare(Matrix *mat);
  */
 bool xmat_isSymm(Matrix *mat);
 
+/**
+ * @brief Identify if a matrix is symmetric within a tolerance, compared as in xmat_isEqualTol.
+ *
+ * Tiles above the diagonal are compared with their mirrors in place, without a transpose.
+ *
+ * @param mat Matrix struct pointer.
+ * @param atol Absolute tolerance.
+ * @param rtol Relative tolerance.
+ * @return bool
+ */
+bool xmat_isSymmTol(Matrix *mat, double atol, double rtol);
+
 /**
  * @brief Identify if a matrix is orthogonal.
  *
@@ -214,6 +365,19 @@ bool xmat_isSymm(Matrix *mat);
  */
 bool xmat_isOrth(Matrix *mat);
 
+/**
+ * @brief Identify if a square matrix is orthogonal, with every element of A A^T within tol
+ * of the identity.
+ *
+ * Row norms are checked first, then A A^T is formed a tile at a time, on the thread pool for
+ * large matrices, and the check stops at the first tile off the identity. Nothing is allocated.
+ *
+ * @param mat Matrix struct pointer.
+ * @param tol Absolute tolerance.
+ * @return bool
+ */
+bool xmat_isOrthTol(Matrix *mat, double tol);
+
 /**
  * @brief Identify if a matrix is all 0;
  * 
@@ -222,6 +386,52 @@ bool xmat_isOrth(Matrix *mat);
  */
 bool xmat_isZero(Matrix *mat);
 
+/**
+ * @brief Identify if every element of a matrix is within tol of 0.
+ *
+ * @param mat Matrix struct pointer.
+ * @param tol Absolute tolerance.
+ * @return bool
+ */
+bool xmat_isZeroTol(Matrix *mat, double tol);
+
+/**
+ * @brief Identify if a matrix is upper or lower triangular (trapezoidal when not square).
+ *
+ * @param mat Matrix struct pointer.
+ * @param upper true for upper triangular, 0 below the diagonal; false for lower triangular.
+ * @return bool
+ */
+bool xmat_isTriangular(Matrix *mat, bool upper);
+
+/**
+ * @brief Identify if a matrix is triangular, with the elements on the other side of the
+ * diagonal within tol of 0.
+ *
+ * @param mat Matrix struct pointer.
+ * @param upper true for upper triangular, false for lower triangular.
+ * @param tol Absolute tolerance.
+ * @return bool
+ */
+bool xmat_isTriangularTol(Matrix *mat, bool upper, double tol);
+
+/**
+ * @brief Identify if a matrix is diagonal, 0 off the main diagonal.
+ *
+ * @param mat Matrix struct pointer.
+ * @return bool
+ */
+bool xmat_isDiagonal(Matrix *mat);
+
+/**
+ * @brief Identify if a matrix is diagonal, with the elements off the main diagonal within tol of 0.
+ *
+ * @param mat Matrix struct pointer.
+ * @param tol Absolute tolerance.
+ * @return bool
+ */
+bool xmat_isDiagonalTol(Matrix *mat, double tol);
+
 /**
  * @brief Element mean of a matrix.
  * 
@@ -266,4 +476,32 @@ double xmat_norm(Matrix *mat, long long l);
  */
 double xmat_cossim(Matrix *mat_1, Matrix *mat_2);
 
+/**
+ * @brief Truncated singular value decomposition A ~ U diag(S) V^T by randomized range finding.
+ *
+ * A is sketched by a random matrix with a few more columns than k, the sketch refined by power
+ * iterations and orthonormalized by QR, and A projected onto it is decomposed by a small dense
+ * SVD. Costs O(mnk) through matrix multiplications, A^T is never formed.
+ *
+ * @param A Matrix of size m x n.
+ * @param k Number of singular values, at most min(m, n).
+ * @param power_iters Power iterations, 1 or 2 sharpen slowly decaying spectra.
+ * @param U Output left singular vectors of size m x k, or NULL.
+ * @param V Output right singular vectors of size n x k, or NULL.
+ * @return Matrix* Row matrix of size 1 x k, singular values in descending order.
+ */
+Matrix *xmat_svd(Matrix *A, long long k, long long power_iters, Matrix **U, Matrix **V);
+
+/**
+ * @brief Principal component analysis, projecting samples onto their top k components.
+ *
+ * Columns are centered implicitly, X is neither copied nor modified.
+ *
+ * @param X Data matrix of size m x n, one sample per row.
+ * @param k Number of components.
+ * @param components Output principal axes of size n x k, one per column, or NULL.
+ * @return Matrix* Projected data of size m x k.
+ */
+Matrix *xmat_pca(Matrix *X, long long k, Matrix **components);
+
 #endif
\ No newline at end of file
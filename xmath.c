@@ -0,0 +1,329 @@
+/**
+ * @file xmath.c
+ * @author Huang Yanzhen (yanzhenhuangwork@gmail.com)
+ * @brief Fast polynomial approximations of transcendental functions.
+ * @version 0.1
+ * @date 2024-12-25
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+// The kernels are written with selects only. GCC if-converts and vectorizes them once
+// comparisons are known not to trap.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("no-trapping-math", "tree-vectorize")
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "xmath.h"
+#include "cpu.h"
+
+// 1.5 * 2^52. Adding it to a double rounds to an integer held in the low mantissa bits.
+#define XM_SHIFTER 6755399441055744.0
+#define XM_LOG2E 1.44269504088896338700e+00
+#define XM_LN2_HI 6.93147180369123816490e-01
+#define XM_LN2_LO 1.90821492927058770002e-10
+#define XM_SQRT2 1.41421356237309514547e+00
+#define XM_EXP_MAX 709.782712893383973096
+#define XM_EXP_MIN -745.133219101941108420
+
+static XMathAccuracy accuracy_tier = XMATH_FAST;
+
+void xmath_setAccuracy(XMathAccuracy accuracy)
+{
+    accuracy_tier = accuracy;
+}
+
+XMathAccuracy xmath_getAccuracy(void)
+{
+    return accuracy_tier;
+}
+
+static inline uint64_t _bits(double x)
+{
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static inline double _from_bits(uint64_t u)
+{
+    double x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+/**
+ * @brief 2^k for an integral double k in [-1022, 1023], without int conversions.
+ */
+static inline double _pow2(double k)
+{
+    return _from_bits((_bits(k + XM_SHIFTER) + 1023) << 52);
+}
+
+/**
+ * @brief exp(x) = 2^k * e^r with |r| <= ln(2) / 2.
+ *
+ * 2^k is applied as two factors so that results down to the subnormal range stay exact.
+ * Every step is a select, so loops over this function vectorize.
+ */
+static inline double _exp(double x, int fastest)
+{
+    double xc = x > XM_EXP_MAX ? XM_EXP_MAX : x;
+    xc = xc < XM_EXP_MIN ? XM_EXP_MIN : xc;
+
+    double k = (xc * XM_LOG2E + XM_SHIFTER) - XM_SHIFTER;
+    double r = (xc - k * XM_LN2_HI) - k * XM_LN2_LO;
+
+    double p;
+    if (fastest)
+    {
+        // Taylor series to degree 7, truncation error below 1e-8.
+        p = 1.0 / 5040;
+        p = p * r + 1.0 / 720;
+        p = p * r + 1.0 / 120;
+        p = p * r + 1.0 / 24;
+        p = p * r + 1.0 / 6;
+        p = p * r + 0.5;
+        p = p * r + 1.0;
+        p = p * r + 1.0;
+    }
+    else
+    {
+        // Taylor series to degree 13, truncation error below 1e-17.
+        p = 1.0 / 6227020800;
+        p = p * r + 1.0 / 479001600;
+        p = p * r + 1.0 / 39916800;
+        p = p * r + 1.0 / 3628800;
+        p = p * r + 1.0 / 362880;
+        p = p * r + 1.0 / 40320;
+        p = p * r + 1.0 / 5040;
+        p = p * r + 1.0 / 720;
+        p = p * r + 1.0 / 120;
+        p = p * r + 1.0 / 24;
+        p = p * r + 1.0 / 6;
+        p = p * r + 0.5;
+        p = p * r + 1.0;
+        p = p * r + 1.0;
+    }
+
+    double k1 = (k * 0.5 + XM_SHIFTER) - XM_SHIFTER;
+    double k2 = k - k1;
+    double y = p * _pow2(k1) * _pow2(k2);
+
+    y = x > XM_EXP_MAX ? INFINITY : y;
+    y = x < XM_EXP_MIN ? 0.0 : y;
+    return x != x ? x : y;
+}
+
+/**
+ * @brief log(x) = e * ln(2) + log(m) with m in [sqrt(2)/2, sqrt(2)).
+ *
+ * log(m) = 2 * atanh(s) with s = (m - 1) / (m + 1), |s| <= 0.1716.
+ */
+static inline double _log(double x, int fastest)
+{
+    // Scale subnormals into the normal range.
+    int subnormal = x < 2.2250738585072014e-308;
+    double xs = subnormal ? x * 18014398509481984.0 : x; // 2^54
+
+    uint64_t u = _bits(xs);
+    double e = _from_bits(0x4330000000000000ULL | (u >> 52)) - 4503599627370496.0 - 1023.0;
+    e = subnormal ? e - 54 : e;
+    double m = _from_bits((u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+
+    int high = m > XM_SQRT2;
+    m = high ? m * 0.5 : m;
+    e = high ? e + 1 : e;
+
+    double f = m - 1.0;
+    double s = f / (2.0 + f);
+    double z = s * s;
+
+    double p;
+    if (fastest)
+    {
+        p = 1.0 / 9;
+        p = p * z + 1.0 / 7;
+        p = p * z + 1.0 / 5;
+        p = p * z + 1.0 / 3;
+    }
+    else
+    {
+        p = 1.0 / 21;
+        p = p * z + 1.0 / 19;
+        p = p * z + 1.0 / 17;
+        p = p * z + 1.0 / 15;
+        p = p * z + 1.0 / 13;
+        p = p * z + 1.0 / 11;
+        p = p * z + 1.0 / 9;
+        p = p * z + 1.0 / 7;
+        p = p * z + 1.0 / 5;
+        p = p * z + 1.0 / 3;
+    }
+
+    // 2s = f - s * f keeps the leading term exact for m close to 1.
+    double log_m = (f - s * f) + 2.0 * s * z * p;
+    double y = e * XM_LN2_HI + (log_m + e * XM_LN2_LO);
+
+    y = x == INFINITY ? x : y;
+    y = x == 0 ? -INFINITY : y;
+    y = x < 0 ? NAN : y;
+    return x != x ? x : y;
+}
+
+static inline double _tanh(double x, int fastest)
+{
+    double ax = fabs(x);
+    double e = _exp(2.0 * ax, fastest);
+    double big = 1.0 - 2.0 / (e + 1.0);
+    big = x < 0 ? -big : big;
+
+    if (fastest)
+    {
+        return big;
+    }
+
+    // Rational approximation for |x| < 0.625, where 1 - 2 / (e + 1) cancels.
+    double z = x * x;
+    double num = (-9.64399179425052238628e-1 * z - 9.92877231001918586564e1) * z - 1.61468768441708447952e3;
+    double den = ((z + 1.12811678491632931402e2) * z + 2.23548839060100448583e3) * z + 4.84406305325125486048e3;
+    double small = x + x * z * num / den;
+
+    return ax < 0.625 ? small : big;
+}
+
+// e^x / (1 + e^x) for negative x, so that the result reaches the subnormal range instead of
+// flushing to 0 once e^-x overflows.
+static inline double _sigmoid(double x, int fastest)
+{
+    double e = _exp(-fabs(x), fastest);
+    return (x < 0 ? e : 1.0) / (1.0 + e);
+}
+
+double xmath_exp(double x)
+{
+    return accuracy_tier == XMATH_EXACT ? exp(x) : _exp(x, accuracy_tier == XMATH_FASTEST);
+}
+
+double xmath_log(double x)
+{
+    return accuracy_tier == XMATH_EXACT ? log(x) : _log(x, accuracy_tier == XMATH_FASTEST);
+}
+
+double xmath_tanh(double x)
+{
+    return accuracy_tier == XMATH_EXACT ? tanh(x) : _tanh(x, accuracy_tier == XMATH_FASTEST);
+}
+
+double xmath_sigmoid(double x)
+{
+    return accuracy_tier == XMATH_EXACT ? 1.0 / (1.0 + exp(-x)) : _sigmoid(x, accuracy_tier == XMATH_FASTEST);
+}
+
+// The tier is resolved once per call so that the inner loops stay branch-free.
+#define XMATH_VECTORIZE(dst, src, n, fn, libm_expr)  \
+    switch (accuracy_tier)                           \
+    {                                                \
+    case XMATH_EXACT:                                \
+        for (long long i = 0; i < (n); i++)          \
+        {                                            \
+            double x = (src)[i];                     \
+            (dst)[i] = (libm_expr);                  \
+        }                                            \
+        break;                                       \
+    case XMATH_FAST:                                 \
+        for (long long i = 0; i < (n); i++)          \
+        {                                            \
+            (dst)[i] = fn((src)[i], 0);              \
+        }                                            \
+        break;                                       \
+    default:                                         \
+        for (long long i = 0; i < (n); i++)          \
+        {                                            \
+            (dst)[i] = fn((src)[i], 1);              \
+        }                                            \
+        break;                                       \
+    }
+
+// Array functions of one instruction set. The scalar kernels above are inlined into them
+// and vectorized for the target in effect.
+#define XMATH_ARRAY_FUNCTIONS(suffix)                                               \
+    static void _vexp_##suffix(double *dst, const double *src, long long n)         \
+    {                                                                               \
+        XMATH_VECTORIZE(dst, src, n, _exp, exp(x));                                 \
+    }                                                                               \
+    static void _vlog_##suffix(double *dst, const double *src, long long n)         \
+    {                                                                               \
+        XMATH_VECTORIZE(dst, src, n, _log, log(x));                                 \
+    }                                                                               \
+    static void _vtanh_##suffix(double *dst, const double *src, long long n)        \
+    {                                                                               \
+        XMATH_VECTORIZE(dst, src, n, _tanh, tanh(x));                               \
+    }                                                                               \
+    static void _vsigmoid_##suffix(double *dst, const double *src, long long n)     \
+    {                                                                               \
+        XMATH_VECTORIZE(dst, src, n, _sigmoid, 1.0 / (1.0 + exp(-x)));              \
+    }
+
+typedef void (*XMathArrayFunction)(double *dst, const double *src, long long n);
+
+XMATH_ARRAY_FUNCTIONS(scalar)
+
+#ifdef CPU_DISPATCH
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+XMATH_ARRAY_FUNCTIONS(sse2)
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+XMATH_ARRAY_FUNCTIONS(avx2)
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+XMATH_ARRAY_FUNCTIONS(avx512)
+#pragma GCC pop_options
+
+#define XMATH_VARIANTS(name) {name##_scalar, name##_sse2, name##_avx2, name##_avx512}
+
+#else
+
+#define XMATH_VARIANTS(name) {name##_scalar}
+
+#endif
+
+static const XMathArrayFunction vexp_variants[CPU_ISA_COUNT] = XMATH_VARIANTS(_vexp);
+static const XMathArrayFunction vlog_variants[CPU_ISA_COUNT] = XMATH_VARIANTS(_vlog);
+static const XMathArrayFunction vtanh_variants[CPU_ISA_COUNT] = XMATH_VARIANTS(_vtanh);
+static const XMathArrayFunction vsigmoid_variants[CPU_ISA_COUNT] = XMATH_VARIANTS(_vsigmoid);
+
+void xmath_vexp(double *dst, const double *src, long long n)
+{
+    vexp_variants[cpu_isa()](dst, src, n);
+}
+
+void xmath_vlog(double *dst, const double *src, long long n)
+{
+    vlog_variants[cpu_isa()](dst, src, n);
+}
+
+void xmath_vlogScalar(double *dst, const double *src, long long n)
+{
+    vlog_variants[CPU_ISA_SCALAR](dst, src, n);
+}
+
+void xmath_vtanh(double *dst, const double *src, long long n)
+{
+    vtanh_variants[cpu_isa()](dst, src, n);
+}
+
+void xmath_vsigmoid(double *dst, const double *src, long long n)
+{
+    vsigmoid_variants[cpu_isa()](dst, src, n);
+}